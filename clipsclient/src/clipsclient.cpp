@@ -1,17 +1,106 @@
 #include "clipsclient.h"
 #include "request.h"
 #include "reply.h"
+#include "shm.h"
 
-#include <regex>
+#include <cstring>
 #include <boost/bind/bind.hpp>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 
 namespace asio = boost::asio;
 using asio::ip::tcp;
 
 
+/**
+ * Validates the arguments of a command and encodes them
+ * either as text or in binary form (see protocol::Opcode)
+ */
+typedef bool (*ArgEncoder)(const std::string& args, bool binary, std::string& encoded);
+
+static bool encode_none(const std::string& /*args*/, bool /*binary*/, std::string& encoded){
+	encoded.clear();
+	return true;
+}
+
+static bool encode_text(const std::string& args, bool /*binary*/, std::string& encoded){
+	if( args.empty() ) return false;
+	encoded = args;
+	return true;
+}
+
+static bool encode_optional_text(const std::string& args, bool /*binary*/, std::string& encoded){
+	encoded = args;
+	return true;
+}
+
+static bool encode_int(const std::string& args, bool binary, std::string& encoded){
+	// An optional sign followed by up to 9 digits. Defaults to -1.
+	int32_t n = -1;
+	if( !args.empty() ){
+		size_t i = (args[0] == '-') ? 1 : 0;
+		if( (args.length() <= i) || (args.length() - i > 9) ) return false;
+		n = 0;
+		for(size_t j = i; j < args.length(); ++j){
+			if( (args[j] < '0') || (args[j] > '9') ) return false;
+			n = 10*n + (args[j] - '0');
+		}
+		if(i) n = -n;
+	}
+	if(binary) encoded.assign( (const char*)&n, sizeof(n) );
+	else encoded = std::to_string(n);
+	return true;
+}
+
+static bool encode_command_id(const std::string& args, bool binary, std::string& encoded){
+	// Optional. No id halts whichever command of the client is running.
+	uint32_t cmdId;
+	if( args.empty() ) encoded.clear();
+	else if( !protocol::decodeCommandId(args, false, cmdId) ) return false;
+	else if(binary) encoded.assign( (const char*)&cmdId, sizeof(cmdId) );
+	else encoded = args;
+	return true;
+}
+
+template<class E, const char* (*nameOf)(E)>
+static bool encode_item(const std::string& args, bool binary, std::string& encoded){
+	E item = protocol::findByName<E>(args.c_str(), args.length(), nameOf);
+	if(item == E::None) return false;
+	if(binary) encoded.assign(1, (char)item);
+	else encoded = args;
+	return true;
+}
+
+/**
+ * Argument encoders indexed by opcode
+ */
+static const ArgEncoder encoders[(size_t)protocol::Opcode::Count] = {
+	/* None   */ nullptr,
+	/* Assert */ encode_text,
+	/* Reset  */ encode_none,
+	/* Clear  */ encode_none,
+	/* Query  */ encode_text,
+	/* Raw    */ encode_text,
+	/* Path   */ encode_text,
+	/* Print  */ encode_item<protocol::PrintItem, protocol::printItemName>,
+	/* Watch  */ encode_item<protocol::WatchItem, protocol::watchItemName>,
+	/* Load   */ encode_text,
+	/* Run    */ encode_int,
+	/* Log    */ encode_optional_text,
+	/* Fresh  */ encode_none,
+	/* Stats  */ encode_optional_text,
+	/* AssertBatch */ encode_text,
+	/* Stream */ encode_text,
+	/* Cancel */ encode_command_id,
+};
+
+
 ClipsClient::ClipsClient(const Private&) :
-	is(&buffer), clipsStatus(NULL){}
+	rxLargeReceived(0), shmSegment(NULL), shmSize(0), shmRingSize(0),
+	serverProtocol(1), clipsStatus(NULL){}
 
 
 
@@ -32,14 +121,74 @@ ClipsClientPtr ClipsClient::create(){
 
 bool ClipsClient::connect(const std::string& address, uint16_t port){
 	if(socketPtr) return false;
-	tcp::endpoint remote_endpoint{boost::asio::ip::address::from_string(address), port};
-	socketPtr = std::make_shared<boost::asio::ip::tcp::socket>(io_service);
+	try{
+		tcp::endpoint remote_endpoint{boost::asio::ip::address::from_string(address), port};
+		return connect(remote_endpoint);
+	}
+	catch(...){ return false; }
+}
+
+
+bool ClipsClient::connectLocal(const std::string& path){
+	if(socketPtr) return false;
+	try{
+		asio::local::stream_protocol::endpoint remote_endpoint(path);
+		return connect(remote_endpoint);
+	}
+	catch(...){ return false; }
+}
+
+
+bool ClipsClient::connectShm(const std::string& path, size_t ringSize){
+	static std::atomic<uint32_t> lastSegmentId(0);
+	size_t size = 2;
+	while(size < ringSize) size<<= 1;
+	if( !connectLocal(path) ) return false;
+
+	// The segment is created here and mapped by the server, which is
+	// told its name through the socket
+	std::string name = shm::NamePrefix + std::to_string(getpid()) + "." + std::to_string(++lastSegmentId);
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	void* addr = MAP_FAILED;
+	if(fd >= 0){
+		if( !ftruncate(fd, shm::Segment::size(size)) )
+			addr = mmap(NULL, shm::Segment::size(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+	}
+	if(addr == MAP_FAILED){
+		if(fd >= 0) shm_unlink(name.c_str());
+		disconnect();
+		return false;
+	}
+	shm::Segment* segment = static_cast<shm::Segment*>(addr);
+	segment->init(size);
+
+	std::string result;
+	bool success = rpc("shm", name, result);
+	shm_unlink( name.c_str() );
+	if(!success){
+		munmap(addr, shm::Segment::size(size));
+		disconnect();
+		return false;
+	}
+	shmSize = shm::Segment::size(size);
+	shmRingSize = size;
+	shmSegment = segment;
+	shmThreadPtr = std::make_shared<boost::thread>( [this](){ this->shmReceive(); } );
+	return true;
+}
+
+
+bool ClipsClient::connect(const asio::generic::stream_protocol::endpoint& remote_endpoint){
+	socketPtr = std::make_shared<asio::generic::stream_protocol::socket>(io_service);
 	try{
 		socketPtr->connect(remote_endpoint);
 	}
 	catch(...){
 		// fprintf(stderr, "Could not connect to CLIPS on %s:%u.\n", address.c_str(), port);
 		// fprintf(stderr, "Run the server and pass the right parameters.\n");
+		// Allow retrying
+		socketPtr = NULL;
 		return false;
 	}
 
@@ -50,14 +199,41 @@ bool ClipsClient::connect(const std::string& address, uint16_t port){
 				this->io_service.run();
 			}
 	));
+	negotiateProtocol();
 	onConnected();
 	return true;
 }
 
 
+void ClipsClient::negotiateProtocol(){
+	// Servers that predate protocol 2 reject the proto command
+	std::string result;
+	serverProtocol = 1;
+	if( !rpc("proto", std::to_string(protocol::Version), result) ) return;
+	try{ serverProtocol = std::stoul(result); }
+	catch(...){}
+}
+
+
+uint32_t ClipsClient::getProtocolVersion() const{
+	return serverProtocol;
+}
+
+
 
 void ClipsClient::disconnect(){
 	abortAllRPC();
+	if(shmSegment){
+		shmSegment->closed.store(1, std::memory_order_release);
+		shmSegment->serverEvent.signal();
+		shmSegment->clientEvent.signal();
+		if(shmThreadPtr) shmThreadPtr->join();
+		shmThreadPtr = NULL;
+		// Senders waiting for room see the channel closed and return
+		std::lock_guard<std::mutex> lock(sendMutex);
+		munmap(shmSegment, shmSize);
+		shmSegment = NULL;
+	}
 	if(serviceThreadPtr){
 		io_service.stop();
 		serviceThreadPtr->join();
@@ -69,21 +245,44 @@ void ClipsClient::disconnect(){
 
 void ClipsClient::loadFile(const std::string& file){
 	// sendRaw( "(load " + file + ")" );
-	rpc("load", file);
+	std::string result;
+	command(protocol::Opcode::Load, file, result);
 }
 
 
 
 void ClipsClient::reset(){
 	// sendRaw("(reset)");
-	rpc("reset");
+	std::string result;
+	command(protocol::Opcode::Reset, "", result);
 }
 
 
 
 void ClipsClient::clear(){
 	// sendRaw("(clear)");
-	rpc("clear");
+	std::string result;
+	command(protocol::Opcode::Clear, "", result);
+}
+
+
+
+bool ClipsClient::fresh(){
+	std::string result;
+	return command(protocol::Opcode::Fresh, "", result);
+}
+
+
+
+bool ClipsClient::getStats(std::string& report){
+	return command(protocol::Opcode::Stats, "", report);
+}
+
+
+
+bool ClipsClient::subscribeStats(bool subscribe){
+	std::string result;
+	return command(protocol::Opcode::Stats, subscribe ? "subscribe" : "unsubscribe", result);
 }
 
 
@@ -91,25 +290,61 @@ void ClipsClient::clear(){
 void ClipsClient::run(int32_t n){
 	if( n < -1 ) n = -1;
 	// sendRaw( "(run "+ std::to_string(n) +")" );
-	rpc("run", std::to_string(n));
+	std::string result;
+	command(protocol::Opcode::Run, std::to_string(n), result);
 }
 
 
 
 void ClipsClient::assertFact(const std::string& fact){
-	rpc("assert", fact);
+	std::string result;
+	command(protocol::Opcode::Assert, fact, result);
+}
+
+
+
+size_t ClipsClient::assertFacts(const std::vector<std::string>& facts, int& failed){
+	failed = -1;
+	if( facts.empty() ) return 0;
+	size_t length = 0;
+	for(const std::string& fact : facts)
+		length+= fact.length() + 1;
+	std::string batch;
+	batch.reserve(length);
+	for(const std::string& fact : facts){
+		if( !batch.empty() ) batch+= ' ';
+		batch+= fact;
+	}
+
+	// The result is "asserted failed". Without it nothing was asserted.
+	std::string result;
+	failed = 0;
+	command(protocol::Opcode::AssertBatch, batch, result);
+	char* end;
+	size_t asserted = std::strtoul(result.c_str(), &end, 10);
+	if( end != result.c_str() ) failed = std::strtol(end, NULL, 10);
+	return asserted;
+}
+
+
+
+size_t ClipsClient::assertFacts(const std::vector<std::string>& facts){
+	int failed;
+	return assertFacts(facts, failed);
 }
 
 
 
 void ClipsClient::retractFact(const std::string& fact){
-	rpc("raw", "(retract " + fact + ")" );
+	std::string result;
+	command(protocol::Opcode::Raw, "(retract " + fact + ")", result);
 }
 
 
 
 bool ClipsClient::setPath(const std::string& path){
-	return rpc("path", path);
+	std::string result;
+	return command(protocol::Opcode::Path, path, result);
 }
 
 	/**
@@ -119,68 +354,163 @@ bool ClipsClient::setPath(const std::string& path){
 	 * 		raw      Injects the string in CLIPS language contained in args
 	 * 		path     Sets the working path of CLIPSServer
 	 * 		load     Loads the CLP or DAT file specidied in args
-	 * 		log      Sets the log level of CLIPSServer
+	 * 		log      Sets the log level of CLIPSServer ([category] level)
+	 * 		stream   Performs the query given in args (see streamQuery())
+	 * 		cancel   Halts the command whose id is given in args (see cancel())
 	 *
 	 * @param  cmd  The command to execute
 	 * @param  args The command to execute
 	 * @return      true if the command was successfully executed, false otherwise
 	 */
 bool ClipsClient::execute(const std::string& cmd, const std::string& args){
-	static std::regex rxInt("-?\\d{1,9}");
-	static std::regex rxPrint("facts|rules|agenda");
-	static std::regex rxWatch("functions|globals|facts|rules");
-	std::smatch match;
-
-	if(cmd == "reset") return rpc(cmd);
-	else if(cmd == "clear") return rpc(cmd);
-	else if(cmd == "run") {
-		if( args.empty() ) return rpc(cmd, "-1");
-		if( std::regex_match(args, match, rxInt) ) return rpc(cmd, args);
-		return false;
-	}
-	else if(cmd == "print")  return std::regex_match(args, match, rxPrint) ? rpc(cmd, args) : false;
-	else if(cmd == "watch")  return std::regex_match(args, match, rxWatch) ? rpc(cmd, args) : false;
-	else if(cmd == "assert") return !args.empty() ? rpc(cmd, args) : false;
-	else if(cmd == "raw")    return !args.empty() ? rpc(cmd, args) : false;
-	else if(cmd == "path")   return !args.empty() ? rpc(cmd, args) : false;
-	else if(cmd == "load")   return !args.empty() ? rpc(cmd, args) : false;
-	else if(cmd == "log")    return !args.empty() ? rpc(cmd, args) : false;
-	return false;
+	std::string result;
+	return command(protocol::findOpcode(cmd.c_str(), cmd.length()), args, result);
+}
+
+
+bool ClipsClient::beginExecute(const std::string& cmd, const std::string& args, uint32_t& cmdId){
+	RequestPtr rq = makeRequest(protocol::findOpcode(cmd.c_str(), cmd.length()), args);
+	if( !rq || !beginRpc(*rq) ) return false;
+	cmdId = rq->getCommandId();
+	return true;
+}
+
+
+bool ClipsClient::endExecute(uint32_t cmdId, std::string& result){
+	bool success = false;
+	if( !awaitResponse(cmdId, success, result) ) return false;
+	return success;
+}
+
+
+bool ClipsClient::endExecute(uint32_t cmdId){
+	std::string result;
+	return endExecute(cmdId, result);
+}
+
+
+bool ClipsClient::command(protocol::Opcode opcode, const std::string& args, std::string& result){
+	RequestPtr rq = makeRequest(opcode, args);
+	return rq ? rpc(*rq, result) : false;
+}
+
+
+RequestPtr ClipsClient::makeRequest(protocol::Opcode opcode, const std::string& args){
+	if( (opcode == protocol::Opcode::None) || (opcode >= protocol::Opcode::Count) )
+		return NULL;
+	bool binary = serverProtocol >= protocol::BinaryCommandsVersion;
+	std::string encoded;
+	if( !encoders[(size_t)opcode](args, binary, encoded) ) return NULL;
+	if(binary) return Request::make_shared(opcode, encoded);
+	return Request::make_shared(protocol::opcodeName(opcode), encoded);
 }
 
 
 bool ClipsClient::query(const std::string& query, std::string& result){
-	return rpc("query", query, result);
+	return command(protocol::Opcode::Query, query, result);
+}
+
+
+bool ClipsClient::streamQuery(const std::string& query, std::function<void(const std::string&)> handler, int& steps){
+	steps = 0;
+	RequestPtr rq = makeRequest(protocol::Opcode::Stream, query);
+	if(!rq) return false;
+	// Output arrives before the response, so the handler is set beforehand
+	uint32_t cmdId = rq->getCommandId();
+	{std::lock_guard<std::mutex> lock(pcmutex);
+		streamHandlers[cmdId] = handler;
+	}
+	std::string result;
+	bool success = rpc(*rq, result);
+	{std::lock_guard<std::mutex> lock(pcmutex);
+		streamHandlers.erase(cmdId);
+	}
+	// The result is the number of rules fired
+	if(success) steps = std::strtol(result.c_str(), NULL, 10);
+	return success;
+}
+
+
+bool ClipsClient::cancel(int& fired, uint32_t cmdId){
+	fired = 0;
+	std::string result;
+	if( !command(protocol::Opcode::Cancel, cmdId ? std::to_string(cmdId) : "", result) )
+		return false;
+	// The result is the number of rules fired by the halted command
+	fired = std::strtol(result.c_str(), NULL, 10);
+	return true;
 }
 
 
 uint32_t ClipsClient::getWatches(){
-	rpc("watch");
+	// Watch without arguments only publishes the status
+	std::string result;
+	if(serverProtocol >= protocol::BinaryCommandsVersion)
+		rpc( Request(protocol::Opcode::Watch), result );
+	else rpc("watch");
 	return clipsStatus ? clipsStatus->getWatches() : -1;
 }
 
 
 uint32_t ClipsClient::toggleWatch(const std::string& watch){
-	if( (watch == "functions") || (watch == "globals") || (watch == "facts") || (watch == "rules") )
-		rpc("watch", watch);
+	std::string result;
+	command(protocol::Opcode::Watch, watch, result);
 	return clipsStatus ? clipsStatus->getWatches() : -1;
 }
 
 
 bool ClipsClient::send(const std::string& s){
+	if(shmSegment) return shmSend( s.data(), s.length() );
 	if(!socketPtr || !socketPtr->is_open() ) return false;
-	socketPtr->send( asio::buffer(s) );
+	std::lock_guard<std::mutex> lock(sendMutex);
+	asio::write( *socketPtr, asio::buffer(s) );
 	return true;
 }
 
 
 bool ClipsClient::sendCommand(const std::string& command, const std::string& args, uint32_t& cmdId){
-	if(!socketPtr || !socketPtr->is_open() ) return false;
-
 	Request rq(command, args);
 	cmdId = rq.getCommandId();
-	socketPtr->send( asio::buffer(rq.getPayload()) );
+	return sendRequest(rq);
+}
 
+
+bool ClipsClient::sendRequest(const Request& rq){
+	if(!socketPtr || !socketPtr->is_open() ) return false;
+	std::vector<char> payload = rq.getPayload();
+	if( payload.empty() ){
+		fprintf(stderr, "Request too large: payload exceeds %lu bytes\n", protocol::MaxPayload);
+		return false;
+	}
+	if( (payload.size() > 0xffff) && (serverProtocol < 2) ){
+		fprintf(stderr, "Request too large: server does not support extended frames\n");
+		return false;
+	}
+	if(shmSegment) return shmSend( payload.data(), payload.size() );
+	std::lock_guard<std::mutex> lock(sendMutex);
+	asio::write( *socketPtr, asio::buffer(payload) );
+	return true;
+}
+
+
+bool ClipsClient::shmSend(const char* data, size_t length){
+	std::lock_guard<std::mutex> lock(sendMutex);
+	if(!shmSegment) return false;
+	shm::Segment& seg = *shmSegment;
+	shm::RingView ring = seg.serverRing(shmRingSize);
+	while(length > 0){
+		if( seg.closed.load(std::memory_order_acquire) ) return false;
+		uint32_t observed = seg.clientEvent.prepare();
+		size_t written = ring.write(data, length);
+		if(written > 0){
+			data+= written;
+			length-= written;
+			seg.serverEvent.signal();
+			continue;
+		}
+		// The ring is full. The server signals when it reads.
+		seg.clientEvent.wait(observed, 100);
+	}
 	return true;
 }
 
@@ -210,14 +540,32 @@ bool ClipsClient::hasReponseArrived(uint32_t cmdId, bool& aborted){
 
 
 bool ClipsClient::rpc(const std::string& cmd, const std::string& args, std::string& result){
-	uint32_t cmdId = 0;
+	return rpc( Request(cmd, args), result );
+}
+
+
+bool ClipsClient::rpc(const Request& rq, std::string& result){
 	bool success = false;
-	if( !sendCommand(cmd, args, cmdId) ) {fprintf(stderr, "Failed to send command\n");return false;}
+	if( !beginRpc(rq) ) return false;
+	if( !awaitResponse(rq.getCommandId(), success, result) ) return false;
+	return success;
+}
+
+
+bool ClipsClient::beginRpc(const Request& rq){
+	uint32_t cmdId = rq.getCommandId();
+	// The command must be pending before it is sent, otherwise
+	// a fast response might arrive before anyone awaits for it.
 	{std::lock_guard<std::mutex> lock(pcmutex);
 		pendingCommands[cmdId] = NULL;
 	}
-	if( !awaitResponse(cmdId, success, result) ) return false;
-	return success;
+	if( !sendRequest(rq) ) {
+		fprintf(stderr, "Failed to send command\n");
+		std::lock_guard<std::mutex> lock(pcmutex);
+		pendingCommands.erase(cmdId);
+		return false;
+	}
+	return true;
 }
 
 bool ClipsClient::rpc(const std::string& cmd){
@@ -264,38 +612,176 @@ void ClipsClient::asyncReadHandler(const boost::system::error_code& error, size_
 		return;
 	}
 
-	do{
+	while(buffer.size() >= protocol::HeaderSize){
 		// 1. Read message header to read only complete messages.
-		// If header is incomplete, the bytes read are returned to the buffer
-		uint16_t msgsize;
-		is.read((char*)&msgsize, sizeof(msgsize));
-		if(buffer.size() < (size_t)(msgsize - 2) ){
-			is.unget(); is.unget();
-			break;
+		// A zero size is followed by the 4-byte size of the payload (extended frame)
+		const char* data = asio::buffer_cast<const char*>(buffer.data());
+		size_t hdrsize = protocol::HeaderSize;
+		size_t msgsize;
+		uint16_t shortsize;
+		std::memcpy(&shortsize, data, sizeof(shortsize));
+		if(shortsize == 0){
+			if(buffer.size() < protocol::ExtendedHeaderSize) break;
+			uint32_t extsize;
+			std::memcpy(&extsize, data + sizeof(shortsize), sizeof(extsize));
+			hdrsize = protocol::ExtendedHeaderSize;
+			msgsize = extsize;
+			// Nothing can be read past a malformed size. Drop the connection.
+			if(msgsize > protocol::MaxPayload){
+				fprintf(stderr, "Malformed frame: %lu bytes exceed the maximum payload\n", msgsize);
+				boost::system::error_code ec;
+				socketPtr->close(ec);
+				abortAllRPC();
+				return;
+			}
 		}
 		// If message size is 2 or less (empty/malformed), discard.
-		if(!(msgsize-=2)) continue;
-		// 2. Read the whole message. Bytes read are removed from the buffer by the istream
-		std::string s(msgsize, 0);
-		is.read(&s[0], msgsize);
+		else if(shortsize <= protocol::HeaderSize){
+			buffer.consume(protocol::HeaderSize);
+			continue;
+		}
+		else msgsize = shortsize - protocol::HeaderSize;
+
+		// 2. Large messages are read straight into their string
+		if( (msgsize > protocol::MaxShortPayload) && (buffer.size() < hdrsize + msgsize) ){
+			rxLarge.assign(msgsize, 0);
+			rxLargeReceived = buffer.size() - hdrsize;
+			std::memcpy(&rxLarge[0], data + hdrsize, rxLargeReceived);
+			buffer.consume(buffer.size());
+			beginReceiveLarge();
+			return;
+		}
+		if(buffer.size() < hdrsize + msgsize) break;
 
-		// 3. If the message is a command's response, process it. Else publish the read string.
-		if(s[0] == 0) handleResponseMesage(s);
-		else onMessageReceived(s);
-		// Repeat while buffer has data
-	}while(buffer.size() > 0);
+		// 3. Read the whole message and remove it from the buffer
+		std::string s(data + hdrsize, msgsize);
+		buffer.consume(hdrsize + msgsize);
+		dispatchMessage(s);
+	}
 
 	beginReceive();
 }
 
 
+void ClipsClient::beginReceiveLarge(){
+	asio::async_read(*socketPtr,
+		asio::buffer(&rxLarge[rxLargeReceived], rxLarge.length() - rxLargeReceived),
+		boost::bind(
+			&ClipsClient::asyncReadLargeHandler, this,
+			boost::asio::placeholders::error,
+			boost::asio::placeholders::bytes_transferred)
+		);
+}
+
+
+void ClipsClient::asyncReadLargeHandler(const boost::system::error_code& error, size_t bytes_transferred){
+	// async_read completes only once the whole frame is in
+	if( error || (rxLargeReceived + bytes_transferred != rxLarge.length()) ){
+		disconnect();
+		return;
+	}
+	std::string s;
+	s.swap(rxLarge);
+	dispatchMessage(s);
+	beginReceive();
+}
+
+
+void ClipsClient::shmReceive(){
+	shm::Segment& seg = *shmSegment;
+	shm::RingView ring = seg.clientRing(shmRingSize);
+	std::string rx;
+	size_t rxReceived = 0;
+	bool receiving = false;
+	while( !seg.closed.load(std::memory_order_acquire) ){
+		uint32_t observed = seg.clientEvent.prepare();
+		bool progress = false;
+		for(;;){
+			if(!receiving){
+				// 1. Read the header (see asyncReadHandler)
+				char header[protocol::ExtendedHeaderSize];
+				size_t available = ring.peek(header, sizeof(header));
+				if(available < protocol::HeaderSize) break;
+				size_t hdrsize = protocol::HeaderSize;
+				size_t msgsize;
+				uint16_t shortsize;
+				std::memcpy(&shortsize, header, sizeof(shortsize));
+				if(shortsize == 0){
+					if(available < protocol::ExtendedHeaderSize) break;
+					uint32_t extsize;
+					std::memcpy(&extsize, header + sizeof(shortsize), sizeof(extsize));
+					hdrsize = protocol::ExtendedHeaderSize;
+					msgsize = extsize;
+					// Close the channel as asyncReadHandler drops the connection
+					if(msgsize > protocol::MaxPayload){
+						fprintf(stderr, "Malformed frame: %lu bytes exceed the maximum payload\n", msgsize);
+						seg.closed.store(1, std::memory_order_release);
+						seg.serverEvent.signal();
+						break;
+					}
+				}
+				else if(shortsize <= protocol::HeaderSize){
+					ring.consume(protocol::HeaderSize);
+					progress = true;
+					continue;
+				}
+				else msgsize = shortsize - protocol::HeaderSize;
+				ring.consume(hdrsize);
+				rx.assign(msgsize, 0);
+				rxReceived = 0;
+				receiving = true;
+				progress = true;
+			}
+
+			// 2. Messages larger than the ring are read as they arrive
+			size_t read = ring.read(&rx[rxReceived], rx.length() - rxReceived);
+			rxReceived+= read;
+			progress|= (read > 0);
+			if(rxReceived < rx.length()) break;
+			receiving = false;
+			dispatchMessage(rx);
+		}
+		if(progress){
+			seg.serverEvent.signal();
+			continue;
+		}
+		seg.clientEvent.wait(observed, 100);
+	}
+	// Closed by the server: release waiting RPCs
+	abortAllRPC();
+}
+
+
+void ClipsClient::dispatchMessage(const std::string& s){
+	// If the message is a command's response, process it. Else publish the read string.
+	if(s[0] == 0) handleResponseMesage(s);
+	else onMessageReceived(s);
+}
+
+
 void ClipsClient::handleResponseMesage(const std::string& s){
+	// Output of a stream command still running
+	if( (s.length() >= 6) && (s[5] == protocol::PartialResult) ){
+		uint32_t cmdId;
+		s.copy((char*)&cmdId, 4, 1);
+		std::unique_lock<std::mutex> lock(pcmutex);
+		auto it = streamHandlers.find(cmdId);
+		if( it == streamHandlers.end() ) return;
+		std::function<void(const std::string&)> handler = it->second;
+		lock.unlock();
+		if(handler) handler( s.substr(6) );
+		return;
+	}
 	ReplyPtr rplptr = Reply::fromMessage(s);
 	if( rplptr ){
 		if(rplptr->getCommandId() == Reply::CommandIdNone){
 			updateStatus(rplptr);
 			return;
 		}
+		if(rplptr->getCommandId() == protocol::StatsCommandId){
+			onStatsReceived( rplptr->getResult() );
+			return;
+		}
 		std::unique_lock<std::mutex> lock(pcmutex);
 		if( !pendingCommands.count(rplptr->getCommandId()) )  return;
 		pendingCommands[rplptr->getCommandId()] = rplptr;
@@ -351,6 +837,14 @@ void ClipsClient::onClipsStatusChanged(){
 }
 
 
+void ClipsClient::onStatsReceived(const std::string& report){
+	for(auto it = statsReceivedHandlers.begin(); it != statsReceivedHandlers.end(); ++it){
+		try{ (*it)( getPtr(), report ); }
+		catch(int err){}
+	}
+}
+
+
 void ClipsClient::addConnectedHandler(std::function<void(const ClipsClientPtr&)> handler){
 	if(!handler) return;
 	connectedHandlers.push_back(handler);
@@ -373,6 +867,11 @@ void ClipsClient::addClipsStatusChangedHandler(std::function<void(const ClipsCli
 	clipsStatusChangedHandlers.push_back(handler);
 }
 
+void ClipsClient::addStatsReceivedHandler(std::function<void(const ClipsClientPtr&, const std::string&)> handler){
+	if(!handler) return;
+	statsReceivedHandlers.push_back(handler);
+}
+
 
 #if __GNUC__ > 10
 
@@ -423,4 +922,16 @@ void ClipsClient::removeClipsStatusChangedHandler(std::function<void(const Clips
 	}
 }
 
+
+void ClipsClient::removeStatsReceivedHandler(std::function<void(const ClipsClientPtr&, const std::string&)> handler){
+	if(!handler) return;
+
+	typedef void(HT)(const ClipsClientPtr&, const std::string&);
+	auto htarget = handler.target<HT>();
+	for(auto it = statsReceivedHandlers.begin(); it != statsReceivedHandlers.end(); ++it){
+		if (it->target<HT>() != htarget) continue;
+		statsReceivedHandlers.erase(it);
+	}
+}
+
 #endif
@@ -3,12 +3,15 @@
 namespace asio = boost::asio;
 using asio::ip::tcp;
 
-uint32_t Request::lastCommandId = 0;
+std::atomic<uint32_t> Request::lastCommandId(0);
 
-Request::Request(){}
+Request::Request() : opcode(protocol::Opcode::None){}
 
 Request::Request(const std::string& command, const std::string& args) :
-	cmdId(++Request::lastCommandId), cmd(command), args(args){}
+	cmdId(++Request::lastCommandId), opcode(protocol::Opcode::None), cmd(command), args(args){}
+
+Request::Request(protocol::Opcode opcode, const std::string& args) :
+	cmdId(++Request::lastCommandId), opcode(opcode), cmd(protocol::opcodeName(opcode)), args(args){}
 
 
 
@@ -31,17 +34,28 @@ std::string Request::getArgs() const{
 
 
 std::vector<char> Request::getPayload() const{
-	std::string content = cmd;
-	if( !args.empty() ) content += " " + args;
-
+	// Binary commands are the opcode followed by the encoded args
+	std::string content;
+	if(opcode != protocol::Opcode::None){
+		content = (char)opcode;
+		content+= args;
+	}
+	else{
+		content = cmd;
+		if( !args.empty() ) content += " " + args;
+	}
+
+	// Frames larger than 64KB use an extended header
+	std::string header = protocol::makeHeader(5 + content.length());
 	std::vector<char> payload;
-	uint16_t packetsize = 7 + content.length();
-	payload.resize(packetsize, 0);
+	if( header.empty() ) return payload;
+	payload.resize(header.length() + 5 + content.length(), 0);
 	char* buffer = payload.data();
-	std::memcpy(buffer, &packetsize, 2);
-	buffer[2] = 0;
-	std::memcpy(buffer+3, &cmdId, 4);
-	content.copy(buffer+7, content.length());
+	header.copy(buffer, header.length());
+	buffer+= header.length();
+	buffer[0] = 0;
+	std::memcpy(buffer+1, &cmdId, 4);
+	content.copy(buffer+5, content.length());
 	return payload;
 }
 
@@ -65,3 +79,9 @@ RequestPtr Request::fromMessage(const std::string& message){
 RequestPtr Request::make_shared(const std::string& command, const std::string& args){
 	return RequestPtr(new Request(command, args));
 }
+
+
+
+RequestPtr Request::make_shared(protocol::Opcode opcode, const std::string& args){
+	return RequestPtr(new Request(opcode, args));
+}
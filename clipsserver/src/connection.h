@@ -0,0 +1,134 @@
+/* ** *****************************************************************
+* connection.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file connection.h
+ * Definition of the Connection interface: what the server needs from
+ * a connected client regardless of the transport it uses
+ */
+
+#ifndef __CONNECTION_H__
+#define __CONNECTION_H__
+#pragma once
+
+/** @cond */
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+/** @endcond */
+
+#include "frame.h"
+
+class Connection;
+typedef std::shared_ptr<Connection> ConnectionPtr;
+
+/**
+ * Enumerates the policies applied when a session's outbound queue
+ * exceeds its high watermark (i.e. the client does not read fast enough)
+ */
+enum class SlowConsumerPolicy{
+	/**
+	 * The producer waits until the queue drains below the low watermark
+	 */
+	Block,
+	/**
+	 * The oldest droppable (status/broadcast) frames are discarded
+	 * until the queue is below the low watermark
+	 */
+	DropOldest,
+	/**
+	 * The client is disconnected
+	 */
+	Disconnect
+};
+
+/**
+ * A connected client. Implemented by Session (TCP and local sockets)
+ * and ShmSession (shared memory). Acks, broadcasts and status frames
+ * are sent through this interface.
+ */
+class Connection{
+public:
+	/**
+	 * Default destructor
+	 */
+	virtual ~Connection(){}
+
+	/**
+	 * Gets a string representation of the remote endpoint
+	 * @return A string representation of the remote endpoint
+	 */
+	virtual std::string getEndPointStr() const = 0;
+
+	/**
+	 * Gets the protocol version negotiated with the remote client
+	 * @return The negotiated protocol version. 1 if none was negotiated.
+	 */
+	virtual uint32_t getProtocolVersion() const = 0;
+
+	/**
+	 * Gets the number of bytes enqueued for sending
+	 * @return The number of bytes waiting to be sent to the remote client
+	 */
+	virtual size_t getQueuedBytes() const = 0;
+
+	/**
+	 * Gets the number of frames discarded by the DropOldest policy
+	 * @return The number of frames discarded so far
+	 */
+	virtual size_t getDroppedFrames() const = 0;
+
+	/**
+	 * Sets the outbound queue watermarks
+	 * @param high The amount of queued bytes that triggers the slow-consumer policy
+	 * @param low  The amount of queued bytes the queue is brought back to
+	 */
+	virtual void setWatermarks(size_t high, size_t low) = 0;
+
+	/**
+	 * Sets the policy applied when the outbound queue exceeds the high watermark
+	 * @param policy The slow-consumer policy
+	 */
+	virtual void setSlowConsumerPolicy(SlowConsumerPolicy policy) = 0;
+
+	/**
+	 * Enqueues an encoded frame for the remote client.
+	 * @param frame     The frame to send
+	 * @param droppable Optional. When true the frame may be discarded by
+	 *                  the DropOldest policy (status and broadcasts).
+	 *                  Default: false
+	 * @return          true if the frame was enqueued, false otherwise.
+	 */
+	virtual bool send(const FramePtr& frame, bool droppable = false) = 0;
+
+	/**
+	 * Enqueues several frames at once, in order.
+	 * Frames are never dropped by the DropOldest policy.
+	 * @param frames    The frames to send
+	 * @return          The number of frames enqueued. Enqueuing stops at
+	 *                  the first frame that can't be sent.
+	 */
+	virtual size_t send(const std::vector<FramePtr>& frames) = 0;
+
+	/**
+	 * Frames and sends the provided string to the remote client
+	 * @param s         The string to send
+	 * @param droppable Optional. When true the frame may be discarded by
+	 *                  the DropOldest policy (status and broadcasts).
+	 *                  Default: false
+	 * @return          true if the string was enqueued, false otherwise.
+	 */
+	bool send(std::string s, bool droppable = false){
+		return send( Frame::makeShared( std::move(s) ), droppable );
+	}
+
+	/**
+	 * Closes the connection with the remote client
+	 */
+	virtual void close() = 0;
+};
+
+#endif // __CONNECTION_H__
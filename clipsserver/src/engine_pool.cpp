@@ -0,0 +1,114 @@
+#include "engine_pool.h"
+#include "shard_router.h"
+#include "logger.h"
+
+#include <cstring>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace asio = boost::asio;
+
+
+/* ** ********************************************************
+* Static members
+* *** *******************************************************/
+const size_t EnginePool::FirstIndex;
+
+
+
+EnginePool::EnginePool(asio::io_context& io, ShardRouter& router,
+	int zygoteFd, const std::string& basePath, size_t size):
+	io(io), router(router), zygoteFd(zygoteFd), basePath(basePath),
+	size(size), lastEngine(0), running(false){
+	}
+
+EnginePool::~EnginePool(){
+	running = false;
+	idleChanged.notify_all();
+	// Unblocks a pending request. The zygote exits once the socket closes.
+	shutdown(zygoteFd, SHUT_RDWR);
+	if(refillThread.joinable())
+		refillThread.join();
+	close(zygoteFd);
+}
+
+
+EnginePool::Engine::~Engine(){
+	// The zygote reaps it. The link reports the disconnection to the router.
+	if( link && link->isConnected() ) kill(pid, SIGTERM);
+}
+
+
+void EnginePool::start(){
+	running = true;
+	refillThread = std::thread(&EnginePool::refill, this);
+}
+
+
+std::shared_ptr<EnginePool::Engine> EnginePool::acquire(std::chrono::milliseconds timeout){
+	std::unique_lock<std::mutex> lock(idleMutex);
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	for(;;){
+		// Engines may die while idle
+		while( !idle.empty() && !idle.front()->link->isConnected() )
+			idle.pop_front();
+		if( !idle.empty() ) break;
+		if( !running || (idleChanged.wait_until(lock, deadline) == std::cv_status::timeout) )
+			return NULL;
+	}
+	std::shared_ptr<Engine> engine = idle.front();
+	idle.pop_front();
+	lock.unlock();
+	idleChanged.notify_all();
+	return engine;
+}
+
+
+void EnginePool::refill(){
+	while(running){
+		{
+			std::unique_lock<std::mutex> lock(idleMutex);
+			idleChanged.wait(lock, [this](){ return !running || (idle.size() < size); });
+		}
+		if(!running) break;
+
+		std::shared_ptr<Engine> engine = spawn();
+		if(!engine){
+			// Retry later rather than spinning on a failing zygote
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> lock(idleMutex);
+			idle.push_back(engine);
+		}
+		idleChanged.notify_all();
+	}
+}
+
+
+std::shared_ptr<EnginePool::Engine> EnginePool::spawn(){
+	uint32_t seq = ++lastEngine;
+	int32_t pid;
+	if( (write(zygoteFd, &seq, sizeof(seq)) != sizeof(seq)) ||
+		(read(zygoteFd, &pid, sizeof(pid)) != sizeof(pid)) || (pid <= 0) ){
+		if(running) LOG_ERROR(Shard, "Engine pool: the zygote did not fork engine %u", seq);
+		return NULL;
+	}
+
+	auto engine = std::make_shared<Engine>();
+	engine->pid = pid;
+	engine->link = std::make_shared<ShardLink>(FirstIndex + seq, io, router);
+	std::string path = basePath + std::to_string(seq);
+	bool connected = engine->link->connect(path, std::chrono::seconds(10));
+	// Nobody else connects to the engine
+	unlink( path.c_str() );
+	if(!connected){
+		kill(pid, SIGTERM);
+		return NULL;
+	}
+	engine->link->start();
+	return engine;
+}
@@ -0,0 +1,177 @@
+/* ** *****************************************************************
+* engine_pool.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file engine_pool.h
+ * Definition of the EnginePool class: a set of idle worker processes
+ * with the rule base loaded and reset, ready to be handed to a client
+ */
+
+#ifndef __ENGINE_POOL_H__
+#define __ENGINE_POOL_H__
+#pragma once
+
+/** @cond */
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <condition_variable>
+
+#include <sys/types.h>
+#include <boost/asio.hpp>
+/** @endcond */
+
+#include "shard_link.h"
+
+
+
+class ShardRouter;
+
+/**
+ * Keeps a number of warm engines: worker processes forked by the zygote,
+ * a process that loaded and reset the rule base once and does nothing
+ * but fork. Taking an engine from the pool only hands over a connected
+ * link, so a client gets a pristine engine without waiting for the rule
+ * base to load. A background thread refills the pool as engines are taken.
+ *
+ * The zygote is driven through a socket: the pool writes the sequence
+ * number of the engine to fork (uint32) and the zygote replies with the
+ * pid of the new engine (int32), which listens on basePath + number.
+ */
+class EnginePool{
+public:
+	/**
+	 * A worker process forked by the zygote. The process is terminated
+	 * when the last reference to the engine is released, so an engine
+	 * replaced while running commands finishes them first.
+	 */
+	struct Engine{
+		~Engine();
+		/**
+		 * Link to the engine. Its index identifies the engine in the router.
+		 */
+		std::shared_ptr<ShardLink> link;
+		/**
+		 * Process id of the engine
+		 */
+		pid_t pid;
+	};
+
+	/**
+	 * Initializes a new instance of EnginePool
+	 * @param io       The io_context where the engines' frames are received
+	 * @param router   The router that handles the engines' frames
+	 * @param zygoteFd Socket connected to the zygote. Owned by the pool.
+	 * @param basePath Prefix of the paths where new engines listen
+	 * @param size     Number of idle engines kept
+	 */
+	EnginePool(boost::asio::io_context& io, ShardRouter& router,
+		int zygoteFd, const std::string& basePath, size_t size);
+	~EnginePool();
+
+	// Disable copy constructor and assignment op.
+private:
+	/**
+	 * Copy constructor disabled
+	 */
+	EnginePool(EnginePool const& obj)        = delete;
+	/**
+	 * Copy assignment operator disabled
+	 */
+	EnginePool& operator=(EnginePool const&) = delete;
+
+public:
+	/**
+	 * Starts filling the pool in the background
+	 */
+	void start();
+
+	/**
+	 * Takes an idle engine from the pool, waiting for one if the pool is empty
+	 * @param  timeout The maximum time to wait
+	 * @return         The engine, or null if none became available in time
+	 */
+	std::shared_ptr<Engine> acquire(std::chrono::milliseconds timeout);
+
+	/**
+	 * Index of the first engine. Engines are numbered from here on,
+	 * so they never clash with the indices of the shards.
+	 */
+	static const size_t FirstIndex = 0x100;
+
+private:
+	/**
+	 * Refills the pool until the pool is stopped
+	 */
+	void refill();
+
+	/**
+	 * Asks the zygote for a new engine and connects to it
+	 * @return The new engine, or null if it could not be started
+	 */
+	std::shared_ptr<Engine> spawn();
+
+private:
+	/**
+	 * The io_context where the engines' frames are received
+	 */
+	boost::asio::io_context& io;
+
+	/**
+	 * The router that handles the engines' frames
+	 */
+	ShardRouter& router;
+
+	/**
+	 * Socket connected to the zygote
+	 */
+	int zygoteFd;
+
+	/**
+	 * Prefix of the paths where new engines listen
+	 */
+	std::string basePath;
+
+	/**
+	 * Number of idle engines kept
+	 */
+	size_t size;
+
+	/**
+	 * Sequence number of the last engine forked
+	 */
+	uint32_t lastEngine;
+
+	/**
+	 * Idle engines, oldest first
+	 */
+	std::deque<std::shared_ptr<Engine>> idle;
+
+	/**
+	 * Protects idle
+	 */
+	std::mutex idleMutex;
+
+	/**
+	 * Signaled when an engine is taken from or added to the pool
+	 */
+	std::condition_variable idleChanged;
+
+	/**
+	 * Set while the refill thread must keep running
+	 */
+	std::atomic<bool> running;
+
+	/**
+	 * Thread refilling the pool
+	 */
+	std::thread refillThread;
+};
+
+#endif // __ENGINE_POOL_H__
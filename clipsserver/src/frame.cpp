@@ -0,0 +1,29 @@
+#include "frame.h"
+#include "clipsclient/protocol.h"
+
+Frame::Frame(std::string&& payload):
+	header(protocol::makeHeader(payload.length())), payload(std::move(payload)){}
+
+const std::string& Frame::getHeader() const{
+	return header;
+}
+
+const std::string& Frame::getPayload() const{
+	return payload;
+}
+
+size_t Frame::size() const{
+	return header.length() + payload.length();
+}
+
+bool Frame::isExtended() const{
+	return payload.length() > protocol::MaxShortPayload;
+}
+
+bool Frame::isValid() const{
+	return !header.empty();
+}
+
+FramePtr Frame::makeShared(std::string payload){
+	return FramePtr(new Frame(std::move(payload)));
+}
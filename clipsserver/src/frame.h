@@ -0,0 +1,97 @@
+/* ** *****************************************************************
+* frame.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file frame.h
+ * Definition of the Frame class: an encoded, immutable message
+ * ready to be written to any number of sessions
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+#pragma once
+
+/** @cond */
+#include <memory>
+#include <string>
+/** @endcond */
+
+class Frame;
+typedef std::shared_ptr<const Frame> FramePtr;
+
+/**
+ * An encoded frame (header and payload). Frames are immutable once
+ * created, so a single instance can be enqueued in every session
+ * of a broadcast and written by all of them concurrently.
+ */
+class Frame{
+	/**
+	 * Initializes a new instance of Frame
+	 * @param payload The message to frame
+	 */
+	Frame(std::string&& payload);
+
+	// Disable copy constructor and assignment op.
+private:
+	/**
+	 * Copy constructor disabled
+	 */
+	Frame(Frame const& obj)        = delete;
+	/**
+	 * Copy assignment operator disabled
+	 */
+	Frame& operator=(Frame const&) = delete;
+
+public:
+	/**
+	 * Gets the encoded header of the frame
+	 * @return The frame header
+	 */
+	const std::string& getHeader() const;
+
+	/**
+	 * Gets the payload of the frame
+	 * @return The framed message
+	 */
+	const std::string& getPayload() const;
+
+	/**
+	 * Gets the size of the frame, header included
+	 * @return The number of bytes written when the frame is sent
+	 */
+	size_t size() const;
+
+	/**
+	 * Checks whether the frame requires an extended header (protocol 2)
+	 * @return true if the payload does not fit in a standard frame
+	 */
+	bool isExtended() const;
+
+	/**
+	 * Checks whether the frame can be sent. Payloads larger than
+	 * protocol::MaxPayload have no header and can't.
+	 * @return true if the frame has a header
+	 */
+	bool isValid() const;
+
+private:
+	/**
+	 * The encoded header
+	 */
+	const std::string header;
+	/**
+	 * The message itself
+	 */
+	const std::string payload;
+
+public:
+	/**
+	 * Encodes the given message and returns a shared pointer to the frame
+	 * @param payload The message to frame. It is moved into the frame.
+	 */
+	static FramePtr makeShared(std::string payload);
+};
+
+#endif // __FRAME_H__
@@ -0,0 +1,149 @@
+#include "logger.h"
+
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <sstream>
+
+
+/* ** ********************************************************
+* Static members
+* *** *******************************************************/
+const size_t Logger::Capacity;
+std::atomic<uint8_t> Logger::levels[(size_t)LogCategory::Count] = {
+	{(uint8_t)LogLevel::Info}, {(uint8_t)LogLevel::Info},
+	{(uint8_t)LogLevel::Info}, {(uint8_t)LogLevel::Info}
+};
+
+
+
+Logger::Logger() :
+	queue(Capacity), running(false), dropped(0){}
+
+
+Logger::~Logger(){
+	stop();
+}
+
+
+Logger& Logger::getInstance(){
+	// Guaranteed to be destroyed.
+	// Instantiated on first use.
+	static Logger instance;
+	return instance;
+}
+
+
+void Logger::start(){
+	if( running.exchange(true) ) return;
+	thread = std::thread(&Logger::drain, this);
+}
+
+
+void Logger::stop(){
+	if( !running.exchange(false) ) return;
+	queue.interrupt();
+	if( thread.joinable() ) thread.join();
+}
+
+
+void Logger::write(LogCategory category, LogLevel level, const char* format, ...){
+	Entry e;
+	e.level = level;
+	e.category = category;
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(e.text, sizeof(e.text), format, args);
+	va_end(args);
+	if(length < 0) return;
+	e.length = ( (size_t)length < sizeof(e.text) ) ? length : sizeof(e.text) - 1;
+	// Messages carry no newline
+	while( (e.length > 0) && (e.text[e.length - 1] == '\n') ) --e.length;
+
+	if( !running.load(std::memory_order_acquire) ) output(e);
+	else if( !queue.tryProduce(e) ) dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void Logger::drain(){
+	Entry e;
+	while( running.load(std::memory_order_acquire) || !queue.empty() ){
+		if( !queue.timedConsume(e, std::chrono::milliseconds(100)) ) continue;
+		do{ output(e); } while( queue.tryConsume(e) );
+		size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+		if(lost) fprintf(stderr, "Log: %lu messages dropped\n", lost);
+		fflush(stdout);
+	}
+}
+
+
+void Logger::output(const Entry& e){
+	FILE* f = (e.level <= LogLevel::Warning) ? stderr : stdout;
+	fwrite(e.text, 1, e.length, f);
+	fputc('\n', f);
+}
+
+
+bool Logger::configure(const std::string& arg, std::string& result){
+	std::istringstream ss(arg);
+	std::string first, second;
+	ss >> first >> second;
+	bool valid = true;
+
+	auto parse_level = [](const std::string& s, LogLevel& level){
+		if( (s.length() == 1) && (s[0] >= '0') && (s[0] < '0' + (int)LogLevel::Count) ){
+			level = (LogLevel)(s[0] - '0');
+			return true;
+		}
+		for(size_t i = 0; i < (size_t)LogLevel::Count; ++i)
+			if(s == levelName( (LogLevel)i )){
+				level = (LogLevel)i;
+				return true;
+			}
+		return false;
+	};
+
+	LogLevel level;
+	if( second.empty() && !first.empty() ){
+		valid = parse_level(first, level);
+		for(size_t i = 0; valid && (i < (size_t)LogCategory::Count); ++i)
+			setLevel( (LogCategory)i, level );
+	}
+	else if( !second.empty() ){
+		size_t i = 0;
+		while( (i < (size_t)LogCategory::Count) && (first != categoryName( (LogCategory)i )) ) ++i;
+		valid = (i < (size_t)LogCategory::Count) && parse_level(second, level);
+		if(valid) setLevel( (LogCategory)i, level );
+	}
+
+	result.clear();
+	for(size_t i = 0; i < (size_t)LogCategory::Count; ++i){
+		if(i) result+= ' ';
+		result+= categoryName( (LogCategory)i );
+		result+= ':';
+		result+= levelName( getLevel( (LogCategory)i ) );
+	}
+	return valid;
+}
+
+
+LogLevel Logger::getLevel(LogCategory category){
+	return (LogLevel)levels[(size_t)category].load(std::memory_order_relaxed);
+}
+
+
+void Logger::setLevel(LogCategory category, LogLevel level){
+	levels[(size_t)category].store((uint8_t)level, std::memory_order_relaxed);
+}
+
+
+const char* Logger::levelName(LogLevel level){
+	static const char* names[] = { "off", "error", "warning", "info", "debug" };
+	return (level < LogLevel::Count) ? names[(size_t)level] : "";
+}
+
+
+const char* Logger::categoryName(LogCategory category){
+	static const char* names[] = { "server", "engine", "network", "shard" };
+	return (category < LogCategory::Count) ? names[(size_t)category] : "";
+}
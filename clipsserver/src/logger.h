@@ -0,0 +1,223 @@
+/* ** *****************************************************************
+* logger.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file logger.h
+ * Definition of the Logger class, an asynchronous leveled logger,
+ * and the LOG_* macros used to write to it
+ */
+
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+#pragma once
+
+/** @cond */
+#include <atomic>
+#include <string>
+#include <thread>
+#include <cstdint>
+/** @endcond */
+
+#include "mpsc_queue.h"
+
+
+/**
+ * Most verbose level compiled in. Messages above it cost nothing.
+ * Defaults to 4 (debug). Set it with -DCLIPSSERVER_LOG_LEVEL=N.
+ */
+#ifndef CLIPSSERVER_LOG_LEVEL
+#define CLIPSSERVER_LOG_LEVEL 4
+#endif
+
+/**
+ * Writes a message to the log if its category is enabled at the given
+ * level. The arguments are not evaluated otherwise.
+ * @param category A LogCategory, without qualification (e.g. Engine)
+ * @param level    A LogLevel, without qualification (e.g. Info)
+ * @param ...      printf-like format and arguments. The newline is added.
+ */
+#define LOG(category, level, ...) do{ \
+	if( ((int)LogLevel::level <= CLIPSSERVER_LOG_LEVEL) && \
+		Logger::isEnabled(LogCategory::category, LogLevel::level) ) \
+		Logger::getInstance().write(LogCategory::category, LogLevel::level, __VA_ARGS__); \
+	}while(0)
+
+#define LOG_ERROR(category, ...)   LOG(category, Error, __VA_ARGS__)
+#define LOG_WARNING(category, ...) LOG(category, Warning, __VA_ARGS__)
+#define LOG_INFO(category, ...)    LOG(category, Info, __VA_ARGS__)
+#define LOG_DEBUG(category, ...)   LOG(category, Debug, __VA_ARGS__)
+
+
+/**
+ * Severity of a log message. A category enabled at a level logs the
+ * messages of that level and the levels before it.
+ */
+enum class LogLevel : uint8_t{
+	Off = 0, Error, Warning, Info, Debug, Count
+};
+
+/**
+ * Part of the server a log message comes from
+ */
+enum class LogCategory : uint8_t{
+	Server = 0, ///< Startup, configuration and working path
+	Engine,     ///< Commands executed by CLIPS and asserted facts
+	Network,    ///< Clients, sessions and frames
+	Shard,      ///< Shards, the shard router and the engine pool
+	Count
+};
+
+
+/**
+ * Leveled logger. Messages are formatted by the thread that logs them
+ * and copied into a lock-free ring. A background thread writes them out,
+ * errors and warnings to stderr and the rest to stdout, so logging never
+ * waits on the console.
+ * Until start() is called, and after stop(), messages are written
+ * synchronously, which is safe across fork().
+ * @remark Singleton: the log levels are shared by the whole process
+ */
+class Logger{
+// Singleton element access
+public:
+	/**
+	 * Returns the unique instance of Logger, creating it if necessary
+	 */
+	static Logger& getInstance();
+
+// Disable copy constructor and copy assignation
+	Logger(const Logger&)         = delete;
+	void operator=(const Logger&) = delete;
+
+// Make constructor private for Singleton
+private:
+	Logger();
+
+public:
+	~Logger();
+
+public:
+	/**
+	 * A log message, as stored in the ring
+	 */
+	struct Entry{
+		LogLevel level;
+		LogCategory category;
+		/**
+		 * Length of the text
+		 */
+		uint16_t length;
+		/**
+		 * The text, without the newline. Longer messages are truncated.
+		 */
+		char text[252];
+	};
+
+	/**
+	 * Starts the background thread. Messages are queued from now on.
+	 */
+	void start();
+
+	/**
+	 * Writes the queued messages and stops the background thread.
+	 * Messages are written synchronously from now on.
+	 */
+	void stop();
+
+	/**
+	 * Writes a message to the log.
+	 * If the ring is full the message is dropped and counted.
+	 * @remark Use the LOG_* macros, which skip disabled levels
+	 * @param category The category of the message
+	 * @param level    The level of the message
+	 * @param format   printf-like format
+	 */
+	void write(LogCategory category, LogLevel level, const char* format, ...)
+		__attribute__((format(printf, 4, 5)));
+
+	/**
+	 * Applies the arguments of the log command:
+	 * a level for all categories ("debug"), a category and its
+	 * level ("engine debug"), or nothing to only query the levels.
+	 * Levels may also be given as numbers (0 for off to 4 for debug).
+	 * @param  arg    The arguments
+	 * @param  result When this method returns contains the level of
+	 *                each category, e.g. "server:info engine:debug"
+	 * @return        true if the arguments were valid, false otherwise
+	 */
+	bool configure(const std::string& arg, std::string& result);
+
+	/**
+	 * Checks whether a category logs messages of the given level
+	 */
+	static inline bool isEnabled(LogCategory category, LogLevel level){
+		return levels[(size_t)category].load(std::memory_order_relaxed) >= (uint8_t)level;
+	}
+
+	/**
+	 * Gets the level of a category
+	 */
+	static LogLevel getLevel(LogCategory category);
+
+	/**
+	 * Sets the level of a category
+	 */
+	static void setLevel(LogCategory category, LogLevel level);
+
+	/**
+	 * Gets the name of a level
+	 */
+	static const char* levelName(LogLevel level);
+
+	/**
+	 * Gets the name of a category
+	 */
+	static const char* categoryName(LogCategory category);
+
+private:
+	/**
+	 * Body of the background thread
+	 */
+	void drain();
+
+	/**
+	 * Writes an entry out
+	 */
+	static void output(const Entry& e);
+
+private:
+	/**
+	 * The ring of queued messages
+	 */
+	mpsc_queue<Entry> queue;
+
+	/**
+	 * Set while the background thread runs
+	 */
+	std::atomic<bool> running;
+
+	/**
+	 * The background thread
+	 */
+	std::thread thread;
+
+	/**
+	 * Messages dropped because the ring was full, not reported yet
+	 */
+	std::atomic<size_t> dropped;
+
+	/**
+	 * Level of each category
+	 */
+	static std::atomic<uint8_t> levels[(size_t)LogCategory::Count];
+
+public:
+	/**
+	 * Number of messages the ring holds
+	 */
+	static const size_t Capacity = 4096;
+};
+
+#endif // __LOGGER_H__
@@ -0,0 +1,195 @@
+#include "metrics.h"
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+
+/* ** ********************************************************
+* Static members
+* *** *******************************************************/
+const unsigned LatencyHistogram::SubBucketBits;
+const uint64_t LatencyHistogram::SubBuckets;
+const uint64_t LatencyHistogram::MaxValue;
+
+
+
+/* ** ********************************************************
+* LatencyHistogram
+* *** *******************************************************/
+LatencyHistogram::LatencyHistogram():
+	buckets(bucketOf(MaxValue) + 1, 0), total(0), highest(0){
+}
+
+
+size_t LatencyHistogram::bucketOf(uint64_t v){
+	if(v < SubBuckets) return v;
+	unsigned msb = 63 - __builtin_clzll(v);
+	unsigned shift = msb - SubBucketBits + 1;
+	return shift * (SubBuckets / 2) + (v >> shift);
+}
+
+
+uint64_t LatencyHistogram::highestValueOf(size_t bucket){
+	if(bucket < SubBuckets) return bucket;
+	unsigned shift = bucket / (SubBuckets / 2) - 1;
+	uint64_t sub = bucket - shift * (SubBuckets / 2);
+	return ((sub + 1) << shift) - 1;
+}
+
+
+void LatencyHistogram::record(std::chrono::nanoseconds d){
+	uint64_t v = (d.count() > 0) ? std::min<uint64_t>(d.count(), MaxValue) : 0;
+	++buckets[bucketOf(v)];
+	++total;
+	if(v > highest) highest = v;
+}
+
+
+uint64_t LatencyHistogram::count() const{
+	return total;
+}
+
+
+uint64_t LatencyHistogram::max() const{
+	return highest;
+}
+
+
+uint64_t LatencyHistogram::quantile(double q) const{
+	if(total < 1) return 0;
+	uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(q * total));
+	uint64_t seen = 0;
+	for(size_t i = 0; i < buckets.size(); ++i){
+		seen+= buckets[i];
+		if(seen >= target) return std::min(highestValueOf(i), highest);
+	}
+	return highest;
+}
+
+
+void LatencyHistogram::reset(){
+	std::fill(buckets.begin(), buckets.end(), 0);
+	total = 0;
+	highest = 0;
+}
+
+
+
+/* ** ********************************************************
+* Metrics
+* *** *******************************************************/
+Metrics::Metrics(std::chrono::milliseconds interval):
+	latencies((size_t)protocol::Opcode::Count), interval(interval){
+	reset();
+}
+
+
+void Metrics::setInterval(std::chrono::milliseconds interval){
+	this->interval = std::max(std::chrono::milliseconds(1), interval);
+	nextTick = Clock::now() + this->interval;
+}
+
+
+std::chrono::milliseconds Metrics::getInterval() const{
+	return interval;
+}
+
+
+void Metrics::recordMessage(protocol::Opcode opcode, std::chrono::nanoseconds wait, std::chrono::nanoseconds exec){
+	Latencies& l = latencies[(size_t)opcode];
+	l.wait.record(wait);
+	l.exec.record(exec);
+	++messages;
+}
+
+
+void Metrics::recordRules(int fired){
+	if(fired > 0) rules+= fired;
+}
+
+
+uint64_t Metrics::getRulesFired() const{
+	return rules;
+}
+
+
+void Metrics::sampleQueue(size_t depth){
+	if(depth > queuePeak) queuePeak = depth;
+}
+
+
+bool Metrics::tick(Clock::time_point now){
+	if(now < nextTick) return false;
+	double seconds = std::chrono::duration<double>(now - nextTick + interval).count();
+	messageRate = (messages - intervalMessages) / seconds;
+	ruleRate = (rules - intervalRules) / seconds;
+	intervalMessages = messages;
+	intervalRules = rules;
+	lastQueuePeak = queuePeak;
+	queuePeak = 0;
+	nextTick = now + interval;
+	return true;
+}
+
+
+std::chrono::milliseconds Metrics::untilTick(Clock::time_point now) const{
+	if(now >= nextTick) return std::chrono::milliseconds(0);
+	// Rounded up, so the interval is over when the wait ends
+	return std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - now) + std::chrono::milliseconds(1);
+}
+
+
+void Metrics::reset(){
+	for(auto& l : latencies){
+		l.wait.reset();
+		l.exec.reset();
+	}
+	started = Clock::now();
+	nextTick = started + interval;
+	messages = rules = 0;
+	intervalMessages = intervalRules = 0;
+	messageRate = ruleRate = 0;
+	queuePeak = lastQueuePeak = 0;
+}
+
+
+/**
+ * Appends a histogram to a report as name:count=n p50=v ... max=v (us)
+ */
+static
+void print_histogram(std::string& report, const std::string& name, const LatencyHistogram& h){
+	static const struct{ const char* label; double q; } quantiles[] = {
+		{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p99.9", 0.999}
+	};
+	char buf[64];
+	report+= name + ":count=" + std::to_string(h.count());
+	for(const auto& q : quantiles){
+		snprintf(buf, sizeof(buf), " %s=%.1f", q.label, h.quantile(q.q) / 1000.0);
+		report+= buf;
+	}
+	snprintf(buf, sizeof(buf), " max=%.1f us\n", h.max() / 1000.0);
+	report+= buf;
+}
+
+
+void Metrics::print(std::string& report) const{
+	char buf[128];
+	double uptime = std::chrono::duration<double>(Clock::now() - started).count();
+	snprintf(buf, sizeof(buf), "uptime:%.1f s\n", uptime);
+	report+= buf;
+	snprintf(buf, sizeof(buf), "messages:total=%llu rate=%.1f/s\n", (unsigned long long)messages, messageRate);
+	report+= buf;
+	snprintf(buf, sizeof(buf), "rules:fired=%llu rate=%.1f/s\n", (unsigned long long)rules, ruleRate);
+	report+= buf;
+	snprintf(buf, sizeof(buf), "queue.peak:%lu\n", lastQueuePeak);
+	report+= buf;
+
+	for(size_t i = 0; i < latencies.size(); ++i){
+		const Latencies& l = latencies[i];
+		if(l.wait.count() < 1) continue;
+		std::string name = (i == 0) ? "message" : protocol::opcodeName( (protocol::Opcode)i );
+		print_histogram(report, "latency." + name + ".wait", l.wait);
+		print_histogram(report, "latency." + name + ".exec", l.exec);
+	}
+}
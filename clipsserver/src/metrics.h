@@ -0,0 +1,256 @@
+/* ** *****************************************************************
+* metrics.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file metrics.h
+ * Definition of the LatencyHistogram and Metrics classes, which keep
+ * the figures reported by the stats command
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+#pragma once
+
+/** @cond */
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+/** @endcond */
+
+#include "clipsclient/protocol.h"
+
+
+
+/**
+ * Log-linear latency histogram in the manner of HdrHistogram.
+ * Values under SubBuckets nanoseconds are counted exactly. Above that,
+ * each power of two is split in SubBuckets/2 buckets, so the value
+ * reported for any percentile is within 1/16 (6%) of the recorded one.
+ * Recording is a shift and an increment.
+ */
+class LatencyHistogram{
+public:
+	LatencyHistogram();
+
+	/**
+	 * Counts a value
+	 * @param d The value to count. Negative values count as zero.
+	 */
+	void record(std::chrono::nanoseconds d);
+
+	/**
+	 * Gets the number of values counted
+	 */
+	uint64_t count() const;
+
+	/**
+	 * Gets the largest value counted, in nanoseconds
+	 */
+	uint64_t max() const;
+
+	/**
+	 * Gets the value below which the given fraction of the values fall
+	 * @param  q The fraction, between 0 and 1
+	 * @return   The value, in nanoseconds. Zero if nothing was counted.
+	 */
+	uint64_t quantile(double q) const;
+
+	/**
+	 * Discards all counted values
+	 */
+	void reset();
+
+private:
+	/**
+	 * Gets the bucket where a value is counted
+	 */
+	static size_t bucketOf(uint64_t v);
+
+	/**
+	 * Gets the largest value counted in a bucket
+	 */
+	static uint64_t highestValueOf(size_t bucket);
+
+	/**
+	 * Number of bits resolved within each power of two
+	 */
+	static const unsigned SubBucketBits = 5;
+
+	/**
+	 * Number of values counted exactly
+	 */
+	static const uint64_t SubBuckets = 1ull << SubBucketBits;
+
+	/**
+	 * Values above this (about 18 minutes) are counted as this
+	 */
+	static const uint64_t MaxValue = (1ull << 40) - 1;
+
+	/**
+	 * Counters per bucket
+	 */
+	std::vector<uint64_t> buckets;
+
+	/**
+	 * Number of values counted
+	 */
+	uint64_t total;
+
+	/**
+	 * Largest value counted
+	 */
+	uint64_t highest;
+};
+
+
+/**
+ * Keeps the figures reported by the stats command: latency histograms
+ * per command, message and rule counters, and the depth of the ingress
+ * queue. Rates are computed over fixed intervals, closed by tick().
+ * @remark Used by the CLIPS thread only
+ */
+class Metrics{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/**
+	 * Initializes a new instance of Metrics
+	 * @param interval The length of the interval rates are computed over
+	 */
+	explicit Metrics(std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+	/**
+	 * Sets the length of the interval rates are computed over
+	 */
+	void setInterval(std::chrono::milliseconds interval);
+
+	/**
+	 * Gets the length of the interval rates are computed over
+	 */
+	std::chrono::milliseconds getInterval() const;
+
+	/**
+	 * Counts a processed message
+	 * @param opcode The command, or Opcode::None for plain messages
+	 * @param wait   Time the message spent in the queue (enqueue to dequeue)
+	 * @param exec   Time spent processing the message (dequeue to ack)
+	 */
+	void recordMessage(protocol::Opcode opcode, std::chrono::nanoseconds wait, std::chrono::nanoseconds exec);
+
+	/**
+	 * Counts fired rules
+	 */
+	void recordRules(int fired);
+
+	/**
+	 * Gets the number of rules fired since counting started
+	 */
+	uint64_t getRulesFired() const;
+
+	/**
+	 * Registers the depth of the ingress queue, keeping the peak of the interval
+	 */
+	void sampleQueue(size_t depth);
+
+	/**
+	 * Closes the current interval if it is over
+	 * @return true if an interval was closed, false otherwise
+	 */
+	bool tick(Clock::time_point now);
+
+	/**
+	 * Gets the time left until the current interval is over
+	 */
+	std::chrono::milliseconds untilTick(Clock::time_point now) const;
+
+	/**
+	 * Discards all counted values
+	 */
+	void reset();
+
+	/**
+	 * Appends the counters and histograms to a report, one item per line
+	 * @param report The report
+	 */
+	void print(std::string& report) const;
+
+private:
+	/**
+	 * Histograms of a message type
+	 */
+	struct Latencies{
+		/**
+		 * Enqueue to dequeue
+		 */
+		LatencyHistogram wait;
+		/**
+		 * Dequeue to ack
+		 */
+		LatencyHistogram exec;
+	};
+
+	/**
+	 * Histograms by opcode. Plain messages are counted under Opcode::None.
+	 */
+	std::vector<Latencies> latencies;
+
+	/**
+	 * Length of the interval rates are computed over
+	 */
+	std::chrono::milliseconds interval;
+
+	/**
+	 * Time when counting started
+	 */
+	Clock::time_point started;
+
+	/**
+	 * Time when the current interval is over
+	 */
+	Clock::time_point nextTick;
+
+	/**
+	 * Messages processed
+	 */
+	uint64_t messages;
+
+	/**
+	 * Rules fired
+	 */
+	uint64_t rules;
+
+	/**
+	 * Messages processed when the current interval started
+	 */
+	uint64_t intervalMessages;
+
+	/**
+	 * Rules fired when the current interval started
+	 */
+	uint64_t intervalRules;
+
+	/**
+	 * Messages processed per second during the last interval
+	 */
+	double messageRate;
+
+	/**
+	 * Rules fired per second during the last interval
+	 */
+	double ruleRate;
+
+	/**
+	 * Peak depth of the queue during the current interval
+	 */
+	size_t queuePeak;
+
+	/**
+	 * Peak depth of the queue during the last interval
+	 */
+	size_t lastQueuePeak;
+};
+
+#endif // __METRICS_H__
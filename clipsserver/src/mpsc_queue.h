@@ -0,0 +1,359 @@
+/* ** ***************************************************************
+* mpsc_queue.h
+*
+* Author: Mauricio Matamoros
+*
+* Implements a bounded lock-free multi-producer/single-consumer
+* queue under the producer-consumer pattern
+*
+** ** **************************************************************/
+/** @file mpsc_queue.h
+ * Implementation of the mpsc_queue class:
+ * a bounded lock-free multi-producer/single-consumer ring queue
+ */
+
+#ifndef __MPSC_QUEUE_H__
+#define __MPSC_QUEUE_H__
+#pragma once
+
+/** @cond */
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+/** @endcond */
+
+
+/**
+ * Implements a bounded lock-free multi-producer/single-consumer
+ * ring queue of type T.
+ * Producers and the consumer never take a lock while the queue has
+ * elements and room. The consumer parks on a condition variable only
+ * when the queue is empty, and producers notify it only when it is
+ * parked. Likewise, producers park only when the queue is full.
+ * @remark Drop-in replacement of sync_queue for the server's ingress
+ *         path. Only ONE thread may call the consume functions.
+ */
+template <class T>
+class mpsc_queue
+{
+private:
+	/**
+	 * A slot of the ring. The sequence number tells whether the slot
+	 * is free for the producer at position seq or holds the element
+	 * for the consumer at position seq-1.
+	 */
+	struct cell{
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	/**
+	 * The ring
+	 */
+	std::unique_ptr<cell[]> _buffer;
+	/**
+	 * Capacity of the ring minus one (capacity is a power of two)
+	 */
+	const size_t _mask;
+	/**
+	 * Next position to write. Shared by all producers.
+	 */
+	alignas(64) std::atomic<size_t> _head;
+	/**
+	 * Next position to read. Owned by the consumer.
+	 */
+	alignas(64) size_t _tail;
+	/**
+	 * Set while the consumer is parked (or about to park)
+	 */
+	alignas(64) std::atomic<bool> _waiting;
+	/**
+	 * Number of producers parked (or about to park) on a full queue
+	 */
+	std::atomic<size_t> _producersWaiting;
+	/**
+	 * Lock used only to park and wake the consumer and producers
+	 */
+	std::mutex _m;
+	/**
+	 * Condition variable where the consumer parks
+	 */
+	std::condition_variable _cv;
+	/**
+	 * Condition variable where producers park until there is room
+	 */
+	std::condition_variable _roomCv;
+	/**
+	 * Set by interrupt() until the consumer returns from wait()
+	 */
+	bool _interrupted;
+
+
+
+// Disable copy constructor and assignment op.
+private:
+	mpsc_queue(mpsc_queue const& obj) = delete;
+	mpsc_queue& operator=(mpsc_queue const&) = delete;
+
+public:
+	/**
+	 * Creates a new instance of a bounded lock-free queue
+	 * @param capacity Maximum number of elements in the queue.
+	 *                 It is rounded up to the next power of two.
+	 */
+	explicit mpsc_queue(size_t capacity = 65536) :
+		_buffer( new cell[roundup(capacity)] ), _mask( roundup(capacity) - 1 ),
+		_head(0), _tail(0), _waiting(false), _producersWaiting(0), _interrupted(false){
+		for(size_t i = 0; i <= _mask; ++i)
+			_buffer[i].seq.store(i, std::memory_order_relaxed);
+	}
+	/**
+	 * Default destructor
+	 * @remark Does nothing
+	 */
+	~mpsc_queue(){}
+
+	/**
+	 * Gets the maximum number of elements the queue can hold
+	 * @return The capacity of the queue
+	 */
+	size_t capacity() const {
+		return _mask + 1;
+	}
+
+	/**
+	 * Retrieves an element from the queue, parking the calling
+	 * thread while the queue is empty.
+	 * @remark Consumer only
+	 * @return The retrieved element
+	 */
+	const T consume() {
+		T obj;
+		while( !tryConsume(obj) )
+			wait(std::chrono::milliseconds::max());
+		return obj;
+	}
+
+	/**
+	 * Gets the number of elements in the queue
+	 * @remark Consumer only. Approximate while producers enqueue.
+	 * @return The number of elements in the queue
+	 */
+	size_t size() const {
+		return _head.load(std::memory_order_relaxed) - _tail;
+	}
+
+	/**
+	 * Checks whether the queue is empty or not
+	 * @remark Consumer only
+	 * @return true if the queue is empty, false otherwise
+	 */
+	bool empty() {
+		cell& c = _buffer[_tail & _mask];
+		return c.seq.load(std::memory_order_acquire) != (_tail + 1);
+	}
+
+	/**
+	 * Enqueues an element in the queue.
+	 * If the queue is full, parks the calling thread until there is room for it.
+	 * @param obj The element to enqueue
+	 */
+	void produce(const T& obj) {
+		while( !tryProduce(obj) )
+			waitForRoom(std::chrono::milliseconds::max());
+	}
+
+	/**
+	 * Enqueues an element in the queue if there is room for it
+	 * @param obj The element to enqueue
+	 * @return    true if the element was enqueued, false if the queue is full.
+	 */
+	bool tryProduce(const T& obj) {
+		cell* c;
+		size_t pos = _head.load(std::memory_order_relaxed);
+		for(;;){
+			c = &_buffer[pos & _mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if(dif == 0){
+				// Slot is free: claim it
+				if( _head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) )
+					break;
+			}
+			else if(dif < 0) return false;  // Queue is full
+			else pos = _head.load(std::memory_order_relaxed);
+		}
+		c->data = obj;
+		c->seq.store(pos + 1, std::memory_order_release); // Publish
+		notify();
+		return true;
+	}
+
+	/**
+	 * Retrieves an element from the queue without waiting
+	 * @remark         Consumer only
+	 * @param obj      The dequeued object
+	 * @return         true if an element was dequeued, false if the queue was empty.
+	 */
+	bool tryConsume(T& obj) {
+		cell& c = _buffer[_tail & _mask];
+		if( c.seq.load(std::memory_order_acquire) != (_tail + 1) )
+			return false;
+		obj = std::move(c.data);
+		c.data = T();                                     // Release resources held by the slot
+		c.seq.store(_tail + _mask + 1, std::memory_order_release);
+		++_tail;
+		// Producers parked on a full queue wake up every half ring.
+		// Waking them per slot would cost a syscall per element.
+		if( (_tail & (_mask >> 1)) == 0 ) notifyRoom();
+		return true;
+	}
+
+	/**
+	 * Retrieves all elements currently in the queue without waiting
+	 * @remark         Consumer only
+	 * @param objs     A vector where dequeued elements are appended
+	 * @param max      Optional. The maximum number of elements to dequeue.
+	 *                 Default: no limit
+	 * @return         The number of dequeued elements
+	 */
+	size_t consumeAll(std::vector<T>& objs, size_t max = std::numeric_limits<size_t>::max()) {
+		size_t count = 0;
+		T obj;
+		while( (count < max) && tryConsume(obj) ){
+			objs.push_back( std::move(obj) );
+			++count;
+		}
+		return count;
+	}
+
+	/**
+	 * Retrieves an element from the queue
+	 * @remark         Consumer only
+	 * @param obj      The dequeued object
+	 * @param timeout  The amount of time to wait for the elemnt in milliseconds
+	 * @return         true if the element was successfully dequeued before the timeout. false otherwise.
+	 */
+	bool timedConsume(T& obj, const std::chrono::milliseconds& timeout) {
+		if( tryConsume(obj) ) return true;
+		wait(timeout);
+		return tryConsume(obj);
+	}
+
+	/**
+	 * Attempts to enqueue an element into the queue
+	 * @param obj      The element to enqueue
+	 * @param timeout  The amount of time to wait for room in the queue in milliseconds
+	 * @return         true if the element was successfully enqueued before the timeout. false otherwise.
+	 */
+	bool timedProduce(const T& obj, const std::chrono::milliseconds& timeout) {
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		while( !tryProduce(obj) ){
+			auto now = std::chrono::steady_clock::now();
+			if(now >= deadline)
+				return false;
+			waitForRoom( std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) +
+				std::chrono::milliseconds(1) );
+		}
+		return true;
+	}
+
+	/**
+	 * Wakes up the consumer if it is parked, even if the queue is empty.
+	 * If the consumer is not parked, its next call to wait() returns
+	 * immediately.
+	 */
+	void interrupt() {
+		std::lock_guard<std::mutex> lock(_m);
+		_interrupted = true;
+		_cv.notify_one();
+	}
+
+	/**
+	 * Parks the consumer until an element is enqueued, the timeout
+	 * expires, or interrupt() is called
+	 * @remark         Consumer only
+	 * @param timeout  The maximum amount of time to wait
+	 */
+	void wait(const std::chrono::milliseconds& timeout) {
+		// Spin briefly: a producer may be about to publish
+		for(int i = 0; i < 64; ++i)
+			if( !empty() ) return;
+
+		std::unique_lock<std::mutex> ul(_m);
+		_waiting.store(true, std::memory_order_seq_cst);
+		// Pairs with the fence in notify(): either the producer sees
+		// _waiting or the consumer sees the published element
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if( empty() && !_interrupted ){
+			if(timeout == std::chrono::milliseconds::max()) _cv.wait(ul);
+			else _cv.wait_for(ul, timeout);
+		}
+		_interrupted = false;
+		_waiting.store(false, std::memory_order_relaxed);
+	}
+
+private:
+	/**
+	 * Checks whether the queue is full
+	 * @return true if the next slot to write still holds an element
+	 */
+	bool full() {
+		size_t pos = _head.load(std::memory_order_relaxed);
+		size_t seq = _buffer[pos & _mask].seq.load(std::memory_order_acquire);
+		return (intptr_t)seq - (intptr_t)pos < 0;
+	}
+
+	/**
+	 * Parks a producer until the consumer frees half the ring or the timeout expires
+	 * @param timeout  The maximum amount of time to wait
+	 */
+	void waitForRoom(const std::chrono::milliseconds& timeout) {
+		std::unique_lock<std::mutex> ul(_m);
+		_producersWaiting.fetch_add(1, std::memory_order_seq_cst);
+		// Pairs with the fence in notifyRoom(): either the consumer sees
+		// the parked producer or the producer sees the freed slot
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if( full() ){
+			if(timeout == std::chrono::milliseconds::max()) _roomCv.wait(ul);
+			else _roomCv.wait_for(ul, timeout);
+		}
+		_producersWaiting.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	/**
+	 * Wakes up the producers parked on a full queue, if any
+	 */
+	void notifyRoom() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if( !_producersWaiting.load(std::memory_order_relaxed) ) return;
+		std::lock_guard<std::mutex> lock(_m);
+		_roomCv.notify_all();
+	}
+
+	/**
+	 * Wakes up the consumer if it is parked
+	 */
+	void notify() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if( !_waiting.load(std::memory_order_relaxed) ) return;
+		std::lock_guard<std::mutex> lock(_m);
+		_cv.notify_one();
+	}
+
+	/**
+	 * Rounds up the given number to the next power of two
+	 */
+	static size_t roundup(size_t n) {
+		size_t p = 2;
+		while(p < n) p<<= 1;
+		return p;
+	}
+};
+
+#endif // __MPSC_QUEUE_H__
@@ -1,4 +1,5 @@
 #include "server.h"
+#include "shm_session.h"
 
 #include <regex>
 #include <cstdio>
@@ -10,7 +11,12 @@
 #include <boost/bind/bind.hpp>
 #include <boost/filesystem.hpp>
 
+#include <signal.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 
 #include "utils.h"
 #include "clipswrapper.h"
@@ -25,6 +31,14 @@ using asio::ip::tcp;
 #define contains(s1,s2) s1.find(s2) != std::string::npos
 
 
+/* ** ********************************************************
+* Static members
+* *** *******************************************************/
+constexpr std::chrono::microseconds Server::MaxAckDelay;
+const size_t Server::StreamChunkSize;
+constexpr std::chrono::milliseconds Server::StreamLatency;
+
+
 /* ** ********************************************************
 * Local helpers
 * *** *******************************************************/
@@ -58,6 +72,71 @@ std::string get_home_path(){
 	return std::getenv("HOME");
 }
 
+static inline
+std::string make_fact(const std::string& fact, const std::string& s){
+	// Received strings may carry a trailing null character.
+	// Everything after it must be discarded or the fact won't be closed.
+	return "(" + fact + " " + s.c_str() + ")";
+}
+
+/**
+ * Asserts the fact make_fact() would build. Messages holding only
+ * constants are built with a FactBuilder, without the CLIPS parser.
+ * The rest go through the parser, logged at debug level: messages
+ * with variables, function calls or parentheses, and relations that
+ * name a deftemplate with slots, which FactBuilder does not build.
+ */
+static inline
+void assert_fact(const std::string& fact, const std::string& s){
+	// Reused while the relation does not change, keeping the fields' storage
+	static clips::FactBuilder builder("");
+	size_t space = fact.find(' ');
+	if( fact.compare(0, space, builder.getRelation()) )
+		builder = clips::FactBuilder( fact.substr(0, space) );
+	else builder.clear();
+
+	bool constant = ( (space == std::string::npos) || builder.append( fact.substr(space + 1) ) ) &&
+		builder.append(s);
+	if(!constant)
+		LOG_DEBUG(Engine, "Non-constant fields in a %s fact: asserted by the parser", builder.getRelation().c_str());
+	else if( builder.assertFact() ) return;
+	else LOG_DEBUG(Engine, "%s is not an ordered fact: asserted by the parser", builder.getRelation().c_str());
+	clips::assertString( make_fact(fact, s) );
+}
+
+static inline
+bool is_command(const std::string& m){
+	return (m[0] == 0) && (m.length() > 5);
+}
+
+static inline
+bool is_cancel(const std::string& m){
+	if( !is_command(m) ) return false;
+	if(m[5] == (char)protocol::Opcode::Cancel) return true;
+	static const char* name = protocol::opcodeName(protocol::Opcode::Cancel);
+	static const size_t length = std::strlen(name);
+	return !m.compare(5, length, name) &&
+		( (m.length() == 5 + length) || (m[5 + length] == ' ') || !m[5 + length] );
+}
+
+static inline
+const char* policy_name(SlowConsumerPolicy policy){
+	switch(policy){
+		case SlowConsumerPolicy::Block:      return "block";
+		case SlowConsumerPolicy::Disconnect: return "disconnect";
+		default:                             return "drop";
+	}
+}
+
+static inline
+const char* shard_key_name(ShardKey key){
+	switch(key){
+		case ShardKey::Prefix: return "prefix";
+		case ShardKey::Tag:    return "tag";
+		default:               return "session";
+	}
+}
+
 static inline
 std::string canonicalize_path(std::string path){
 	if (path.length() < 1) return path;
@@ -75,11 +154,26 @@ std::string canonicalize_path(std::string path){
 Server::Server():
 	// clipsFile("cubes.dat"),
 	flgFacts(false), flgRules(false), clppath(get_current_path()),
-	port(5000), acceptorPtr(NULL), defaultMsgInFact("network 0.0.0.0:0"){
+	running(false), traceSampling(1), ioThreads(1), port(5000), acceptorPtr(NULL), defaultMsgInFact("network 0.0.0.0:0"),
+	batchSize(0), batchLatency(std::chrono::milliseconds(5)),
+	sliceTime(std::chrono::milliseconds(10)), sliceRules(0),
+	highWatermark(8 << 20), lowWatermark(4 << 20), slowConsumerPolicy(SlowConsumerPolicy::DropOldest),
+	shardCount(0), shardKey(ShardKey::Session), shardIndex(-1),
+	poolSize(0), zygotePid(0), zygoteFd(-1){
 }
 
 Server::~Server(){
 	stop();
+	if(localAcceptorPtr) unlink( localPath.c_str() );
+	if(zygotePid > 0){
+		kill(zygotePid, SIGTERM);
+		waitpid(zygotePid, NULL, 0);
+	}
+	for(size_t i = 0; i < shardPids.size(); ++i){
+		kill(shardPids[i], SIGTERM);
+		waitpid(shardPids[i], NULL, 0);
+		unlink( shardPaths[i].c_str() );
+	}
 }
 
 
@@ -92,11 +186,27 @@ Server::~Server(){
 bool Server::init(int argc, char **argv){
 	if( !parseArgs(argc, argv) ) return false;
 
+	if(shardCount > 0){
+		// Workers inherit the rule base loaded here
+		initCLIPS(argc, argv);
+		if( !forkShards() ) return false;
+		if( (shardIndex < 0) && (poolSize > 0) && !forkZygote() ) return false;
+		if(shardIndex >= 0){
+			if( !initLocalServer() || !initTrace() ) return false;
+			publishStatus();
+			return true;
+		}
+		if( !initTcpServer() || !initLocalServer() ) return false;
+		return connectShards();
+	}
+
 	if( !initTcpServer() ) return false;
+	if( !initLocalServer() ) return false;
 	// std::this_thread::sleep_for(std::chrono::milliseconds(delay));
 
 	initCLIPS(argc, argv);
-	// publishStatus();
+	if( !initTrace() ) return false;
+	publishStatus();
 
 	return true;
 }
@@ -106,7 +216,7 @@ void Server::initCLIPS(int argc, char **argv){
 	clips::initialize();
 	clips::rerouteStdin(argc, argv);
 	clips::clear();
-	std::cout << "Clips ready" << std::endl;
+	LOG_INFO(Engine, "Clips ready");
 
 	// Load clp files specified in file
 	loadFile(clipsFile);
@@ -121,41 +231,278 @@ void Server::initCLIPS(int argc, char **argv){
 }
 
 
+std::string Server::workerBasePath() const{
+	return localPath.empty() ? "/tmp/clipsserver." + std::to_string(getpid()) : localPath;
+}
+
+
+bool Server::forkShards(){
+	std::string base = workerBasePath();
+	pid_t parent = getpid();
+	// Otherwise every worker prints what is buffered again
+	fflush(stdout);
+	for(size_t i = 0; i < shardCount; ++i){
+		std::string path = base + ".shard" + std::to_string(i);
+		io_context.notify_fork(asio::execution_context::fork_prepare);
+		pid_t pid = fork();
+		if(pid < 0){
+			LOG_ERROR(Shard, "Can't fork shard %lu: %s", i, std::strerror(errno));
+			io_context.notify_fork(asio::execution_context::fork_parent);
+			return false;
+		}
+		if(pid == 0){
+			io_context.notify_fork(asio::execution_context::fork_child);
+			// Workers don't outlive the front end
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			if(getppid() != parent) _exit(0);
+			shardIndex = i;
+			localPath = path;
+			shardPids.clear();
+			shardPaths.clear();
+			return true;
+		}
+		io_context.notify_fork(asio::execution_context::fork_parent);
+		shardPids.push_back(pid);
+		shardPaths.push_back(path);
+	}
+	// The front end only forwards messages. Workers batch them.
+	batchSize = 0;
+	return true;
+}
+
+
+bool Server::forkZygote(){
+	int fds[2];
+	if( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) ){
+		LOG_ERROR(Shard, "Can't create the zygote socket: %s", std::strerror(errno));
+		return false;
+	}
+	enginePath = workerBasePath() + ".engine";
+	pid_t parent = getpid();
+	fflush(stdout);
+	io_context.notify_fork(asio::execution_context::fork_prepare);
+	pid_t pid = fork();
+	if(pid < 0){
+		LOG_ERROR(Shard, "Can't fork the zygote: %s", std::strerror(errno));
+		io_context.notify_fork(asio::execution_context::fork_parent);
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if(pid == 0){
+		io_context.notify_fork(asio::execution_context::fork_child);
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if(getppid() != parent) _exit(0);
+		close(fds[0]);
+		shardPids.clear();
+		shardPaths.clear();
+		// Returns in the engines only
+		runZygote(fds[1]);
+		return true;
+	}
+	io_context.notify_fork(asio::execution_context::fork_parent);
+	close(fds[1]);
+	zygotePid = pid;
+	zygoteFd = fds[0];
+	return true;
+}
+
+
+void Server::runZygote(int fd){
+	// Engines are handed out reset. The zygote reaps them.
+	resetCLIPS();
+	fflush(stdout);
+	signal(SIGCHLD, SIG_IGN);
+	pid_t zygote = getpid();
+	uint32_t seq;
+	while( read(fd, &seq, sizeof(seq)) == sizeof(seq) ){
+		io_context.notify_fork(asio::execution_context::fork_prepare);
+		pid_t pid = fork();
+		if(pid == 0){
+			io_context.notify_fork(asio::execution_context::fork_child);
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			if(getppid() != zygote) _exit(0);
+			close(fd);
+			signal(SIGCHLD, SIG_DFL);
+			shardIndex = EnginePool::FirstIndex + seq;
+			localPath = enginePath + std::to_string(seq);
+			return;
+		}
+		io_context.notify_fork(asio::execution_context::fork_parent);
+		// A negative pid tells the front end the fork failed
+		int32_t reply = pid;
+		if( write(fd, &reply, sizeof(reply)) != sizeof(reply) ) break;
+	}
+	// The front end is gone
+	_exit(0);
+}
+
+
+bool Server::initTrace(){
+	if( tracePath.empty() ) return true;
+	std::string path = tracePath;
+	if(shardIndex >= 0) path+= ".shard" + std::to_string(shardIndex);
+	tracePtr = TraceLog::makeShared(path, traceSampling, shardIndex);
+	if(!tracePtr) return false;
+	LOG_INFO(Server, "Tracing 1 in %lu messages to %s", traceSampling, path.c_str());
+	return true;
+}
+
+
+bool Server::connectShards(){
+	routerPtr.reset( new ShardRouter(*this, shardKey) );
+	for(const std::string& path : shardPaths){
+		if( !routerPtr->addShard(path) ) return false;
+		// Nobody else connects to the worker
+		unlink( path.c_str() );
+	}
+	LOG_INFO(Shard, "Routing to %lu shards by %s", shardPaths.size(), shard_key_name(shardKey));
+	if(zygoteFd >= 0){
+		// The router owns the socket from now on
+		routerPtr->addPool(zygoteFd, enginePath, poolSize);
+		zygoteFd = -1;
+		LOG_INFO(Shard, "Keeping %lu warm engines", poolSize);
+	}
+	return true;
+}
+
+
 bool Server::initTcpServer(){
 
 	tcp::endpoint listen_ep{{}, port};
 	acceptorPtr = std::shared_ptr<tcp::acceptor>(new tcp::acceptor(io_context, listen_ep));
 	acceptorPtr->set_option(tcp::acceptor::reuse_address(true));
 
-	std::shared_ptr<tcp::socket> socketPtr(new tcp::socket(io_context));
+	beginAccept();
+	acceptorPtr->listen();
+	LOG_INFO(Server, "Listening on port %u", port);
+	return true;
+}
+
+
+bool Server::initLocalServer(){
+	if( localPath.empty() ) return true;
+
+	// A socket left behind by a previous run prevents binding.
+	// Anything else at that path is not ours to remove.
+	struct stat st;
+	if( !lstat(localPath.c_str(), &st) && S_ISSOCK(st.st_mode) )
+		unlink( localPath.c_str() );
+	try{
+		asio::local::stream_protocol::endpoint listen_ep(localPath);
+		localAcceptorPtr = std::make_shared<asio::local::stream_protocol::acceptor>(io_context, listen_ep);
+	}
+	catch(const boost::system::system_error& ex){
+		LOG_ERROR(Server, "Can't listen on {%s}: %s", localPath.c_str(), ex.what());
+		return false;
+	}
+
+	beginAcceptLocal();
+	LOG_INFO(Server, "Listening on %s", localPath.c_str());
+	return true;
+}
+
+
+void Server::beginAccept(){
+	std::shared_ptr<StreamSocket> socketPtr(new StreamSocket(io_context));
 	acceptorPtr->async_accept(
 		*socketPtr,
 		boost::bind(&Server::acceptHandler, this, boost::asio::placeholders::error, socketPtr));
-	acceptorPtr->listen();
-	printf("Listening on port %u\n", port);
-	return true;
 }
 
 
-void Server::acceptHandler(const boost::system::error_code& error, std::shared_ptr<tcp::socket> socketPtr){
+void Server::beginAcceptLocal(){
+	std::shared_ptr<StreamSocket> socketPtr(new StreamSocket(io_context));
+	localAcceptorPtr->async_accept(
+		*socketPtr,
+		boost::bind(&Server::acceptLocalHandler, this, boost::asio::placeholders::error, socketPtr));
+}
+
+
+void Server::acceptHandler(const boost::system::error_code& error, std::shared_ptr<StreamSocket> socketPtr){
 	if(!error){
-		auto sp = Session::makeShared(socketPtr, *this);
-		clients[sp->getEndPointStr()] = sp;
-		printf("Connected client %s\n", sp->getEndPointStr().c_str());
-		publishStatus();
+		// Frames are written as soon as they are produced by the CLIPS
+		// thread. Nagle would hold small ones until the previous is ACK'd.
+		boost::system::error_code ec;
+		socketPtr->set_option(tcp::no_delay(true), ec);
+		startSession(socketPtr);
 	}
+	beginAccept();
+}
 
-	std::shared_ptr<tcp::socket> nextSckt(new tcp::socket(io_context));
-	acceptorPtr->async_accept(
-		*nextSckt,
-		boost::bind(&Server::acceptHandler, this, boost::asio::placeholders::error, nextSckt));
+
+void Server::acceptLocalHandler(const boost::system::error_code& error, std::shared_ptr<StreamSocket> socketPtr){
+	if(!error) startSession(socketPtr);
+	beginAcceptLocal();
+}
+
+
+void Server::startSession(std::shared_ptr<StreamSocket> socketPtr){
+	auto sp = Session::makeShared(socketPtr, *this);
+	sp->setWatermarks(highWatermark, lowWatermark);
+	sp->setSlowConsumerPolicy(slowConsumerPolicy);
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex);
+		clients[sp->getEndPointStr()] = sp;
+		updateSessionList();
+	}
+	sp->start();
+	LOG_INFO(Network, "Connected client %s", sp->getEndPointStr().c_str());
+	// CLIPS can't be queried from an I/O thread. Send the latest status.
+	// It has not changed, so there is no need to broadcast it.
+	std::unique_lock<std::mutex> lock(statusMutex);
+	FramePtr status = statusFrame;
+	lock.unlock();
+	sp->send(status, true);
 }
 
 
 void Server::removeSession(const std::string& srep){
-	if(clients.count( srep ) < 1) return;
-	auto disconnected = clients[srep];
-	clients.erase( srep );
+	{
+		std::lock_guard<std::mutex> lock(clientsMutex);
+		if( clients.erase( srep ) ) updateSessionList();
+	}
+	if(routerPtr) routerPtr->releaseEngine(srep);
+}
+
+
+bool Server::attachShm(const std::string& name, std::shared_ptr<Session> session){
+	// Only objects created by clipsclient, and only through local sockets
+	if( localPath.empty() || name.compare(0, sizeof(shm::NamePrefix) - 1, shm::NamePrefix) ||
+		(name.find('/', 1) != std::string::npos) ||
+		(session->getEndPointStr().compare(0, 5, "unix:")) ){
+		LOG_WARNING(Network, "Client %s requested an invalid shared memory channel.",
+			session->getEndPointStr().c_str());
+		return false;
+	}
+	auto sp = ShmSession::makeShared(name, session->getProtocolVersion(), *this);
+	if(!sp) return false;
+	sp->setWatermarks(highWatermark, lowWatermark);
+	sp->setSlowConsumerPolicy(slowConsumerPolicy);
+	{
+		// From now on the socket is only used to detect disconnection
+		std::lock_guard<std::mutex> lock(clientsMutex);
+		clients.erase( session->getEndPointStr() );
+		clients[sp->getEndPointStr()] = sp;
+		updateSessionList();
+	}
+	session->setCompanion(sp);
+	sp->start();
+	LOG_INFO(Network, "Client %s moved to %s", session->getEndPointStr().c_str(), sp->getEndPointStr().c_str());
+	std::unique_lock<std::mutex> lock(statusMutex);
+	FramePtr status = statusFrame;
+	lock.unlock();
+	sp->send(status, true);
+	return true;
+}
+
+
+void Server::updateSessionList(){
+	auto list = std::make_shared<std::vector<ConnectionPtr>>();
+	list->reserve(clients.size());
+	for(auto it = clients.begin(); it != clients.end(); ++it)
+		list->push_back(it->second);
+	sessionList = list;
 }
 
 
@@ -166,39 +513,47 @@ void Server::removeSession(const std::string& srep){
 * *** *******************************************************/
 void Server::assertFact(const std::string& s, const std::string& fact, bool resetFactListChanged) {
 	std::string f = fact.empty() ? defaultMsgInFact : fact;
-	std::string as = "(" + fact + " " + s + ")";
-	clips::assertString( as );
+	assert_fact(f, s);
 	if(resetFactListChanged)
 		clips::setFactListChanged(0);
-	printf("Asserted string %s\n", as.c_str());
+	LOG_DEBUG(Engine, "Asserted string %s", make_fact(f, s).c_str());
 }
 
 
 void Server::clearCLIPS(){
 	clips::clear();
-	printf("KDB cleared (clear)\n");
+	LOG_INFO(Engine, "KDB cleared (clear)");
 }
 
 
 void Server::resetCLIPS(){
 	clips::reset();
-	printf("KDB reset (reset)\n");
+	LOG_INFO(Engine, "KDB reset (reset)");
+}
+
+
+bool Server::freshCLIPS(){
+	clips::clear();
+	bool loaded = clipsFile.empty() || loadFile(clipsFile);
+	clips::reset();
+	LOG_INFO(Engine, "KDB restarted (fresh)");
+	return loaded;
 }
 
 
 bool Server::sendCommand(std::string const& s){
-	printf("Executing command: %s\n", s.c_str());
+	LOG_DEBUG(Engine, "Executing command: %s", s.c_str());
 	return clips::sendCommand(s);
 }
 
 
 bool Server::loadClp(const std::string& fpath){
-	printf("Loading file '%s'...\n", fpath.c_str() );
+	LOG_INFO(Engine, "Loading file '%s'...", fpath.c_str() );
 	if( !clips::load( canonicalize_path(fpath) ) ){
-		printf("Error in file '%s' or does not exist\n", fpath.c_str());
+		LOG_ERROR(Engine, "Error in file '%s' or does not exist", fpath.c_str());
 		return false;
 	}
-	printf("File %s loaded successfully\n", fpath.c_str());
+	LOG_INFO(Engine, "File %s loaded successfully", fpath.c_str());
 	return true;
 }
 
@@ -209,7 +564,7 @@ bool Server::loadDat(const std::string& fpath){
 	fs.open( canonicalize_path(fpath) );
 
 	if( fs.fail() || !fs.is_open() ){
-		fprintf(stderr, "File '%s' does not exists\n", fpath.c_str());
+		LOG_ERROR(Engine, "File '%s' does not exists", fpath.c_str());
 		return false;
 	}
 
@@ -218,7 +573,7 @@ bool Server::loadDat(const std::string& fpath){
 	std::string here = get_current_path();
 	split_path(fpath, fdir, fname);
 	if(!fdir.empty()) chdir(fdir.c_str());
-	printf("Loading '%s'...\n", fname.c_str());
+	LOG_INFO(Engine, "Loading '%s'...", fname.c_str());
 	while(!err && std::getline(fs, line) ){
 		if(line.empty()) continue;
 		// size_t slashp = fpath.rfind("/");
@@ -227,14 +582,14 @@ bool Server::loadDat(const std::string& fpath){
 	}
 	fs.close();
 	chdir(here.c_str());
-	printf(err? "Aborted.\n" : "Done.");
+	LOG_INFO(Engine, err ? "Aborted." : "Done.");
 
 	return !err;
 }
 
 
 bool Server::loadFile(std::string const& fpath){
-	printf("Current path '%s'\n", get_current_path().c_str() );
+	LOG_INFO(Server, "Current path '%s'", get_current_path().c_str() );
 	if(ends_with(fpath, ".dat"))
 		return loadDat(fpath);
 	else if(ends_with(fpath, ".clp"))
@@ -243,8 +598,16 @@ bool Server::loadFile(std::string const& fpath){
 }
 
 
-void Server::enqueueTcpMessage(std::shared_ptr<TcpMessage> messagePtr){
-	queue.produce(messagePtr);
+bool Server::enqueueTcpMessage(const std::shared_ptr<TcpMessage>& messagePtr){
+	// The front end forwards cancel commands like any other
+	if( !routerPtr && is_cancel( messagePtr->getMessage() ) ){
+		cancelRun(messagePtr);
+		return true;
+	}
+	messagePtr->stamp(trace::Enqueued);
+	// Wakes up the CLIPS thread if parked. I/O threads must not wait for
+	// room: the CLIPS thread may itself be waiting for them (Block policy).
+	return queue.tryProduce(messagePtr);
 }
 
 /**
@@ -257,97 +620,482 @@ void Server::enqueueTcpMessage(std::shared_ptr<TcpMessage> messagePtr){
 void Server::parseMessage(std::shared_ptr<TcpMessage> msg){
 	std::string& m = msg->getMessage();
 
-	if((m[0] == 0) && (m.length() > 5)){
+	// Front end of a sharded server
+	if(routerPtr){
+		if( is_command(m) ) routerPtr->routeCommand(msg);
+		else routerPtr->routeMessage(msg);
+		return;
+	}
+
+	if( deferIfBusy(msg) ) return;
+	msg->stamp(trace::Dequeued);
+	protocol::Opcode opcode = protocol::Opcode::None;
+	if( is_command(m) ){
 		std::string result;
-		bool success = handleCommand(m.substr(5), result);
+		uint64_t rules = metrics.getRulesFired();
+		msg->stamp(trace::EngineStart);
+		executing = msg;
+		bool success = handleCommand(msg->getSource(), m.data() + 5, m.length() - 5, result, opcode);
+		executing.reset();
+		// Suspended between slices: completed by resumeRun()
+		if( slicedRun && (slicedRun->message == msg) ) return;
+		msg->stamp(trace::EngineEnd);
+		if(tracePtr) traceMessage(msg, opcode, true, success, metrics.getRulesFired() - rules);
 		acknowledgeMessage(msg, success, result);
-		return;
 	}
+	else{
+		std::string& ep = msg->getSource();
+		msg->stamp(trace::EngineStart);
+		assertFact(m, "network " + ep);
+		msg->stamp(trace::EngineEnd);
+		if(tracePtr) traceMessage(msg, opcode, false, true, 0);
+	}
+	auto dequeued = msg->getStamp(trace::Dequeued);
+	metrics.recordMessage(opcode, dequeued - msg->getStamp(trace::Enqueued), std::chrono::steady_clock::now() - dequeued);
+}
+
+
+void Server::processBatch(){
+	typedef std::chrono::steady_clock Clock;
+	size_t facts = 0;
+	Clock::time_point deadline = Clock::now() + batchLatency;
+
+	metrics.sampleQueue( queue.size() );
+	queue.consumeAll(batch, batchSize);
+	for(auto it = batch.begin(); it != batch.end(); ++it){
+		std::string& m = (*it)->getMessage();
+		if( deferIfBusy(*it) ) continue;
+		if( is_command(m) ){
+			parseMessage(*it);
+			flushAcksIfDue();
+		}
+		else{
+			// Rules fired by the batch are not attributed to its messages
+			auto dequeued = Clock::now();
+			(*it)->stamp(trace::Dequeued, dequeued);
+			(*it)->stamp(trace::EngineStart, dequeued);
+			assert_fact("network " + (*it)->getSource(), m);
+			(*it)->stamp(trace::EngineEnd);
+			++facts;
+			if(tracePtr) traceMessage(*it, protocol::Opcode::None, false, true, 0);
+			metrics.recordMessage(protocol::Opcode::None, dequeued - (*it)->getStamp(trace::Enqueued), Clock::now() - dequeued);
+		}
+		if( facts && (Clock::now() >= deadline) ){
+			runBatchAgenda(facts);
+			facts = 0;
+			deadline = Clock::now() + batchLatency;
+		}
+	}
+	batch.clear();
+	runBatchAgenda(facts);
+}
 
-	std::string& ep = msg->getSource();
-	assertFact(m, "network " + ep);
+
+void Server::runBatchAgenda(size_t facts){
+	// A suspended command fires the rules when resumed
+	if( (facts < 1) || slicedRun ) return;
+	clips::setFactListChanged(0);
+	int fired = clips::run();
+	metrics.recordRules(fired);
+	LOG_DEBUG(Engine, "Batch: %lu facts asserted, %d rules fired", facts, fired);
 }
 
 
+/**
+ * Commands served while a run, query or stream command is suspended,
+ * indexed by opcode. The rest need the engine to themselves and wait.
+ */
+static const bool interleaved[(size_t)protocol::Opcode::Count] = {
+	/* None   */ true,
+	/* Assert */ true,
+	/* Reset  */ false,
+	/* Clear  */ false,
+	/* Query  */ false,
+	/* Raw    */ false,
+	/* Path   */ true,
+	/* Print  */ true,
+	/* Watch  */ true,
+	/* Load   */ false,
+	/* Run    */ false,
+	/* Log    */ true,
+	/* Fresh  */ false,
+	/* Stats  */ true,
+	/* AssertBatch */ true,
+	/* Stream */ false,
+	/* Cancel */ true,
+};
+
+
 static inline
-void splitCommand(const std::string& s, std::string& cmd, std::string& arg){
-	std::string::size_type sp = s.find(" ");
-	if(sp == std::string::npos){
-		// Trims leading zeroes from command, if any.
-		cmd = s.substr(0, s.find_first_of( (char)0 ));
-		arg.clear();
+bool decode_int(const std::string& arg, bool binary, int32_t& n){
+	if(binary){
+		if(arg.length() != sizeof(n)) return false;
+		std::memcpy(&n, arg.data(), sizeof(n));
+		return true;
 	}
-	else{
-		cmd = s.substr(0, sp);
-		arg = s.substr(sp+1);
-		// Trims leading zeroes from arg, if any.
-		arg.erase(arg.find_first_of( (char)0 ));
-	}
-}
-
-
-bool Server::handleCommand(const std::string& c, std::string& result){
-	std::string cmd, arg;
-	splitCommand(c, cmd, arg);
-
-	// if( arg.empty() ) printf("Received command {%s} (%lu bytes)\n", cmd.c_str(), cmd.length());
-	// else              printf("Received command {%s %s} (%lu bytes)\n", cmd.c_str(), arg.c_str(), cmd.length() + arg.length() + 1);
-	if(cmd == "assert")     { clips::assertString(arg); return true; }
-	else if(cmd == "reset") { resetCLIPS();             return true; }
-	else if(cmd == "clear") { clearCLIPS();             return true; }
-	else if(cmd == "query") { return clips::query(arg, result); }
-	else if(cmd == "raw")   { return sendCommand(arg); }
-	else if(cmd == "path")  { return handlePath(arg); }
-	else if(cmd == "print") { return handlePrint(arg); }
-	else if(cmd == "watch") { return handleWatch(arg); }
-	else if(cmd == "load")  { return loadFile(arg); }
-	else if(cmd == "run")   { return handleRun(arg); }
-	else if(cmd == "log")   { return handleLog(arg); }
-	// printf("Rejected\n");
-	return false;
+	try{ n = std::stoi(arg); }
+	catch(...){ return false; }
+	return true;
 }
 
 
-bool Server::handleLog(const std::string& arg){
-	return true;
+template<class E>
+static inline
+E decode_item(const std::string& arg, bool binary, const char* (*nameOf)(E)){
+	if(!binary) return protocol::findByName<E>(arg.c_str(), arg.length(), nameOf);
+	if( (arg.length() != 1) || ((uint8_t)arg[0] >= (uint8_t)E::Count) ) return E::None;
+	return (E)arg[0];
+}
+
+
+bool Server::handleCommand(const std::string& source, const char* c, size_t length, std::string& result, protocol::Opcode& opcode){
+	typedef bool (*CommandHandler)(Server& srv, const std::string& source, const std::string& arg, bool binary, std::string& result);
+	// Indexed by opcode
+	static const CommandHandler handlers[(size_t)protocol::Opcode::Count] = {
+		/* None   */ nullptr,
+		/* Assert */ [](Server&, const std::string&, const std::string& arg, bool, std::string&){ clips::assertString(arg); return true; },
+		/* Reset  */ [](Server& srv, const std::string&, const std::string&, bool, std::string&){ srv.resetCLIPS(); return true; },
+		/* Clear  */ [](Server& srv, const std::string&, const std::string&, bool, std::string&){ srv.clearCLIPS(); return true; },
+		/* Query  */ [](Server& srv, const std::string&, const std::string& arg, bool, std::string& result){ return srv.handleQuery(arg, result); },
+		/* Raw    */ [](Server& srv, const std::string&, const std::string& arg, bool, std::string&){ return srv.sendCommand(arg); },
+		/* Path   */ [](Server& srv, const std::string&, const std::string& arg, bool, std::string&){ return srv.handlePath(arg); },
+		/* Print  */ [](Server& srv, const std::string&, const std::string& arg, bool binary, std::string&){
+			return srv.handlePrint( decode_item(arg, binary, protocol::printItemName) );
+		},
+		/* Watch  */ [](Server& srv, const std::string&, const std::string& arg, bool binary, std::string&){
+			if( arg.empty() ) return srv.handleWatch(protocol::WatchItem::None);
+			protocol::WatchItem item = decode_item(arg, binary, protocol::watchItemName);
+			return (item != protocol::WatchItem::None) && srv.handleWatch(item);
+		},
+		/* Load   */ [](Server& srv, const std::string&, const std::string& arg, bool, std::string&){ return srv.loadFile(arg); },
+		/* Run    */ [](Server& srv, const std::string&, const std::string& arg, bool binary, std::string& result) -> bool {
+			int32_t n;
+			return decode_int(arg, binary, n) && srv.handleRun(n, result);
+		},
+		/* Log    */ [](Server& srv, const std::string&, const std::string& arg, bool, std::string& result){ return srv.handleLog(arg, result); },
+		/* Fresh  */ [](Server& srv, const std::string&, const std::string&, bool, std::string&){ return srv.freshCLIPS(); },
+		/* Stats  */ [](Server& srv, const std::string& source, const std::string& arg, bool, std::string& result){
+			return srv.handleStats(source, arg, result);
+		},
+		/* AssertBatch */ [](Server& srv, const std::string&, const std::string& arg, bool, std::string& result){
+			return srv.handleAssertBatch(arg, result);
+		},
+		/* Stream */ [](Server& srv, const std::string& source, const std::string& arg, bool, std::string& result){
+			return srv.handleStream(source, arg, result);
+		},
+		// Served by cancelRun() as soon as it is received
+		/* Cancel */ [](Server&, const std::string&, const std::string&, bool, std::string&){ return false; },
+	};
+
+	std::string arg;
+	bool binary;
+	opcode = protocol::decodeCommand(c, length, arg, binary);
+	if(opcode == protocol::Opcode::None) return false;
+	return handlers[(size_t)opcode](*this, source, arg, binary, result);
+}
+
+
+bool Server::handleAssertBatch(const std::string& facts, std::string& result){
+	int failed;
+	size_t asserted = clips::assertBatch(facts, failed);
+	result = std::to_string(asserted) + " " + std::to_string(failed);
+	if(failed < 0) LOG_INFO(Engine, "Asserted %lu facts", asserted);
+	else LOG_WARNING(Engine, "Asserted %lu facts. Fact %d has errors.", asserted, failed);
+	return failed < 0;
+}
+
+
+bool Server::handleLog(const std::string& arg, std::string& result){
+	return Logger::getInstance().configure(arg, result);
 }
 
 
 bool Server::handlePath(const std::string& path){
 	std::string cpath = canonicalize_path(path);
 	if(chdir( cpath.c_str() ) != 0){
-		fprintf(stderr, "Can't access {%s}: %s\n", path.c_str(), std::strerror(errno));
-		printf("Reset clppath to {%s}\n", clppath.c_str() );
+		LOG_ERROR(Server, "Can't access {%s}: %s", path.c_str(), std::strerror(errno));
+		LOG_INFO(Server, "Reset clppath to {%s}", clppath.c_str() );
 		return false;
 	}
 	clppath = cpath;
-	printf("clppath set to {%s}\n", clppath.c_str() );
+	LOG_INFO(Server, "clppath set to {%s}", clppath.c_str() );
 	publishStatus();
 	return true;
 }
 
 
-bool Server::handlePrint(const std::string& arg){
-	if(arg == "facts"){       clips::printFacts();  }
-	else if(arg == "rules"){  clips::printRules();  }
-	else if(arg == "agenda"){ clips::printAgenda(); }
+bool Server::handlePrint(protocol::PrintItem item){
+	switch(item){
+		case protocol::PrintItem::Facts:  clips::printFacts();  break;
+		case protocol::PrintItem::Rules:  clips::printRules();  break;
+		case protocol::PrintItem::Agenda: clips::printAgenda(); break;
+		default: return false;
+	}
+	return true;
+}
+
+
+bool Server::handleRun(int32_t n, std::string& result){
+	return startRun(protocol::Opcode::Run, n, result);
+}
+
+
+bool Server::handleQuery(const std::string& query, std::string& result){
+	clips::QueryRouter& qr = clips::QueryRouter::getInstance();
+	qr.read();
+	qr.enable();
+	bool injected = clips::sendCommand(query, true);
+	qr.disable();
+	return injected && startRun(protocol::Opcode::Query, -1, result);
+}
+
+
+bool Server::handleStats(const std::string& source, const std::string& arg, std::string& result){
+	if( arg.empty() ){
+		printStats(result);
+		return true;
+	}
+	if(arg == "reset") metrics.reset();
+	else if(arg == "subscribe") statsSubscribers.insert(source);
+	else if(arg == "unsubscribe") statsSubscribers.erase(source);
 	else return false;
 	return true;
 }
 
 
-int Server::handleRun(const std::string& arg){
-	int n = std::stoi(arg);
-	return clips::run(n);
+bool Server::handleStream(const std::string& source, const std::string& query, std::string& result){
+	ConnectionPtr session = getSession(source);
+	// Output must not overtake the acks of earlier commands
+	flushAcks();
+	std::string header = executing->getMessage().substr(0, 5) + protocol::PartialResult;
+	clips::QueryRouter& qr = clips::QueryRouter::getInstance();
+	qr.read();
+	// The handler outlives this call if the command is suspended
+	qr.stream([session, header](const std::string& output){
+		if(session) session->send(header + output);
+	}, StreamChunkSize, StreamLatency);
+	qr.enable();
+	bool injected = clips::sendCommand(query, true);
+	qr.disable();
+	if(!injected){
+		qr.stream(nullptr, 0, std::chrono::milliseconds(0));
+		result = "0";
+		return false;
+	}
+	return startRun(protocol::Opcode::Stream, -1, result);
+}
+
+
+bool Server::startRun(protocol::Opcode opcode, int32_t limit, std::string& result){
+	slicedRun.reset( new SlicedRun{executing, opcode, limit, 0} );
+	{
+		// From now on the command can be halted by cancelRun()
+		std::lock_guard<std::mutex> lock(cancelMutex);
+		runningSource = executing->getSource();
+		runningId = executing->getMessage().substr(1, 4);
+	}
+	// Suspended: the ack is sent by resumeRun()
+	if( !runSlice() ) return false;
+	return finishRun(result);
+}
+
+
+bool Server::runSlice(){
+	SlicedRun& r = *slicedRun;
+	clips::QueryRouter& qr = clips::QueryRouter::getInstance();
+	// Output is captured during the slices only
+	bool capture = (r.opcode != protocol::Opcode::Run);
+	int32_t max = r.limit;
+	if( (sliceRules > 0) && ( (max < 0) || (max > sliceRules) ) ) max = sliceRules;
+
+	bool expired = false;
+	if(capture) qr.enable();
+	int fired = (sliceTime.count() > 0) ? clips::run(max, sliceTime, expired) : clips::run(max);
+	if(capture) qr.disable();
+	// Streamed output does not wait for the next slice
+	if(r.opcode == protocol::Opcode::Stream) qr.flush();
+
+	r.fired+= fired;
+	if(r.limit > 0) r.limit-= fired;
+	metrics.recordRules(fired);
+	// Over when the agenda is empty or the limit is reached
+	return !expired && ( (max < 0) || (fired < max) || (r.limit == 0) );
+}
+
+
+void Server::resumeRun(){
+	if( !runSlice() ) return;
+
+	std::shared_ptr<TcpMessage> msg = slicedRun->message;
+	protocol::Opcode opcode = slicedRun->opcode;
+	int fired = slicedRun->fired;
+	std::string result;
+	bool success = finishRun(result);
+	msg->stamp(trace::EngineEnd);
+	if(tracePtr) traceMessage(msg, opcode, true, success, fired);
+	acknowledgeMessage(msg, success, result);
+	auto dequeued = msg->getStamp(trace::Dequeued);
+	metrics.recordMessage(opcode, dequeued - msg->getStamp(trace::Enqueued), std::chrono::steady_clock::now() - dequeued);
+
+	replayDeferred();
+}
+
+
+bool Server::finishRun(std::string& result){
+	std::unique_ptr<SlicedRun> r = std::move(slicedRun);
+	std::vector<std::shared_ptr<TcpMessage>> halters;
+	{
+		// The halt request is withdrawn along with the command, so
+		// a late cancel can't halt the next one
+		std::lock_guard<std::mutex> lock(cancelMutex);
+		runningSource.clear();
+		halters.swap(cancellers);
+		clips::clearHalt();
+	}
+	if( !halters.empty() )
+		LOG_INFO(Engine, "%s halted after %d rules", protocol::opcodeName(r->opcode), r->fired);
+	for(auto& msg : halters)
+		acknowledgeMessage(msg, true, std::to_string(r->fired));
+
+	clips::QueryRouter& qr = clips::QueryRouter::getInstance();
+	switch(r->opcode){
+		case protocol::Opcode::Query:
+			result = qr.read();
+			return r->fired > 0;
+		case protocol::Opcode::Stream:
+			// Sends what is left before streaming stops
+			qr.stream(nullptr, 0, std::chrono::milliseconds(0));
+			result = std::to_string(r->fired);
+			return true;
+		default:
+			return r->fired > 0;
+	}
+}
+
+
+void Server::cancelRun(const std::shared_ptr<TcpMessage>& msg){
+	const std::string& m = msg->getMessage();
+	std::string arg;
+	bool binary;
+	protocol::decodeCommand(m.data() + 5, m.length() - 5, arg, binary);
+	uint32_t cmdId = 0;
+	bool scoped = !arg.empty();
+	if( !scoped || protocol::decodeCommandId(arg, binary, cmdId) ){
+		std::lock_guard<std::mutex> lock(cancelMutex);
+		// Clients can only halt their own commands
+		bool matches = (runningSource == msg->getSource()) &&
+			( !scoped || !std::memcmp(runningId.data(), &cmdId, sizeof(cmdId)) );
+		if(matches){
+			// Acknowledged by finishRun()
+			cancellers.push_back(msg);
+			clips::requestHalt();
+			return;
+		}
+	}
+	ConnectionPtr session = getSession( msg->getSource() );
+	if(session) session->send( m.substr(0, 5) + '\x00' );
+}
+
+
+bool Server::deferIfBusy(const std::shared_ptr<TcpMessage>& msg){
+	if(!slicedRun) return false;
+	const std::string& m = msg->getMessage();
+	const std::string& source = msg->getSource();
+	protocol::Opcode opcode = protocol::Opcode::None;
+	if( is_command(m) ){
+		std::string arg;
+		bool binary;
+		opcode = protocol::decodeCommand(m.data() + 5, m.length() - 5, arg, binary);
+	}
+	bool wait;
+	if(shardIndex < 0){
+		// Messages of a client are served in order
+		wait = (source == slicedRun->message->getSource()) || deferredSources.count(source) ||
+			!interleaved[(size_t)opcode];
+	}
+	else{
+		// Workers receive everything from the front end and can't tell its
+		// clients apart. Only stats and log, which don't depend on the order
+		// of other commands, are served there.
+		wait = (opcode != protocol::Opcode::Stats) && (opcode != protocol::Opcode::Log);
+	}
+	if(!wait) return false;
+	deferred.push_back(msg);
+	deferredSources.insert(source);
+	return true;
+}
+
+
+void Server::replayDeferred(){
+	std::deque<std::shared_ptr<TcpMessage>> waiting;
+	waiting.swap(deferred);
+	deferredSources.clear();
+	size_t facts = 0;
+	// A command may be suspended again, deferring the rest once more
+	for(auto& msg : waiting){
+		if( (batchSize > 0) && !slicedRun && !is_command( msg->getMessage() ) ) ++facts;
+		parseMessage(msg);
+	}
+	runBatchAgenda(facts);
 }
 
 
-bool Server::handleWatch(const std::string& arg){
-	if(arg == "functions"){    clips::toggleWatch(clips::WatchItem::Deffunctions); }
-	else if(arg == "globals"){ clips::toggleWatch(clips::WatchItem::Globals);      }
-	else if(arg == "facts"){   clips::toggleWatch(clips::WatchItem::Facts);        }
-	else if(arg == "rules"){   clips::toggleWatch(clips::WatchItem::Rules);        }
-	else if( !arg.empty() ) return false;
+void Server::printStats(std::string& report){
+	char buf[128];
+	if(shardIndex >= 0) report+= "shard:" + std::to_string(shardIndex) + "\n";
+	metrics.print(report);
+	snprintf(buf, sizeof(buf), "queue.depth:%lu capacity=%lu\n", queue.size(), queue.capacity());
+	report+= buf;
+	snprintf(buf, sizeof(buf), "facts:%ld\nactivations:%ld\n",
+		clips::getNumberOfFacts(), clips::getNumberOfActivations());
+	report+= buf;
+	snprintf(buf, sizeof(buf), "memory:used=%ld requests=%ld\n", clips::memUsed(), clips::memRequests());
+	report+= buf;
+
+	std::unique_lock<std::mutex> lock(clientsMutex);
+	auto sessions = sessionList;
+	lock.unlock();
+	size_t count = 0, queued = 0, dropped = 0;
+	if(sessions){
+		for(auto& session : *sessions){
+			++count;
+			queued+= session->getQueuedBytes();
+			dropped+= session->getDroppedFrames();
+		}
+	}
+	snprintf(buf, sizeof(buf), "sessions:count=%lu queued=%lu dropped=%lu\n", count, queued, dropped);
+	report+= buf;
+}
+
+
+void Server::pushStats(){
+	if( statsSubscribers.empty() ) return;
+	std::string s(1, '\0');
+	s.append( (const char*)&protocol::StatsCommandId, sizeof(protocol::StatsCommandId) );
+	s+= '\x01';
+	printStats(s);
+	FramePtr frame = Frame::makeShared( std::move(s) );
+	for(auto it = statsSubscribers.begin(); it != statsSubscribers.end(); ){
+		ConnectionPtr session = getSession(*it);
+		// Subscriptions end with the session
+		if(!session){
+			it = statsSubscribers.erase(it);
+			continue;
+		}
+		session->send(frame, true);
+		++it;
+	}
+}
+
+
+bool Server::handleWatch(protocol::WatchItem item){
+	switch(item){
+		case protocol::WatchItem::Functions: clips::toggleWatch(clips::WatchItem::Deffunctions); break;
+		case protocol::WatchItem::Globals:   clips::toggleWatch(clips::WatchItem::Globals);      break;
+		case protocol::WatchItem::Facts:     clips::toggleWatch(clips::WatchItem::Facts);        break;
+		case protocol::WatchItem::Rules:     clips::toggleWatch(clips::WatchItem::Rules);        break;
+		default: break;
+	}
 	publishStatus();
 	return true;
 }
@@ -357,13 +1105,75 @@ void Server::acknowledgeMessage(std::shared_ptr<TcpMessage> message, bool succes
 	// 1. Copy 5bytes 0x00+CommandID from original message. Discard the rest.
 	// 2. Place success as 1byte boolean
 	// 3. Append result if any.
-	// 4. Send
+	// 4. Send. Acks are held until the queue is drained (see flushAcks)
 
 	std::string ack = message->getMessage().substr(0, 5);
 	ack+= success ? '\x01' : '\x00';
 	ack+= result;
 
-	clients[message->getSource()]->send( ack );
+	// Pipelined commands usually come from the same client
+	ConnectionPtr session;
+	if( !pendingAcks.empty() && (pendingAcks.back().first->getEndPointStr() == message->getSource()) )
+		session = pendingAcks.back().first;
+	else session = getSession( message->getSource() );
+	if(!session) return;
+
+	FramePtr frame = Frame::makeShared( std::move(ack) );
+	// Results over 64KB can't be sent unless the client negotiated
+	// extended frames, nor results over protocol::MaxPayload at all.
+	// Report a failure rather than leaving it waiting.
+	if( !frame->isValid() ){
+		LOG_WARNING(Network, "Can't send %lu bytes to client %s: payload too large.",
+			frame->getPayload().length(), message->getSource().c_str());
+		frame = Frame::makeShared( message->getMessage().substr(0, 5) + '\x00' );
+	}
+	else if( frame->isExtended() && (session->getProtocolVersion() < 2) ){
+		LOG_WARNING(Network, "Can't send %lu bytes to client %s: extended frames not negotiated.",
+			frame->getPayload().length(), message->getSource().c_str());
+		frame = Frame::makeShared( message->getMessage().substr(0, 5) + '\x00' );
+	}
+	if( pendingAcks.empty() )
+		ackDeadline = std::chrono::steady_clock::now() + MaxAckDelay;
+	pendingAcks.push_back( std::make_pair(session, frame) );
+	if(pendingAcks.size() >= MaxPendingAcks) flushAcks();
+}
+
+
+void Server::flushAcksIfDue(){
+	if( !pendingAcks.empty() && (std::chrono::steady_clock::now() >= ackDeadline) )
+		flushAcks();
+}
+
+
+void Server::flushAcks(){
+	std::vector<FramePtr> frames;
+	auto it = pendingAcks.begin();
+	while(it != pendingAcks.end()){
+		// Consecutive acks of the same session are sent in a single write
+		ConnectionPtr session = it->first;
+		for(; (it != pendingAcks.end()) && (it->first == session); ++it)
+			frames.push_back( it->second );
+		session->send( frames );
+		frames.clear();
+	}
+	pendingAcks.clear();
+
+	if( tracedMessages.empty() ) return;
+	auto written = std::chrono::steady_clock::now();
+	for(auto& t : tracedMessages){
+		t.message->stamp(trace::AckWritten, written);
+		tracePtr->write(*t.message, t.sequence, t.opcode, true, t.success, t.rulesFired);
+	}
+	tracedMessages.clear();
+}
+
+
+void Server::traceMessage(const std::shared_ptr<TcpMessage>& message, protocol::Opcode opcode,
+	bool command, bool success, int rulesFired){
+	uint64_t sequence = tracePtr->sample();
+	if(!sequence) return;
+	if(command) tracedMessages.push_back( TracedMessage{message, sequence, opcode, success, rulesFired} );
+	else tracePtr->write(*message, sequence, opcode, false, true, rulesFired);
 }
 
 
@@ -374,29 +1184,59 @@ void Server::acknowledgeMessage(std::shared_ptr<TcpMessage> message, bool succes
 *
 * *** *******************************************************/
 bool Server::broadcast(const std::string& message){
-	for(auto it = clients.begin(); it != clients.end(); ++it)
-		it->second->send( message );
+	return broadcast( Frame::makeShared(message) );
+}
+
+
+bool Server::broadcast(const FramePtr& frame){
+	// Sending may block (Block policy), so the lock is not held meanwhile
+	std::unique_lock<std::mutex> lock(clientsMutex);
+	auto sessions = sessionList;
+	lock.unlock();
+	if(!sessions) return true;
+	// The frame is encoded once and shared by all sessions
+	for(auto& session : *sessions)
+		session->send( frame, true );
 	return true;
 }
 
 
 bool Server::sendTo(const std::string& cliEP, const std::string& message){
-	if (clients.find(cliEP) == clients.end()){
-		fprintf(stderr, "Client %s disconnected or does not exist", cliEP.c_str());
+	ConnectionPtr session = getSession(cliEP);
+	if( !session && (shardIndex >= 0) ){
+		// Clients are connected to the front end. Relay the message to it.
+		std::string relay(1, ShardRouter::RelayMarker);
+		relay+= cliEP;
+		relay+= '\0';
+		relay+= message;
+		return broadcast( Frame::makeShared( std::move(relay) ) );
+	}
+	if(!session){
+		LOG_WARNING(Network, "Client %s disconnected or does not exist", cliEP.c_str());
 		return false;
 	}
-	clients[cliEP]->send( message );
-	return true;
+	return session->send( message );
 }
 
 
-bool Server::publishStatus(){
-	std::string status;
-	status+= '\0';
-	status+= "\xff\xff\xff\xff\x01watching:" + std::to_string((int)clips::getWatches());
-	status+= "|path:" + clppath;
+ConnectionPtr Server::getSession(const std::string& cliEP){
+	std::lock_guard<std::mutex> lock(clientsMutex);
+	auto it = clients.find(cliEP);
+	return (it != clients.end()) ? it->second : NULL;
+}
 
-	return broadcast(status);
+
+bool Server::publishStatus(){
+	std::string s;
+	s+= '\0';
+	s+= "\xff\xff\xff\xff\x01watching:" + std::to_string((int)clips::getWatches());
+	s+= "|path:" + clppath;
+	FramePtr frame = Frame::makeShared( std::move(s) );
+	{
+		std::lock_guard<std::mutex> lock(statusMutex);
+		statusFrame = frame;
+	}
+	return broadcast(frame);
 }
 
 
@@ -407,6 +1247,8 @@ bool Server::publishStatus(){
 * *** *******************************************************/
 void Server::stop(){
 	running = false;
+	// Wakes up run() if waiting for messages
+	queue.interrupt();
 	if(asyncThread.joinable())
 		asyncThread.join();
 }
@@ -420,15 +1262,50 @@ void Server::runAsync(){
 void Server::run(){
 	if(running) return;
 	running = true;
-	// Loop forever
+	// Forks are over: from now on log messages are written in the background
+	Logger::getInstance().start();
+	// Keeps the I/O threads running even if no async operation is pending
+	auto work = asio::make_work_guard(io_context);
+	io_context.restart();
+	for(size_t i = 0; i < ioThreads; ++i)
+		ioThreadPool.push_back( std::thread([this](){ io_context.run(); }) );
+
+	// CLIPS runs only in this thread
+	std::shared_ptr<TcpMessage> msg;
 	while(running){
-		io_context.poll();
-		if( queue.empty() ){
-			std::this_thread::sleep_for(std::chrono::milliseconds(20));
-			continue;
+		// Sleeps until sessions enqueue a message, stop() is called
+		// or the stats interval is over. A suspended command does not wait.
+		if(!slicedRun) queue.wait( metrics.untilTick(std::chrono::steady_clock::now()) );
+		// While a command is suspended only the messages queued so far
+		// are served before it is resumed
+		if(batchSize > 0){
+			while( running && !queue.empty() ){
+				processBatch();
+				if(slicedRun) break;
+			}
+		}
+		else{
+			size_t backlog = queue.size();
+			while( running && (!slicedRun || (backlog-- > 0)) && queue.tryConsume(msg) ){
+				metrics.sampleQueue( queue.size() + 1 );
+				parseMessage( msg );
+				flushAcksIfDue();
+			}
+		}
+		// The queue is empty: send the acks of the commands executed
+		flushAcks();
+		if(slicedRun){
+			resumeRun();
+			flushAcks();
 		}
-		parseMessage( queue.consume() );
+		if( metrics.tick(std::chrono::steady_clock::now()) ) pushStats();
 	}
+
+	io_context.stop();
+	for(auto& t : ioThreadPool)
+		t.join();
+	ioThreadPool.clear();
+	Logger::getInstance().stop();
 }
 
 
@@ -472,8 +1349,79 @@ bool Server::parseArgs(int argc, char **argv){
 		else if (!strcmp(argv[i],"-p")){
 			port = std::stoi(argv[++i]);
 		}
+		else if (!strcmp(argv[i],"-u")){
+			localPath = argv[++i];
+		}
+		else if (!strcmp(argv[i],"-j")){
+			ioThreads = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if (!strcmp(argv[i],"-b")){
+			batchSize = std::stoul(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-bl")){
+			batchLatency = std::chrono::milliseconds(std::stoul(argv[++i]));
+		}
+		else if (!strcmp(argv[i],"-rs")){
+			sliceTime = std::chrono::milliseconds(std::stoul(argv[++i]));
+		}
+		else if (!strcmp(argv[i],"-rn")){
+			sliceRules = std::stoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-hw")){
+			highWatermark = std::stoul(argv[++i]) << 10;
+		}
+		else if (!strcmp(argv[i],"-lw")){
+			lowWatermark = std::stoul(argv[++i]) << 10;
+		}
+		else if (!strcmp(argv[i],"-s")){
+			shardCount = std::min(ShardRouter::MaxShards, std::stoul(argv[++i]));
+		}
+		else if (!strcmp(argv[i],"-si")){
+			metrics.setInterval( std::chrono::milliseconds(std::stoul(argv[++i])) );
+		}
+		else if (!strcmp(argv[i],"-tf")){
+			tracePath = argv[++i];
+		}
+		else if (!strcmp(argv[i],"-ts")){
+			traceSampling = std::max(1ul, std::stoul(argv[++i]));
+		}
+		else if (!strcmp(argv[i],"-ep")){
+			poolSize = std::stoul(argv[++i]);
+		}
+		else if (!strcmp(argv[i],"-ll")){
+			std::string levels;
+			if( !Logger::getInstance().configure(argv[++i], levels) ){
+				fprintf(stderr, "Unknown log level '%s'\n", argv[i]);
+				printHelp( pname );
+				return false;
+			}
+		}
+		else if (!strcmp(argv[i],"-sk")){
+			++i;
+			if(!strcmp(argv[i],"session")) shardKey = ShardKey::Session;
+			else if(!strcmp(argv[i],"prefix")) shardKey = ShardKey::Prefix;
+			else if(!strcmp(argv[i],"tag")) shardKey = ShardKey::Tag;
+			else{
+				fprintf(stderr, "Unknown shard key '%s'\n", argv[i]);
+				printHelp( pname );
+				return false;
+			}
+		}
+		else if (!strcmp(argv[i],"-sp")){
+			++i;
+			if(!strcmp(argv[i],"block")) slowConsumerPolicy = SlowConsumerPolicy::Block;
+			else if(!strcmp(argv[i],"drop")) slowConsumerPolicy = SlowConsumerPolicy::DropOldest;
+			else if(!strcmp(argv[i],"disconnect")) slowConsumerPolicy = SlowConsumerPolicy::Disconnect;
+			else{
+				fprintf(stderr, "Unknown slow-consumer policy '%s'\n", argv[i]);
+				printHelp( pname );
+				return false;
+			}
+		}
 
 	}
+	// Engines are handed out by the front end of a sharded server
+	if( (poolSize > 0) && (shardCount < 1) ) shardCount = 1;
 	return true;
 }
 
@@ -483,10 +1431,26 @@ void Server::printDefaultArgs(std::string const& pname){
 	std::cout << "Using default parameters:" << std::endl;
 	std::cout << "    "   << pname;
 	std::cout << " -p "   << port;
+	std::cout << " -u "   << ( (localPath.length() > 0) ? localPath : "''");
 	std::cout << " -d "   << clppath;
 	std::cout << " -e "   << ( (clipsFile.length() > 0) ? clipsFile : "''");
 	std::cout << " -w "   << flgFacts;
 	std::cout << " -r "   << flgRules;
+	std::cout << " -j "   << ioThreads;
+	std::cout << " -b "   << batchSize;
+	std::cout << " -bl "  << std::chrono::duration_cast<std::chrono::milliseconds>(batchLatency).count();
+	std::cout << " -rs "  << std::chrono::duration_cast<std::chrono::milliseconds>(sliceTime).count();
+	std::cout << " -rn "  << sliceRules;
+	std::cout << " -hw "  << (highWatermark >> 10);
+	std::cout << " -lw "  << (lowWatermark >> 10);
+	std::cout << " -sp "  << policy_name(slowConsumerPolicy);
+	std::cout << " -s "   << shardCount;
+	std::cout << " -sk "  << shard_key_name(shardKey);
+	std::cout << " -ep "  << poolSize;
+	std::cout << " -si "  << metrics.getInterval().count();
+	std::cout << " -tf "  << ( (tracePath.length() > 0) ? tracePath : "''");
+	std::cout << " -ts "  << traceSampling;
+	std::cout << " -ll "  << Logger::levelName( Logger::getLevel(LogCategory::Server) );
 	std::cout << std::endl << std::endl;
 }
 
@@ -496,10 +1460,26 @@ void Server::printHelp(std::string const& pname){
 	std::cout << "Usage:" << std::endl;
 	std::cout << "    " << pname << " ";
 	std::cout << "-p port ";
+	std::cout << "-u unix_socket_path (listens on a local socket too) ";
 	std::cout << "-d clp base path (where clips files are) ";
 	std::cout << "-e clipsFile ";
 	std::cout << "-w watch_facts ";
 	std::cout << "-r watch_rules ";
+	std::cout << "-j io_threads ";
+	std::cout << "-b batch_size (0 disables batch mode) ";
+	std::cout << "-bl batch_latency_ms ";
+	std::cout << "-rs run_slice_ms (0 runs to completion) ";
+	std::cout << "-rn run_slice_rules ";
+	std::cout << "-hw high_watermark_KiB ";
+	std::cout << "-lw low_watermark_KiB ";
+	std::cout << "-sp slow_consumer_policy (block|drop|disconnect) ";
+	std::cout << "-s shards (worker processes, 0 disables sharding) ";
+	std::cout << "-sk shard_key (session|prefix|tag) ";
+	std::cout << "-ep engine_pool_size (warm engines handed out by fresh) ";
+	std::cout << "-si stats_interval_ms (rates and pushed stats) ";
+	std::cout << "-tf trace_file (enables message tracing) ";
+	std::cout << "-ts trace_sampling (traces 1 in N messages) ";
+	std::cout << "-ll log_level (off|error|warning|info|debug) ";
 	std::cout << std::endl << std::endl;
 	std::cout << "Example:" << std::endl;
 	std::cout << "    " << pname << " -e virbot.dat -w 1 -r 1"  << std::endl;
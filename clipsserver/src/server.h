@@ -14,17 +14,28 @@
 #pragma once
 
 /** @cond */
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <thread>
 #include <string>
 #include <iomanip>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <boost/asio.hpp>
 /** @endcond */
 
 #include "session.h"
 #include "tcp_message.h"
-#include "sync_queue.h"
+#include "shard_router.h"
+#include "metrics.h"
+#include "logger.h"
+#include "trace_log.h"
+#include "mpsc_queue.h"
+#include "clipsclient/protocol.h"
 
 
 /**
@@ -83,7 +94,9 @@ public:
 	bool loadDat(std::string const& fpath);
 
 	/**
-	 * Runs the bridge, blocking the calling thread until ROS is shutdown
+	 * Runs the bridge, blocking the calling thread until ROS is shutdown.
+	 * Network I/O runs on a pool of ioThreads threads while CLIPS runs
+	 * exclusively on the calling thread, fed by the message queue.
 	 */
 	void run();
 
@@ -98,10 +111,14 @@ public:
 	void stop();
 
 	/**
-	 * Enqueues a received TCP message in the server's message queue
+	 * Enqueues a received TCP message in the server's message queue.
+	 * Cancel commands are served right away instead (see cancelRun).
+	 * Never waits: sessions pause reading and retry when the queue is full.
 	 * @param messagePtr A pointer to the received message
+	 * @return           true if the message was enqueued or served,
+	 *                   false if the queue is full
 	 */
-	void enqueueTcpMessage(std::shared_ptr<TcpMessage> messagePtr);
+	bool enqueueTcpMessage(const std::shared_ptr<TcpMessage>& messagePtr);
 
 	/**
 	 * Removes a session from the server. Called by Session upon disconnection.
@@ -109,6 +126,16 @@ public:
 	 */
 	void removeSession(const std::string& srep);
 
+	/**
+	 * Moves a client connected through a local socket to a shared-memory
+	 * channel. Called by Session upon reception of the shm command.
+	 * From then on acks and broadcasts are sent through the channel,
+	 * which is closed along with the socket.
+	 * @param  name    The name of the shared-memory object created by the client
+	 * @param  session The session of the client
+	 * @return         true if the channel was set up, false otherwise
+	 */
+	bool attachShm(const std::string& name, std::shared_ptr<Session> session);
 
 
 protected:
@@ -141,6 +168,12 @@ protected:
 	 * Resets CLIPS by calling clips::reset()
 	 */
 	void resetCLIPS();
+	/**
+	 * Starts over with the rule base loaded at startup: clears CLIPS,
+	 * loads Server::clipsFile and resets CLIPS
+	 * @return true if the rule base was loaded, false otherwise
+	 */
+	bool freshCLIPS();
 	// std::string& eval(std::string const& s); // Unsupported in 6.0
 
 
@@ -154,11 +187,59 @@ protected:
 	 */
 	virtual void initCLIPS(int argc, char **argv);
 
+	/**
+	 * Forks the worker processes of a sharded server. Called once
+	 * CLIPS is initialized, so every worker inherits the rule base.
+	 * Returns in the workers too, with shardIndex set.
+	 * @return true if all workers were forked, false otherwise
+	 */
+	bool forkShards();
+
+	/**
+	 * Forks the zygote of the engine pool, which resets CLIPS and
+	 * forks a new engine whenever the front end asks for one.
+	 * The zygote never returns, but the engines it forks do, with
+	 * shardIndex set.
+	 * @return true if the zygote was forked, false otherwise
+	 */
+	bool forkZygote();
+
+	/**
+	 * Runs the zygote until the front end closes the socket
+	 * @param fd The zygote's end of the socket
+	 */
+	void runZygote(int fd);
+
+	/**
+	 * Gets the prefix of the paths where workers listen
+	 */
+	std::string workerBasePath() const;
+
+	/**
+	 * Connects the front end of a sharded server to its workers
+	 * @return true if all workers were connected, false otherwise
+	 */
+	bool connectShards();
+
+	/**
+	 * Creates the trace file, if a trace path was given.
+	 * Workers trace to the path followed by .shard and their index.
+	 * @return true if tracing is disabled or the file was created,
+	 *         false otherwise
+	 */
+	bool initTrace();
+
 	/**
 	 * Initializes the TCP server.
 	 */
 	virtual bool initTcpServer();
 
+	/**
+	 * Initializes the local (AF_UNIX) server, if a socket path was given.
+	 * Local clients use the same framing and commands as TCP clients.
+	 */
+	virtual bool initLocalServer();
+
 private:
 
 	/**
@@ -167,6 +248,7 @@ private:
 	 * Any non-command string is considered a fact and thus is asserted
 	 * with Server::assertFact().
 	 * Commands are strings that start with a NULL character ('\\0').
+	 * They are sent either as text or in binary form (see protocol::Opcode).
 	 * The following commands are supported:
 	 * assert      calls clips::assertString()
 	 * reset       calls clips::reset()
@@ -176,7 +258,12 @@ private:
 	 * watch what  Toggles the specified watches
 	 * load  file  Loads the specified file
 	 * run num     Performs the specified number of runs
-	 * log         Unimplemented
+	 * log [category] level  Sets the log level of all categories or of one
+	 * fresh       Clears CLIPS, loads the startup file and resets CLIPS
+	 * stats       Reports latencies, rates and engine counters
+	 * assert-batch facts  Asserts many facts with a single pass of the parser
+	 * stream query  Performs a query, sending its output as it is produced
+	 * cancel [id]   Halts the sender's running command (the given one, if any)
 	 *
 	 * @param cliEp      The message source. A string representation of the
 	 *                   remote endpoint of the network client that sends the message
@@ -185,6 +272,21 @@ private:
 	void parseMessage(std::shared_ptr<TcpMessage> m);
 	// void parseMessage(const TcpMessage& m);
 
+	/**
+	 * Processes a batch of messages from the queue (batch mode).
+	 * Dequeues up to batchSize messages at once. Network facts are
+	 * asserted back to back and commands are executed in order.
+	 * If any fact was asserted, the agenda is run once when the batch
+	 * is complete, or earlier if processing exceeds batchLatency.
+	 */
+	void processBatch();
+
+	/**
+	 * Runs the agenda after a batch of network facts has been asserted
+	 * @param facts The number of facts asserted in the batch
+	 */
+	void runBatchAgenda(size_t facts);
+
 	/**
 	 * Acknowledges reception/excecution of a message
 	 * @param message   The message to acknowledge
@@ -196,16 +298,66 @@ private:
 	void acknowledgeMessage(std::shared_ptr<TcpMessage> message, bool success=true, const std::string& result = "");
 
 	/**
-	 * Handles commands received via topicIn
-	 * @param c The received command message
+	 * Sends the acknowledgements held by acknowledgeMessage().
+	 * The acks of each session are enqueued at once, so pipelined
+	 * commands are acknowledged with a single write.
 	 */
-	bool handleCommand(const std::string& c, std::string& result);
+	void flushAcks();
 
 	/**
-	 * Unimplemented
-	 * @param arg Unimplemented
+	 * Sends the acknowledgements held for longer than MaxAckDelay,
+	 * so acks are not delayed while other clients keep the queue busy
 	 */
-	bool handleLog(const std::string& arg);
+	void flushAcksIfDue();
+
+	/**
+	 * Traces a processed message if it is in the sample.
+	 * The trace of a command is written once its ack is handed to
+	 * the connection (see flushAcks).
+	 * @param message    The message, stamped up to trace::EngineEnd
+	 * @param opcode     The command, or Opcode::None for plain messages
+	 * @param command    true if the message is a command
+	 * @param success    true if the command succeeded
+	 * @param rulesFired Number of rules fired while processing the message
+	 */
+	void traceMessage(const std::shared_ptr<TcpMessage>& message, protocol::Opcode opcode,
+		bool command, bool success, int rulesFired);
+
+	/**
+	 * Handles commands received via topicIn.
+	 * Binary and text commands are dispatched through the same
+	 * table of handlers, indexed by opcode.
+	 * @param source The client that sent the command
+	 * @param c      The received command, right after the command id
+	 * @param length The length of the command
+	 * @param result When this method returns contains the result of
+	 *               the command, if any
+	 * @param opcode When this method returns contains the command,
+	 *               or Opcode::None if it could not be decoded
+	 * @return       true if the command was successfully executed,
+	 *               false otherwise
+	 */
+	bool handleCommand(const std::string& source, const char* c, size_t length, std::string& result, protocol::Opcode& opcode);
+
+	/**
+	 * Handles assert-batch commands received via topicIn.
+	 * Asserts many facts with a single pass of the parser.
+	 * @param facts  The facts, e.g. "(a 1) (b 2)"
+	 * @param result When this method returns contains the number of facts
+	 *               asserted and the index of the first fact with errors
+	 *               (-1 if none), separated by a space
+	 * @return       true if all facts were parsed, false otherwise
+	 */
+	bool handleAssertBatch(const std::string& facts, std::string& result);
+
+	/**
+	 * Handles log commands received via topicIn.
+	 * Sets the log level of all categories ("debug") or of one
+	 * ("engine debug"). Without arguments only reports the levels.
+	 * @param arg    The arguments (see Logger::configure)
+	 * @param result When this method returns contains the level of each category
+	 */
+	bool handleLog(const std::string& arg, std::string& result);
 
 	/**
 	 * Handles path request commands received via topicIn
@@ -215,37 +367,151 @@ private:
 
 	/**
 	 * Handles print request commands received via topicIn
-	 * @param arg What to print. Accepted values are facts, rules
-	 *            and agenda.
+	 * @param item What to print: facts, rules or agenda.
 	 */
-	bool handlePrint(const std::string& arg);
+	bool handlePrint(protocol::PrintItem item);
 
 	/**
 	 * Handles run request commands received via topicIn.
-	 * On a successful parsing of the argument performs clips::run(arg)
-	 * @param arg A string representation of an integer specifying
-	 *            the maximum number of run steps to perform
+	 * Performs clips::run(n), in slices (see startRun)
+	 * @param  n      The maximum number of run steps to perform
+	 * @param  result Unused
+	 * @return        true if rules were fired, false otherwise
+	 */
+	bool handleRun(int32_t n, std::string& result);
+
+	/**
+	 * Handles query commands received via topicIn.
+	 * Performs clips::query(query), running the engine in slices (see startRun)
+	 * @param  query  The query
+	 * @param  result When this method returns contains the output of the query
+	 * @return        true if the query was injected and rules were fired, false otherwise
 	 */
-	int handleRun(const std::string& arg);
+	bool handleQuery(const std::string& query, std::string& result);
 
 	/**
 	 * Handles toggle-watch request commands received via topicIn.
-	 * On a successful parsing of the argument toggles the watching
-	 * of functions, globals, facts or rules
-	 * @param arg A string specifying which watch shall be toggled
+	 * Toggles the watching of functions, globals, facts or rules
+	 * and publishes the status
+	 * @param item Which watch shall be toggled.
+	 *             WatchItem::None only publishes the status.
+	 */
+	bool handleWatch(protocol::WatchItem item);
+
+	/**
+	 * Handles stats commands received via topicIn.
+	 * Without arguments reports the statistics of the server.
+	 * reset discards the statistics gathered so far, while subscribe
+	 * and unsubscribe toggle the periodic push of the report.
+	 * @param source The client that sent the command
+	 * @param arg    Empty, reset, subscribe or unsubscribe
+	 * @param result When this method returns contains the report, if requested
+	 */
+	bool handleStats(const std::string& source, const std::string& arg, std::string& result);
+
+	/**
+	 * Handles stream commands received via topicIn.
+	 * Performs a query as clips::query does, but the output is sent to
+	 * the client as it is produced, in PartialResult frames, and the ack
+	 * carries only the number of rules fired.
+	 * @param source The client that sent the command
+	 * @param query  The query
+	 * @param result When this method returns contains the number of rules fired
+	 */
+	bool handleStream(const std::string& source, const std::string& query, std::string& result);
+
+	/**
+	 * Runs the engine for the command being executed (run, query or
+	 * stream). The first slice runs right away. If the agenda is not
+	 * done by then, the command is suspended: run() serves the queued
+	 * messages and resumes it with resumeRun() until it is over.
+	 * @param  opcode The command
+	 * @param  limit  The maximum number of rules to fire. Negative for no limit.
+	 * @param  result When this method returns contains the result of the
+	 *                command, if it was completed
+	 * @return        The success of the command, if it was completed
+	 */
+	bool startRun(protocol::Opcode opcode, int32_t limit, std::string& result);
+
+	/**
+	 * Fires the rules of a slice of the suspended command
+	 * @return true if the command is over, false otherwise
+	 */
+	bool runSlice();
+
+	/**
+	 * Runs a slice of the suspended command. When the command is over
+	 * sends its ack and serves the messages deferred meanwhile.
+	 */
+	void resumeRun();
+
+	/**
+	 * Ends the suspended command. Acknowledges the cancel commands
+	 * that halted it with the number of rules it fired.
+	 * @param  result When this method returns contains the result of the command
+	 * @return        The success of the command
+	 */
+	bool finishRun(std::string& result);
+
+	/**
+	 * Serves a cancel command. Called by the I/O threads, since the CLIPS
+	 * thread may be busy running the very command to halt. Halts the run,
+	 * query or stream command being executed if the same client sent it
+	 * (and it has the given id, if any) before its next rule fires. The ack
+	 * is sent by finishRun() once the command is over, or right away
+	 * (failure) if there is no such command.
+	 * @param msg The cancel command
+	 */
+	void cancelRun(const std::shared_ptr<TcpMessage>& msg);
+
+	/**
+	 * Keeps a message for later if it can't be served while a command is
+	 * suspended: it comes from the client that sent the command or from
+	 * a client with deferred messages, or it needs the engine to itself
+	 * @param  msg The message
+	 * @return     true if the message was deferred, false if it can be served now
+	 */
+	bool deferIfBusy(const std::shared_ptr<TcpMessage>& msg);
+
+	/**
+	 * Serves the deferred messages, in the order they were received
+	 */
+	void replayDeferred();
+
+	/**
+	 * Appends the statistics of the server to a report, one item per line
+	 * @param report The report
+	 */
+	void printStats(std::string& report);
+
+	/**
+	 * Sends the statistics of the server to the subscribed clients
 	 */
-	bool handleWatch(const std::string& arg);
+	void pushStats();
 
 	/**
 	 * Parses command line arguments.
 	 * Supported arguments are:
-	 * -i   default input topic  (topicIn)
-	 * -o   default output topic (topicOut)
-	 * -s   default status_topic (topicStatus)
 	 * -d   clp base path (where clips files are
 	 * -e   File to load upon initialization
 	 * -w   Indicates whether to watch facts upon initialization
 	 * -r   Indicates whether to watch rules upon initialization
+	 * -u   Path of a local (Unix domain) socket to listen on, besides TCP
+	 * -j   Number of I/O threads
+	 * -b   Maximum batch size (enables batch mode)
+	 * -bl  Maximum batch latency in milliseconds
+	 * -rs  Maximum time run, query and stream fire rules before serving other messages (ms)
+	 * -rn  Maximum rules run, query and stream fire before serving other messages
+	 * -hw  Per-session outbound high watermark in KiB
+	 * -lw  Per-session outbound low watermark in KiB
+	 * -sp  Slow-consumer policy: block, drop or disconnect
+	 * -s   Number of worker processes (shards)
+	 * -sk  Shard key: session, prefix or tag
+	 * -ep  Number of warm engines kept for the fresh command
+	 * -si  Interval of the rates and pushed stats in milliseconds
+	 * -tf  Trace file (enables tracing)
+	 * -ts  Traces one message out of this many
+	 * -ll  Log level of all categories: off, error, warning, info or debug
 	 * @param  argc The main's argc
 	 * @param  argv The main's argv
 	 * @return      true if arguments were successfully parsed,
@@ -271,7 +537,31 @@ private:
 	 * @param socketPtr  A ponter to the socket used to connect with the remote client
 	 *                   if the connection succeeded
 	 */
-	void acceptHandler(const boost::system::error_code& error, std::shared_ptr<boost::asio::ip::tcp::socket> socketPtr);
+	void acceptHandler(const boost::system::error_code& error, std::shared_ptr<StreamSocket> socketPtr);
+
+	/**
+	 * Handles incomming local connections and starts an asynchronous accept again
+	 * @param error      Error produced when accepting the connection
+	 * @param socketPtr  A ponter to the socket used to connect with the remote client
+	 *                   if the connection succeeded
+	 */
+	void acceptLocalHandler(const boost::system::error_code& error, std::shared_ptr<StreamSocket> socketPtr);
+
+	/**
+	 * Starts an asynchronous accept on the TCP acceptor
+	 */
+	void beginAccept();
+
+	/**
+	 * Starts an asynchronous accept on the local acceptor
+	 */
+	void beginAcceptLocal();
+
+	/**
+	 * Creates and registers the session of a newly connected client
+	 * @param socketPtr  The socket connected to the client
+	 */
+	void startSession(std::shared_ptr<StreamSocket> socketPtr);
 
 	/**
 	 * Handles incomming data through a socket
@@ -288,6 +578,14 @@ private:
 	 */
 	bool broadcast(const std::string& message);
 
+	/**
+	 * Enqueues an encoded frame in every session
+	 * @param  frame   The frame to be published
+	 * @return         true if the frame was successfully published,
+	 *                 false otherwise
+	 */
+	bool broadcast(const FramePtr& frame);
+
 	/**
 	 * Sends a message to the specified client.
 	 * @param  destPort   A string representation of the client's
@@ -298,6 +596,19 @@ private:
 	 */
 	bool sendTo(const std::string& cliEP, const std::string& message);
 
+	/**
+	 * Gets the session of the specified client
+	 * @param  cliEP A string representation of the client's remote endpoint
+	 * @return       A pointer to the session, or null if the client is not connected
+	 */
+	ConnectionPtr getSession(const std::string& cliEP);
+
+	/**
+	 * Rebuilds sessionList from clients
+	 * @remark clientsMutex must be held by the caller
+	 */
+	void updateSessionList();
+
 	/**
 	 * Publishes the status of the bridge to topicStatus
 	 * @return         true if the status was successfully published,
@@ -346,6 +657,12 @@ private:
 	 */
 	friend int server_broadcast_invoker(Server& server, const std::string& message);
 
+	/**
+	 * The router of a sharded server delivers the workers' replies
+	 * and status to the clients of the front end
+	 */
+	friend class ShardRouter;
+
 
 protected:
 	/**
@@ -374,19 +691,195 @@ protected:
 	 * It is set to true by run() until changed to false by stop() or
 	 * unless an external event modifies it.
 	 */
-	bool running;
+	std::atomic<bool> running;
 
 	/**
-	 * The syncrhonous queue used to pass messages to CLIPS.
+	 * The lock-free queue used to pass messages to CLIPS.
 	 * @remark CLIPS functions crash if called from a separate thread.
 	 */
-	sync_queue<std::shared_ptr<TcpMessage>> queue;
+	mpsc_queue<std::shared_ptr<TcpMessage>> queue;
+
+	/**
+	 * Messages dequeued for the batch being processed (batch mode)
+	 */
+	std::vector<std::shared_ptr<TcpMessage>> batch;
+
+	/**
+	 * Latency histograms, rates and counters reported by the stats command.
+	 * Accessed only by the CLIPS thread.
+	 */
+	Metrics metrics;
+
+	/**
+	 * Clients receiving the stats periodically.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::unordered_set<std::string> statsSubscribers;
+
+	/**
+	 * A traced command waiting for its ack to be sent
+	 */
+	struct TracedMessage{
+		/**
+		 * The message
+		 */
+		std::shared_ptr<TcpMessage> message;
+		/**
+		 * Number of the message, as returned by TraceLog::sample()
+		 */
+		uint64_t sequence;
+		/**
+		 * The command
+		 */
+		protocol::Opcode opcode;
+		/**
+		 * true if the command succeeded
+		 */
+		bool success;
+		/**
+		 * Number of rules fired by the command
+		 */
+		int rulesFired;
+	};
+
+	/**
+	 * Path of the trace file. Empty when tracing is disabled.
+	 */
+	std::string tracePath;
+
+	/**
+	 * One message out of this many is traced
+	 */
+	size_t traceSampling;
+
+	/**
+	 * Writes the trace file. Null when tracing is disabled.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::shared_ptr<TraceLog> tracePtr;
+
+	/**
+	 * Traced commands whose ack is pending.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::vector<TracedMessage> tracedMessages;
+
+	/**
+	 * Acknowledgements not sent yet, in the order they were produced.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::vector<std::pair<ConnectionPtr, FramePtr>> pendingAcks;
+
+	/**
+	 * Time when the oldest pending acknowledgement is due
+	 */
+	std::chrono::steady_clock::time_point ackDeadline;
+
+	/**
+	 * Maximum number of acknowledgements held before they are sent
+	 */
+	static const size_t MaxPendingAcks = 64;
+
+	/**
+	 * Maximum time an acknowledgement is held before it is sent
+	 */
+	static constexpr std::chrono::microseconds MaxAckDelay{1000};
+
+	/**
+	 * The command being executed, for commands that reply more than once.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::shared_ptr<TcpMessage> executing;
+
+	/**
+	 * A run, query or stream command suspended between slices
+	 */
+	struct SlicedRun{
+		/**
+		 * The command
+		 */
+		std::shared_ptr<TcpMessage> message;
+		/**
+		 * Run, Query or Stream
+		 */
+		protocol::Opcode opcode;
+		/**
+		 * Rules left to fire. Negative for no limit.
+		 */
+		int32_t limit;
+		/**
+		 * Rules fired so far
+		 */
+		int fired;
+	};
+
+	/**
+	 * The suspended command, if any.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::unique_ptr<SlicedRun> slicedRun;
+
+	/**
+	 * Messages waiting for the suspended command to end.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::deque<std::shared_ptr<TcpMessage>> deferred;
+
+	/**
+	 * Clients with deferred messages.
+	 * Accessed only by the CLIPS thread.
+	 */
+	std::unordered_set<std::string> deferredSources;
+
+	/**
+	 * Client that sent the run, query or stream command being executed.
+	 * Empty when there is none. Protected by cancelMutex.
+	 */
+	std::string runningSource;
+
+	/**
+	 * Command id (4 bytes) of the command being executed.
+	 * Protected by cancelMutex.
+	 */
+	std::string runningId;
+
+	/**
+	 * Cancel commands waiting for the command they halted to end.
+	 * Protected by cancelMutex.
+	 */
+	std::vector<std::shared_ptr<TcpMessage>> cancellers;
+
+	/**
+	 * Protects runningSource, runningId and cancellers, which are
+	 * accessed by the I/O threads
+	 */
+	std::mutex cancelMutex;
+
+	/**
+	 * Size of the output chunks sent by the stream command
+	 */
+	static const size_t StreamChunkSize = 16384;
+
+	/**
+	 * Maximum time the stream command holds output before sending it
+	 */
+	static constexpr std::chrono::milliseconds StreamLatency{10};
 
 	/**
 	 * Thread used to asynchronously run the bridge
 	 */
 	std::thread asyncThread;
 
+	/**
+	 * Threads running the io_context
+	 */
+	std::vector<std::thread> ioThreadPool;
+
+	/**
+	 * Number of threads running the io_context
+	 */
+	size_t ioThreads;
+
 	/**
 	 * Stores the name of the topic this bridge listens to
 	 */
@@ -402,16 +895,137 @@ protected:
 	 */
 	std::shared_ptr<boost::asio::ip::tcp::acceptor> acceptorPtr;
 
+	/**
+	 * Path of the local (AF_UNIX) socket. Empty when disabled.
+	 */
+	std::string localPath;
+
+	/**
+	 * Pointer to an acceptor objects that handles incomming local connections
+	 */
+	std::shared_ptr<boost::asio::local::stream_protocol::acceptor> localAcceptorPtr;
+
 	/**
 	 * Stores the name of the fact where network messages are asserted.
 	 */
 	std::string defaultMsgInFact;
 
+	/**
+	 * Maximum number of messages processed in a single batch.
+	 * Zero disables batch mode.
+	 */
+	size_t batchSize;
+
+	/**
+	 * Maximum amount of time a batch may take before the agenda is run.
+	 */
+	std::chrono::microseconds batchLatency;
+
+	/**
+	 * Maximum amount of time run, query and stream commands fire rules
+	 * before the queued messages are served. Zero sets no limit.
+	 */
+	std::chrono::microseconds sliceTime;
+
+	/**
+	 * Maximum number of rules run, query and stream commands fire
+	 * before the queued messages are served. Zero sets no limit.
+	 */
+	int32_t sliceRules;
+
+	/**
+	 * Amount of bytes queued for a client that triggers slowConsumerPolicy
+	 */
+	size_t highWatermark;
+
+	/**
+	 * Amount of bytes queued for a client slowConsumerPolicy brings it back to
+	 */
+	size_t lowWatermark;
+
+	/**
+	 * Policy applied to clients that do not read fast enough
+	 */
+	SlowConsumerPolicy slowConsumerPolicy;
+
 	/**
 	 * Active connections to tcp clients
 	 */
 	// std::unordered_map<boost::asio::ip::tcp::endpoint, std::shared_ptr<boost::asio::ip::tcp::socket>> clients;
-	std::unordered_map<std::string, std::shared_ptr<Session>> clients;
+	std::unordered_map<std::string, ConnectionPtr> clients;
+
+	/**
+	 * Snapshot of the sessions in clients. Replaced (never modified) when
+	 * a client connects or disconnects, so broadcasts only copy a pointer.
+	 */
+	std::shared_ptr<const std::vector<ConnectionPtr>> sessionList;
+
+	/**
+	 * Protects clients and sessionList, which are modified by the I/O threads
+	 */
+	std::mutex clientsMutex;
+
+	/**
+	 * Number of worker processes. 0 runs CLIPS in this process.
+	 */
+	size_t shardCount;
+
+	/**
+	 * Key used by the front end to pick the shard of a message
+	 */
+	ShardKey shardKey;
+
+	/**
+	 * Index of this worker. -1 in the front end or when not sharded.
+	 */
+	int shardIndex;
+
+	/**
+	 * Process ids of the workers (front end only)
+	 */
+	std::vector<pid_t> shardPids;
+
+	/**
+	 * Paths of the workers' local sockets (front end only)
+	 */
+	std::vector<std::string> shardPaths;
+
+	/**
+	 * Number of warm engines kept for the fresh command.
+	 * 0 disables the engine pool.
+	 */
+	size_t poolSize;
+
+	/**
+	 * Process id of the zygote of the engine pool (front end only)
+	 */
+	pid_t zygotePid;
+
+	/**
+	 * Socket connected to the zygote until the router takes it (front end only)
+	 */
+	int zygoteFd;
+
+	/**
+	 * Prefix of the paths where pooled engines listen
+	 */
+	std::string enginePath;
+
+	/**
+	 * Forwards messages to the workers (front end only)
+	 */
+	std::unique_ptr<ShardRouter> routerPtr;
+
+	/**
+	 * Latest status frame. Built in the CLIPS thread and sent by the
+	 * I/O threads to clients upon connection.
+	 */
+	FramePtr statusFrame;
+
+	/**
+	 * Protects status
+	 */
+	std::mutex statusMutex;
 
 
 };
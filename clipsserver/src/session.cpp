@@ -1,20 +1,54 @@
 #include "server.h"
 #include "session.h"
 #include <boost/bind/bind.hpp>
+#include <cstring>
 
 namespace ph = std::placeholders;
 namespace asio = boost::asio;
 using asio::ip::tcp;
 
 
-Session::Session(std::shared_ptr<boost::asio::ip::tcp::socket> socketPtr,
+/* ** ********************************************************
+* Static members
+* *** *******************************************************/
+const int Session::EnqueueRetryMs;
+
+
+static inline
+std::string endpoint_string(const StreamSocket& socket){
+	// Endpoints are copied into their actual type to be printed
+	std::ostringstream os;
+	auto ep = socket.remote_endpoint();
+	if(ep.protocol().family() != AF_UNIX){
+		tcp::endpoint tcpep;
+		std::memcpy(tcpep.data(), ep.data(), ep.size());
+		tcpep.resize(ep.size());
+		os << tcpep;
+		return os.str();
+	}
+	// Local peers are unnamed. Tell them apart with a counter.
+	static std::atomic<uint64_t> localPeers(0);
+	auto lep = socket.local_endpoint();
+	asio::local::stream_protocol::endpoint localep;
+	std::memcpy(localep.data(), lep.data(), lep.size());
+	localep.resize(lep.size());
+	os << "unix:" << localep.path() << "#" << ++localPeers;
+	return os.str();
+}
+
+
+
+Session::Session(std::shared_ptr<StreamSocket> socketPtr,
 				 Server& server):
-	socketPtr(socketPtr), server(server){
-		std::ostringstream os;
-		auto ep = socketPtr->remote_endpoint();
-		os << ep;
-		endpoint = os.str();
-		beginAsyncReceivePoll();
+	rxbuf(RxBufferSize), rxHead(0), rxTail(0),
+	rxLargeReceived(0), protocolVersion(1),
+	socketPtr(socketPtr), strand(asio::make_strand(socketPtr->get_executor())),
+	retryTimer(socketPtr->get_executor()),
+	server(server), writing(false), closing(false),
+	queuedBytes(0), droppedFrames(0),
+	highWatermark(8 << 20), lowWatermark(4 << 20),
+	policy(SlowConsumerPolicy::DropOldest){
+		endpoint = endpoint_string(*socketPtr);
 	}
 
 Session::~Session(){
@@ -27,88 +61,414 @@ std::string Session::getEndPointStr() const{
 	return endpoint;
 }
 
-std::shared_ptr<boost::asio::ip::tcp::socket> Session::getSocketPtr() const{
+std::shared_ptr<StreamSocket> Session::getSocketPtr() const{
 	return socketPtr;
 }
 
+size_t Session::getQueuedBytes() const{
+	return queuedBytes;
+}
 
-void Session::beginAsyncReceivePoll(){
-	buffer.prepare(0xffff);
-	// asio::async_read_until(*socketPtr, buffer, "\n",
-	asio::async_read(*socketPtr, buffer,
-		// boost::bind(&Session::checkTransferComplete, this,
-			// boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred),
-		boost::asio::transfer_at_least(3),
-		boost::bind(&Session::asyncReadHandler, this,
-			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)
-	);
+size_t Session::getDroppedFrames() const{
+	return droppedFrames;
+}
+
+void Session::setWatermarks(size_t high, size_t low){
+	highWatermark = high;
+	lowWatermark = (low < high) ? low : high;
 }
 
-size_t Session::checkTransferComplete(const boost::system::error_code& error, size_t bytes_transferred){
-	// uint16_t* hdrPtr = (uint16_t*)buffer.data();
-	// printf("HDR: 0x%4x\tBT: 0x%4x\n", *hdrPtr, bytes_transferred);
-	return 0;
+void Session::setSlowConsumerPolicy(SlowConsumerPolicy policy){
+	this->policy = policy;
+}
+
+void Session::setCompanion(const ConnectionPtr& companion){
+	asio::post(strand, [self = shared_from_this(), companion](){
+		// Runs before or after the strand handler posted by close()
+		bool closing;
+		{
+			std::lock_guard<std::mutex> lock(self->outboxMutex);
+			closing = self->closing;
+		}
+		if(closing) companion->close();
+		else self->companion = companion;
+	});
+}
+
+
+void Session::beginAsyncReceivePoll(){
+	socketPtr->async_read_some(
+		asio::buffer(&rxbuf[rxTail], rxbuf.size() - rxTail),
+		asio::bind_executor(strand, boost::bind(&Session::asyncReadHandler, shared_from_this(),
+			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred))
+	);
 }
 
 void Session::asyncReadHandler(const boost::system::error_code& error, size_t bytes_transferred){
 	if(error){
 		server.removeSession(endpoint);
-		// delete this;
+		// Aborts pending writes and releases blocked senders
+		close();
+		return;
+	}
+
+	rxTail+= bytes_transferred;
+	receiveFrames();
+}
+
+void Session::receiveFrames(){
+	if( !parseFrames() ){
+		LOG_WARNING(Network, "Malformed frame from client %s. Disconnecting.", endpoint.c_str());
+		server.removeSession(endpoint);
+		close();
+		return;
+	}
+	resumeReceive();
+}
+
+void Session::resumeReceive(){
+	if(rxPending) beginRetryEnqueue();
+	else if(rxLarge) beginAsyncReceiveLarge();
+	else beginAsyncReceivePoll();
+}
+
+void Session::enqueue(std::shared_ptr<TcpMessage> message){
+	if( !server.enqueueTcpMessage(message) )
+		rxPending = std::move(message);
+}
+
+void Session::beginRetryEnqueue(){
+	retryTimer.expires_after( std::chrono::milliseconds(EnqueueRetryMs) );
+	retryTimer.async_wait(
+		asio::bind_executor(strand, boost::bind(&Session::retryEnqueueHandler, shared_from_this(),
+			boost::asio::placeholders::error))
+	);
+}
+
+void Session::retryEnqueueHandler(const boost::system::error_code& error){
+	// Cancelled by close(). No read is pending to remove the session.
+	if( error || !socketPtr->is_open() ){
+		rxPending.reset();
+		server.removeSession(endpoint);
+		return;
+	}
+	if( !server.enqueueTcpMessage(rxPending) ){
+		beginRetryEnqueue();
 		return;
 	}
+	rxPending.reset();
+	// Frames left in the buffer go first
+	receiveFrames();
+}
+
+void Session::beginAsyncReceiveLarge(){
+	std::string& m = rxLarge->getMessage();
+	// The message has room for the trailing null character
+	asio::async_read(*socketPtr,
+		asio::buffer(&m[rxLargeReceived], m.length() - 1 - rxLargeReceived),
+		asio::bind_executor(strand, boost::bind(&Session::asyncReadLargeHandler, shared_from_this(),
+			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred))
+	);
+}
 
-	std::istream is(&buffer);
+void Session::asyncReadLargeHandler(const boost::system::error_code& error, size_t bytes_transferred){
+	// async_read completes only once the whole frame is in
+	if( error || (rxLargeReceived + bytes_transferred != rxLarge->getMessage().length() - 1) ){
+		rxLarge.reset();
+		server.removeSession(endpoint);
+		close();
+		return;
+	}
+	enqueue( std::move(rxLarge) );
+	rxLarge.reset();
+	resumeReceive();
+}
 
-	do{
+bool Session::parseFrames(){
+	while( !rxPending && (rxTail - rxHead >= protocol::HeaderSize) ){
 		// 1. Fetch header.
-		// Header is 2 bytes and contains the size of the message
-		uint16_t msgsize = peekMessageHeader(is);
-		// 2. If the buffer size is smaller than the header the message is incomplete. Skip.
-		if(buffer.size() < msgsize) break;
-		// 3. Retrieve the message
-		std::string s = fetchStringFromBuffer(is);
-		// 4. Enqueue the message
-		server.enqueueTcpMessage( TcpMessage::makeShared(endpoint, s) );
-	}while(buffer.size() > 0);
-	beginAsyncReceivePoll();
+		// Header is 2 bytes and contains the size of the message (header included).
+		// A zero size is followed by the 4-byte size of the payload (extended frame).
+		const char* frame = &rxbuf[rxHead];
+		size_t available = rxTail - rxHead;
+		size_t hdrsize = protocol::HeaderSize;
+		size_t length;
+		uint16_t msgsize;
+		std::memcpy(&msgsize, frame, sizeof(msgsize));
+		if(msgsize == 0){
+			if(available < protocol::ExtendedHeaderSize) break;
+			uint32_t extsize;
+			std::memcpy(&extsize, frame + sizeof(msgsize), sizeof(extsize));
+			if(extsize > protocol::MaxPayload) return false;
+			hdrsize = protocol::ExtendedHeaderSize;
+			length = extsize;
+		}
+		else if(msgsize < protocol::HeaderSize) return false;
+		else length = msgsize - protocol::HeaderSize;
+
+		// 2. Frames larger than half the buffer are read straight into
+		// their message. Copy what has been received so far.
+		if(hdrsize + length > RxBufferSize / 2){
+			rxLarge = pool.acquire(endpoint, length);
+			rxLargeReceived = std::min(available - hdrsize, length);
+			std::memcpy(&(rxLarge->getMessage()[0]), frame + hdrsize, rxLargeReceived);
+			rxHead+= hdrsize + rxLargeReceived;
+			if(rxLargeReceived < length) break;
+			enqueue( std::move(rxLarge) );
+			rxLarge.reset();
+			continue;
+		}
+
+		// 3. If the buffer is smaller than the frame the message is incomplete.
+		if(available < hdrsize + length) break;
+		// 4. Handle the payload in place
+		handleFrame(frame + hdrsize, length);
+		rxHead+= hdrsize + length;
+	}
+
+	// Rewind when everything was consumed. Otherwise move the partial
+	// frame to the front only when the room left can't fit a whole frame.
+	if(rxHead == rxTail)
+		rxHead = rxTail = 0;
+	else if(rxbuf.size() - rxHead < RxBufferSize / 2){
+		std::memmove(&rxbuf[0], &rxbuf[rxHead], rxTail - rxHead);
+		rxTail-= rxHead;
+		rxHead = 0;
+	}
+	return true;
+}
+
+
+/**
+ * Checks whether the given payload holds the given text command
+ * @param  data    The payload
+ * @param  length  The length of the payload
+ * @param  name    The name of the command
+ * @param  arg     When the command matches, receives its arguments
+ * @return         true if the payload holds the command, false otherwise
+ */
+static
+bool match_command(const char* data, size_t length, const char* name, std::string& arg){
+	size_t namelen = std::strlen(name);
+	if( (length < 5 + namelen) || data[0] || std::memcmp(data + 5, name, namelen) ||
+		( (length > 5 + namelen) && (data[5 + namelen] != ' ') ) )
+		return false;
+	if(length > 6 + namelen)
+		arg.assign(data + 6 + namelen, length - 6 - namelen);
+	return true;
+}
+
+
+void Session::handleFrame(const char* data, size_t length){
+	std::string arg;
+	std::string ack(data, std::min<size_t>(length, 5));
+
+	// The proto command is answered here, so the framing is switched
+	// before any reply is produced for subsequent commands.
+	if( match_command(data, length, "proto", arg) ){
+		uint32_t requested = 1;
+		try{ requested = std::stoul(arg); }
+		catch(...){}
+		protocolVersion = std::max<uint32_t>(1, std::min(requested, protocol::Version));
+		ack+= '\x01';
+		ack+= std::to_string(protocolVersion);
+		send( std::move(ack) );
+	}
+	// The shm command moves the client to a shared-memory channel. The
+	// ack is sent here, once the server is already serving the channel.
+	else if( match_command(data, length, "shm", arg) ){
+		bool success = server.attachShm(arg, shared_from_this());
+		ack+= success ? '\x01' : '\x00';
+		send( std::move(ack) );
+	}
+	// Payload is copied straight from the buffer into a pooled message
+	else enqueue( pool.acquire(endpoint, data, length) );
+}
+
+
+uint32_t Session::getProtocolVersion() const{
+	return protocolVersion;
+}
+
+
+void Session::sendHello(){
+	std::string hello;
+	hello+= '\0';
+	hello.append((const char*)&protocol::HelloCommandId, sizeof(protocol::HelloCommandId));
+	hello+= '\x01';
+	hello+= "proto:" + std::to_string(protocol::Version);
+	send( std::move(hello) );
 }
 
-uint16_t Session::peekMessageHeader(std::istream& is){
-	uint16_t hdr;
-	is.read((char*)&hdr, sizeof(hdr));
-	is.unget(); is.unget();
-	return hdr;
+
+bool Session::send(const FramePtr& frame, bool droppable){
+	if(!this->socketPtr || !frame) return false;
+	if( !frame->isValid() ){
+		LOG_WARNING(Network, "Can't send %lu bytes to client %s: payload too large.",
+			frame->getPayload().length(), endpoint.c_str());
+		return false;
+	}
+	if( frame->isExtended() && (protocolVersion < 2) ){
+		LOG_WARNING(Network, "Can't send %lu bytes to client %s: extended frames not negotiated.",
+			frame->getPayload().length(), endpoint.c_str());
+		return false;
+	}
+
+	std::unique_lock<std::mutex> lock(outboxMutex);
+	if( closing || !makeRoom(lock, frame->size(), droppable) ) return false;
+	queuedBytes+= frame->size();
+	outbox.push_back( {frame, droppable} );
+	if(writing) return true;
+	// No write in progress. Start one from within the io_context
+	writing = true;
+	asio::post(strand,
+		boost::bind(&Session::beginAsyncWrite, shared_from_this()));
+	return true;
 }
 
-std::string Session::fetchStringFromBuffer(std::istream& is){
-	// Reads header again
-	uint16_t bytesToRead;
-	is.read((char*)&bytesToRead, sizeof(bytesToRead));
-	bytesToRead-= sizeof(bytesToRead);
 
-	std::string s(bytesToRead+1, 0);
-	is.read(&s[0], bytesToRead);
-	return s;
+size_t Session::send(const std::vector<FramePtr>& frames){
+	if(!this->socketPtr) return 0;
+	size_t sent = 0;
+	std::unique_lock<std::mutex> lock(outboxMutex);
+	for(const FramePtr& frame : frames){
+		if( !frame->isValid() || (frame->isExtended() && (protocolVersion < 2)) ) break;
+		if( closing || !makeRoom(lock, frame->size(), false) ){
+			// The Disconnect policy releases the lock
+			if( !lock.owns_lock() ) return sent;
+			break;
+		}
+		queuedBytes+= frame->size();
+		outbox.push_back( {frame, false} );
+		++sent;
+	}
+	if( (sent < 1) || writing ) return sent;
+	writing = true;
+	asio::post(strand,
+		boost::bind(&Session::beginAsyncWrite, shared_from_this()));
+	return sent;
 }
 
 
-void Session::send(const std::string& s){
-	if(!this->socketPtr || !this->socketPtr->is_open() ) return;
-	// asio::write( *socketPtr, asio::buffer(message) );
-	//
-	uint16_t packetsize = 2 + s.length();
-	char buffer[packetsize];
-	buffer[0] = *((char*)&packetsize);
-	buffer[1] = *((char*)&packetsize +1);
-	for(size_t i = 0; i < s.length(); ++i)
-		buffer[i+2] = s[i];
-	// buffer[packetsize-1] = 0;
-	asio::write(*socketPtr, asio::buffer(buffer, packetsize));
+bool Session::makeRoom(std::unique_lock<std::mutex>& lock, size_t size, bool droppable){
+	if(queuedBytes + size <= highWatermark) return true;
+
+	switch(policy){
+		case SlowConsumerPolicy::Disconnect:
+			LOG_WARNING(Network, "Client %s is not reading (%lu bytes queued). Disconnecting.",
+				endpoint.c_str(), (size_t)queuedBytes);
+			lock.unlock();
+			close();
+			return false;
+
+		case SlowConsumerPolicy::DropOldest:
+			// Frames in flight can't be dropped. Status and broadcast frames
+			// are discarded oldest first down to the low watermark.
+			for(auto it = outbox.begin(); (it != outbox.end()) && (queuedBytes + size > lowWatermark); ){
+				if(!it->droppable){ ++it; continue; }
+				queuedBytes-= it->size();
+				it = outbox.erase(it);
+				++droppedFrames;
+			}
+			if( droppable && (queuedBytes + size > highWatermark) ){
+				++droppedFrames;
+				return false;
+			}
+			return true;
+
+		case SlowConsumerPolicy::Block:
+		default:
+			break;
+	}
+
+	// Block. I/O threads must never wait for a client (they are the ones
+	// draining the queues), in which case the frame is enqueued regardless.
+	asio::io_context& io = static_cast<asio::io_context&>(socketPtr->get_executor().context());
+	if( io.get_executor().running_in_this_thread() ) return true;
+	drained.wait(lock, [this](){ return closing || (queuedBytes <= lowWatermark); });
+	return !closing;
+}
+
+
+void Session::close(){
+	{
+		std::lock_guard<std::mutex> lock(outboxMutex);
+		if(closing) return;
+		closing = true;
+	}
+	drained.notify_all();
+	// The read handler fails and removes the session from the server
+	asio::post(strand, [self = shared_from_this()](){
+		if(self->companion) self->companion->close();
+		self->companion.reset();
+		boost::system::error_code ec;
+		self->socketPtr->shutdown(asio::socket_base::shutdown_both, ec);
+		self->socketPtr->close(ec);
+		self->retryTimer.cancel();
+	});
+}
+
+
+void Session::start(){
+	// Handlers keep a shared pointer to the session, so the first
+	// read can only be started once the session is owned by one.
+	asio::post(strand, boost::bind(&Session::beginAsyncReceivePoll, shared_from_this()));
+	sendHello();
+}
+
+
+void Session::beginAsyncWrite(){
+	std::vector<asio::const_buffer> buffers;
+	{
+		std::lock_guard<std::mutex> lock(outboxMutex);
+		if( outbox.empty() || !socketPtr->is_open() ){
+			writing = false;
+			return;
+		}
+		while( !outbox.empty() && (inflight.size() < MaxGatherFrames) ){
+			inflight.push_back( std::move(outbox.front().frame) );
+			outbox.pop_front();
+		}
+	}
+
+	buffers.reserve(2 * inflight.size());
+	for(const FramePtr& frame : inflight){
+		buffers.push_back( asio::buffer(frame->getHeader()) );
+		buffers.push_back( asio::buffer(frame->getPayload()) );
+	}
+	asio::async_write(*socketPtr, buffers,
+		asio::bind_executor(strand, boost::bind(&Session::asyncWriteHandler, shared_from_this(),
+			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred))
+	);
+}
+
+
+void Session::asyncWriteHandler(const boost::system::error_code& error, size_t /*bytes_transferred*/){
+	size_t written = 0;
+	for(const FramePtr& frame : inflight)
+		written+= frame->size();
+	inflight.clear();
+	{
+		// Decremented under the lock so senders waiting for the
+		// queue to drain (Block policy) can't miss the notification
+		std::lock_guard<std::mutex> lock(outboxMutex);
+		queuedBytes-= written;
+		if(error){
+			// The read handler takes care of removing the session
+			outbox.clear();
+			queuedBytes = 0;
+			writing = false;
+			closing = true;
+		}
+	}
+	if(queuedBytes <= lowWatermark) drained.notify_all();
+	if(error) return;
+	beginAsyncWrite();
 }
 
 
 std::shared_ptr<Session> Session::makeShared(
-			std::shared_ptr<tcp::socket> socketPtr,
+			std::shared_ptr<StreamSocket> socketPtr,
 			Server& server
 	){
 	return std::shared_ptr<Session>(new Session(socketPtr, server));
@@ -14,18 +14,32 @@
 #pragma once
 
 /** @cond */
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <string>
+#include <vector>
 #include <iomanip>
 #include <boost/asio.hpp>
 /** @endcond */
 
+#include "frame.h"
+#include "connection.h"
 #include "tcp_message.h"
+#include "clipsclient/protocol.h"
 
 
 
 class Server;
 
-class Session{
+/**
+ * Socket of a session. TCP and local (AF_UNIX) connections are both
+ * accepted into a generic stream socket, so they share the framing.
+ */
+typedef boost::asio::generic::stream_protocol::socket StreamSocket;
+
+class Session : public Connection, public std::enable_shared_from_this<Session>{
 public:
 	/**
 	 * Initializes a new instance of Session
@@ -33,7 +47,7 @@ public:
 	 * @param server       The server that manages the session and handles incomming messages.
 	 */
 	Session(
-		std::shared_ptr<boost::asio::ip::tcp::socket> socketPtr,
+		std::shared_ptr<StreamSocket> socketPtr,
 		Server& serverPtr
 	);
 	~Session();
@@ -54,21 +68,93 @@ public:
 	 * Gets a string representation of the remote endpoint
 	 * @return A string representation of the remote endpoint
 	 */
-	std::string getEndPointStr() const;
+	std::string getEndPointStr() const override;
 
 	/**
 	 * Gets the underlaying connection socket to the remote client
 	 * @return The underlaying connection socket to the remote client
 	 */
-	std::shared_ptr<boost::asio::ip::tcp::socket> getSocketPtr() const;
+	std::shared_ptr<StreamSocket> getSocketPtr() const;
+
+	/**
+	 * Gets the number of bytes enqueued for sending, including the
+	 * ones being written
+	 * @return The number of bytes waiting to be sent to the remote client
+	 */
+	size_t getQueuedBytes() const override;
+
+	/**
+	 * Gets the number of frames discarded by the DropOldest policy
+	 * @return The number of frames discarded so far
+	 */
+	size_t getDroppedFrames() const override;
+
+	/**
+	 * Sets the outbound queue watermarks
+	 * @param high The amount of queued bytes that triggers the slow-consumer policy
+	 * @param low  The amount of queued bytes the queue is brought back to
+	 */
+	void setWatermarks(size_t high, size_t low) override;
+
+	/**
+	 * Sets the policy applied when the outbound queue exceeds the high watermark
+	 * @param policy The slow-consumer policy
+	 */
+	void setSlowConsumerPolicy(SlowConsumerPolicy policy) override;
+
+	/**
+	 * Gets the protocol version negotiated with the remote client
+	 * @return The negotiated protocol version. 1 if none was negotiated.
+	 */
+	uint32_t getProtocolVersion() const override;
+
+	/**
+	 * Sets a connection that is closed along with this session, such
+	 * as a shared-memory channel set up through it
+	 * @param companion The connection to close
+	 */
+	void setCompanion(const ConnectionPtr& companion);
 
 
 public:
+	using Connection::send;
+
 	/**
-	 * Sends the provided string to the remote client
-	 * @param s The string to send
+	 * Enqueues an encoded frame in the session's outbound queue,
+	 * which is drained asynchronously. Returns immediately unless the
+	 * queue is above the high watermark and the policy is Block.
+	 * The frame is shared, not copied, so the same frame can be
+	 * enqueued in several sessions (broadcast).
+	 * @param frame     The frame to send
+	 * @param droppable Optional. When true the frame may be discarded by
+	 *                  the DropOldest policy (status and broadcasts).
+	 *                  Default: false
+	 * @return          true if the frame was enqueued, false if it was
+	 *                  dropped, the session is closed, or the frame is
+	 *                  an extended frame the client did not negotiate.
 	 */
-	void send(const std::string& s);
+	bool send(const FramePtr& frame, bool droppable = false) override;
+
+	/**
+	 * Enqueues several frames at once, in order, so they are drained
+	 * by a single write. Frames are never dropped by the DropOldest policy.
+	 * @param frames    The frames to send
+	 * @return          The number of frames enqueued. Enqueuing stops at
+	 *                  the first frame that can't be sent.
+	 */
+	size_t send(const std::vector<FramePtr>& frames) override;
+
+	/**
+	 * Closes the connection with the remote client
+	 */
+	void close() override;
+
+	/**
+	 * Starts receiving data from the remote client and sends the hello
+	 * frame. The session must be configured before it is started since
+	 * its handlers run on the I/O threads.
+	 */
+	void start();
 
 
 private:
@@ -88,23 +174,93 @@ private:
 	void asyncReadHandler(const boost::system::error_code& error, size_t bytes_transferred);
 
 	/**
-	 * Verifies whether all data has been received
-	 * @param error Error produced when accepting the connection
-	 * @param peer  The number of bytes transferred
+	 * Starts an asynchronous read of the remainder of a frame too large
+	 * for the receive buffer, straight into its message (rxLarge)
 	 */
-	size_t checkTransferComplete(const boost::system::error_code& error, size_t bytes_transferred);
+	void beginAsyncReceiveLarge();
 
 	/**
-	 * Reads the header of the message from the buffer without advancing the read cursor.
-	 * @param is A istream to read the buffer
+	 * Handles the completion of the read of a large frame
+	 * @param error             Error produced during the read operation
+	 * @param bytes_transferred The number of bytes transferred
 	 */
-	uint16_t peekMessageHeader(std::istream& is);
+	void asyncReadLargeHandler(const boost::system::error_code& error, size_t bytes_transferred);
 
 	/**
-	 * Reads the a message from the buffer.
-	 * @param is A istream to read the buffer
+	 * Parses the received frames and starts the next read, or waits for
+	 * room in the server's queue if a message could not be enqueued
 	 */
-	std::string fetchStringFromBuffer(std::istream& is);
+	void receiveFrames();
+
+	/**
+	 * Starts the next read, or the next enqueue retry if reading is paused
+	 */
+	void resumeReceive();
+
+	/**
+	 * Hands a message to the server. If its queue is full the message
+	 * is held in rxPending and reading pauses until it is enqueued.
+	 * @param message The received message
+	 */
+	void enqueue(std::shared_ptr<TcpMessage> message);
+
+	/**
+	 * Retries to enqueue rxPending after EnqueueRetryMs
+	 */
+	void beginRetryEnqueue();
+
+	/**
+	 * Handles the expiration of the enqueue retry timer
+	 * @param error Error produced during the wait
+	 */
+	void retryEnqueueHandler(const boost::system::error_code& error);
+
+	/**
+	 * Handles the payload of a received frame. The proto and shm commands
+	 * are answered by the session, anything else is enqueued in the server.
+	 * @param data   Pointer to the payload in the receive buffer
+	 * @param length Length of the payload
+	 */
+	void handleFrame(const char* data, size_t length);
+
+	/**
+	 * Sends the hello frame advertising the protocol version
+	 */
+	void sendHello();
+
+	/**
+	 * Applies the slow-consumer policy to make room for a new frame
+	 * @param lock      The lock held on outboxMutex
+	 * @param size      The size of the frame to be enqueued
+	 * @param droppable Whether the frame to be enqueued may be discarded
+	 * @return          true if the frame shall be enqueued, false otherwise
+	 */
+	bool makeRoom(std::unique_lock<std::mutex>& lock, size_t size, bool droppable);
+
+	/**
+	 * Starts an asynchronous write of all frames in the outbound queue,
+	 * coalescing consecutive frames into a single gather-write.
+	 * @remark Must be called from within the io_context.
+	 */
+	void beginAsyncWrite();
+
+	/**
+	 * Handles the completion of an asynchronous write and starts the
+	 * next one if frames were enqueued in the meantime.
+	 * @param error             Error produced during the write operation
+	 * @param bytes_transferred The number of bytes transferred
+	 */
+	void asyncWriteHandler(const boost::system::error_code& error, size_t bytes_transferred);
+
+	/**
+	 * Parses all complete frames in the receive buffer in place and
+	 * enqueues their payloads in the server. Parsing stops when the
+	 * server's queue is full (see rxPending). Incomplete frames are left
+	 * in the buffer, moved to its beginning if required to make room
+	 * for the next read.
+	 * @return false if a malformed frame was found, true otherwise
+	 */
+	bool parseFrames();
 
 
 private:
@@ -114,20 +270,152 @@ private:
 	std::string endpoint;
 
 	/**
-	 * Dynamic buffer required to receive messages asynchronously
+	 * Connection closed along with this session. Accessed only by the strand.
+	 */
+	ConnectionPtr companion;
+
+	/**
+	 * Contiguous receive buffer. Data is read at rxTail and frames are
+	 * parsed from rxHead. Twice the maximum frame size, so a partial
+	 * frame moved to the beginning always leaves room for the rest of it.
 	 */
-	boost::asio::streambuf buffer;
+	std::vector<char> rxbuf;
+
+	/**
+	 * Position of the first unparsed byte in rxbuf
+	 */
+	size_t rxHead;
+
+	/**
+	 * Position past the last received byte in rxbuf
+	 */
+	size_t rxTail;
+
+	/**
+	 * Recycles the messages handed to the server
+	 */
+	TcpMessagePool pool;
+
+	/**
+	 * Message being received straight from the socket (large frames)
+	 */
+	std::shared_ptr<TcpMessage> rxLarge;
+
+	/**
+	 * Bytes of rxLarge received so far
+	 */
+	size_t rxLargeReceived;
+
+	/**
+	 * Message waiting for room in the server's queue. Reading is paused meanwhile.
+	 */
+	std::shared_ptr<TcpMessage> rxPending;
+
+	/**
+	 * Protocol version negotiated with the remote client
+	 */
+	std::atomic<uint32_t> protocolVersion;
+
+	/**
+	 * Size of the receive buffer
+	 */
+	static const size_t RxBufferSize = 0x20000;
+
+	/**
+	 * Delay between attempts to enqueue rxPending, in milliseconds
+	 */
+	static const int EnqueueRetryMs = 1;
 
 	/**
 	 * The underlaying connection socket to the remote client
 	 */
-	std::shared_ptr<boost::asio::ip::tcp::socket> socketPtr;
+	std::shared_ptr<StreamSocket> socketPtr;
+
+	/**
+	 * Serializes the session's handlers, which run on the I/O threads
+	 */
+	boost::asio::strand<StreamSocket::executor_type> strand;
+
+	/**
+	 * Schedules enqueue retries while reading is paused
+	 */
+	boost::asio::steady_timer retryTimer;
 
 	/**
 	 * The sessions lord and master
 	 */
 	Server& server;
 
+	/**
+	 * A frame enqueued for sending
+	 */
+	struct OutFrame{
+		FramePtr frame;
+		bool droppable;
+		size_t size() const { return frame->size(); }
+	};
+
+	/**
+	 * Frames waiting to be written to the remote client
+	 */
+	std::deque<OutFrame> outbox;
+
+	/**
+	 * Frames being written by the current asynchronous write operation
+	 */
+	std::vector<FramePtr> inflight;
+
+	/**
+	 * Protects outbox, writing and closing
+	 */
+	std::mutex outboxMutex;
+
+	/**
+	 * Notified when the outbound queue drains to the low watermark
+	 * or the session is closed (Block policy)
+	 */
+	std::condition_variable drained;
+
+	/**
+	 * Indicates whether an asynchronous write operation is in progress
+	 */
+	bool writing;
+
+	/**
+	 * Indicates whether the session is being closed
+	 */
+	bool closing;
+
+	/**
+	 * Bytes in outbox and inflight
+	 */
+	std::atomic<size_t> queuedBytes;
+
+	/**
+	 * Frames discarded by the DropOldest policy
+	 */
+	std::atomic<size_t> droppedFrames;
+
+	/**
+	 * Amount of queued bytes that triggers the slow-consumer policy
+	 */
+	size_t highWatermark;
+
+	/**
+	 * Amount of queued bytes the queue is brought back to
+	 */
+	size_t lowWatermark;
+
+	/**
+	 * Policy applied when the outbound queue exceeds highWatermark
+	 */
+	SlowConsumerPolicy policy;
+
+	/**
+	 * Maximum number of frames coalesced in a single gather-write
+	 */
+	static const size_t MaxGatherFrames = 64;
+
 
 public:
 	/**
@@ -136,7 +424,7 @@ public:
 	 * @param server    The server that manages the session and handles incomming messages.
 	 */
 	static std::shared_ptr<Session> makeShared(
-			std::shared_ptr<boost::asio::ip::tcp::socket> socketPtr,
+			std::shared_ptr<StreamSocket> socketPtr,
 			Server& server
 	);
 };
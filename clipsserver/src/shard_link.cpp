@@ -0,0 +1,131 @@
+#include "shard_link.h"
+#include "shard_router.h"
+#include "logger.h"
+
+#include <thread>
+#include <cstring>
+#include <boost/bind/bind.hpp>
+
+namespace asio = boost::asio;
+
+
+
+ShardLink::ShardLink(size_t index, asio::io_context& io, ShardRouter& router):
+	index(index), socket(io), router(router),
+	rxbuf(RxBufferSize), rxTail(0), connected(false){
+	}
+
+ShardLink::~ShardLink(){
+	boost::system::error_code ec;
+	socket.close(ec);
+}
+
+bool ShardLink::isConnected() const{
+	return connected;
+}
+
+size_t ShardLink::getIndex() const{
+	return index;
+}
+
+
+bool ShardLink::connect(const std::string& path, std::chrono::milliseconds timeout){
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	asio::local::stream_protocol::endpoint ep(path);
+	for(;;){
+		boost::system::error_code ec;
+		socket.connect(ep, ec);
+		if(!ec) break;
+		socket.close(ec);
+		if(std::chrono::steady_clock::now() >= deadline){
+			LOG_ERROR(Shard, "Can't connect to shard %lu at %s", index, path.c_str());
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	connected = true;
+	return true;
+}
+
+
+void ShardLink::start(){
+	beginReceive();
+	// Workers send results over 64KB in extended frames
+	std::string proto(1, '\0');
+	proto.append( (const char*)&ShardRouter::UntrackedCommandId, sizeof(uint32_t) );
+	send( proto + "proto " + std::to_string(protocol::Version) );
+}
+
+
+bool ShardLink::send(const std::string& payload){
+	if(!connected) return false;
+	std::string header = protocol::makeHeader(payload.length());
+	if( header.empty() ){
+		LOG_WARNING(Shard, "Can't send %lu bytes to shard %lu: payload too large.", payload.length(), index);
+		return false;
+	}
+	std::vector<asio::const_buffer> buffers = { asio::buffer(header), asio::buffer(payload) };
+	boost::system::error_code ec;
+	std::lock_guard<std::mutex> lock(sendMutex);
+	asio::write(socket, buffers, ec);
+	if(!ec) return true;
+	// The read handler reports the disconnection
+	connected = false;
+	return false;
+}
+
+
+void ShardLink::beginReceive(){
+	socket.async_read_some(
+		asio::buffer(&rxbuf[rxTail], rxbuf.size() - rxTail),
+		boost::bind(&ShardLink::asyncReadHandler, shared_from_this(),
+			asio::placeholders::error, asio::placeholders::bytes_transferred)
+	);
+}
+
+
+void ShardLink::asyncReadHandler(const boost::system::error_code& error, size_t bytes_transferred){
+	if(error){
+		LOG_ERROR(Shard, "Shard %lu disconnected: %s", index, error.message().c_str());
+		connected = false;
+		router.handleDisconnection(index);
+		return;
+	}
+
+	rxTail+= bytes_transferred;
+	size_t head = 0;
+	size_t needed = 0;
+	while(rxTail - head >= protocol::HeaderSize){
+		// Same framing as sessions (see Session::parseFrames)
+		const char* frame = &rxbuf[head];
+		size_t hdrsize = protocol::HeaderSize;
+		size_t length;
+		uint16_t msgsize;
+		std::memcpy(&msgsize, frame, sizeof(msgsize));
+		if(msgsize == 0){
+			if(rxTail - head < protocol::ExtendedHeaderSize) break;
+			uint32_t extsize;
+			std::memcpy(&extsize, frame + sizeof(msgsize), sizeof(extsize));
+			hdrsize = protocol::ExtendedHeaderSize;
+			length = extsize;
+		}
+		else if(msgsize < protocol::HeaderSize){
+			head+= protocol::HeaderSize;
+			continue;
+		}
+		else length = msgsize - protocol::HeaderSize;
+
+		if(rxTail - head < hdrsize + length){
+			needed = hdrsize + length;
+			break;
+		}
+		router.handleFrame(index, frame + hdrsize, length);
+		head+= hdrsize + length;
+	}
+
+	// Keep the partial frame at the front, growing the buffer to fit it
+	std::memmove(&rxbuf[0], &rxbuf[head], rxTail - head);
+	rxTail-= head;
+	if(needed > rxbuf.size()) rxbuf.resize(needed);
+	beginReceive();
+}
@@ -0,0 +1,146 @@
+/* ** *****************************************************************
+* shard_link.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file shard_link.h
+ * Definition of a shard link: the connection between the front end of
+ * a sharded server and one of its worker processes
+ */
+
+#ifndef __SHARD_LINK_H__
+#define __SHARD_LINK_H__
+#pragma once
+
+/** @cond */
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+/** @endcond */
+
+
+
+class ShardRouter;
+
+/**
+ * Connects the front end to a worker through the worker's local socket.
+ * Frames are written synchronously by the routing thread and received
+ * asynchronously by the I/O threads, which hand them to the router.
+ */
+class ShardLink : public std::enable_shared_from_this<ShardLink>{
+public:
+	/**
+	 * Initializes a new instance of ShardLink
+	 * @param index  The index of the shard
+	 * @param io     The io_context where frames are received
+	 * @param router The router that handles received frames
+	 */
+	ShardLink(size_t index, boost::asio::io_context& io, ShardRouter& router);
+	~ShardLink();
+
+	// Disable copy constructor and assignment op.
+private:
+	/**
+	 * Copy constructor disabled
+	 */
+	ShardLink(ShardLink const& obj)        = delete;
+	/**
+	 * Copy assignment operator disabled
+	 */
+	ShardLink& operator=(ShardLink const&) = delete;
+
+public:
+	/**
+	 * Connects to the worker, retrying while it starts up
+	 * @param  path    The path of the worker's local socket
+	 * @param  timeout The maximum time to wait for the worker
+	 * @return         true if the connection was established, false otherwise
+	 */
+	bool connect(const std::string& path, std::chrono::milliseconds timeout);
+
+	/**
+	 * Starts receiving frames from the worker and negotiates
+	 * the protocol version
+	 */
+	void start();
+
+	/**
+	 * Frames and sends the given payload to the worker
+	 * @param  payload The payload to send
+	 * @return         true if the payload was sent, false if the link is down
+	 */
+	bool send(const std::string& payload);
+
+	/**
+	 * Checks whether the link is up
+	 * @return true if connected to the worker, false otherwise
+	 */
+	bool isConnected() const;
+
+	/**
+	 * Gets the index of the shard
+	 * @return The index of the shard
+	 */
+	size_t getIndex() const;
+
+private:
+	/**
+	 * Begins an asynchronous read operation
+	 */
+	void beginReceive();
+
+	/**
+	 * Handles asynchronous data reception, passing complete frames to the router
+	 * @param error             Error code
+	 * @param bytes_transferred Number of bytes transferred
+	 */
+	void asyncReadHandler(const boost::system::error_code& error, size_t bytes_transferred);
+
+private:
+	/**
+	 * Index of the shard
+	 */
+	size_t index;
+
+	/**
+	 * Socket connected to the worker
+	 */
+	boost::asio::local::stream_protocol::socket socket;
+
+	/**
+	 * The router that handles received frames
+	 */
+	ShardRouter& router;
+
+	/**
+	 * Receive buffer. Grows to fit frames larger than it.
+	 */
+	std::vector<char> rxbuf;
+
+	/**
+	 * End of the received data in rxbuf
+	 */
+	size_t rxTail;
+
+	/**
+	 * Serializes writes to the socket
+	 */
+	std::mutex sendMutex;
+
+	/**
+	 * Set while the link is up
+	 */
+	std::atomic<bool> connected;
+
+	/**
+	 * Initial size of the receive buffer
+	 */
+	static const size_t RxBufferSize = 0x10000;
+};
+
+#endif // __SHARD_LINK_H__
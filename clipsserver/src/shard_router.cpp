@@ -0,0 +1,533 @@
+#include "server.h"
+#include "shard_router.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+
+/* ** ********************************************************
+* Static members
+* *** *******************************************************/
+const size_t ShardRouter::MaxShards;
+const uint32_t ShardRouter::UntrackedCommandId;
+const char ShardRouter::RelayMarker;
+constexpr std::chrono::milliseconds ShardRouter::AcquireTimeout;
+
+
+
+/**
+ * How each command is routed, indexed by opcode
+ */
+static const struct{
+	/**
+	 * The command changes the rule base or the engine configuration,
+	 * so it reaches every shard
+	 */
+	bool global;
+	/**
+	 * The arguments are text, so they may carry a shard tag
+	 */
+	bool textArgs;
+	/**
+	 * Success only tells whether rules fired (or a command was halted),
+	 * so the command succeeds if any shard does. Otherwise all must.
+	 */
+	bool anyShard;
+	/**
+	 * The results are counts, added up rather than concatenated
+	 */
+	bool counts;
+} commands[(size_t)protocol::Opcode::Count] = {
+	/* None   */ { true,  false, false, false },
+	/* Assert */ { false, true,  false, false },
+	/* Reset  */ { true,  false, false, false },
+	/* Clear  */ { true,  false, false, false },
+	/* Query  */ { false, true,  true,  false },
+	/* Raw    */ { false, true,  false, false },
+	/* Path   */ { true,  true,  false, false },
+	/* Print  */ { false, false, false, false },
+	/* Watch  */ { true,  false, false, false },
+	/* Load   */ { true,  true,  false, false },
+	/* Run    */ { false, false, true,  false },
+	/* Log    */ { true,  true,  false, false },
+	/* Fresh  */ { true,  false, false, false },
+	/* Stats  */ { true,  false, false, false },
+	/* AssertBatch */ { false, true, false, false },
+	/* Stream */ { false, true,  true,  true  },
+	/* Cancel */ { true,  false, true,  true  },
+};
+
+
+/**
+ * Encodes the start of a command: 0x00 + id
+ */
+static inline
+std::string command_header(uint32_t cmdId){
+	std::string s(1, '\0');
+	s.append((const char*)&cmdId, sizeof(cmdId));
+	return s;
+}
+
+
+/**
+ * Encodes a command with the given id, in the same form it was received
+ */
+static inline
+std::string encode_command(uint32_t cmdId, protocol::Opcode opcode, const std::string& arg, bool binary){
+	std::string s = command_header(cmdId);
+	if(binary) s+= (char)opcode;
+	else{
+		s+= protocol::opcodeName(opcode);
+		if( !arg.empty() ) s+= ' ';
+	}
+	s+= arg;
+	return s;
+}
+
+
+/**
+ * Removes a leading shard tag (@N followed by a space) from s
+ * @return true if s was tagged, false otherwise
+ */
+static inline
+bool strip_tag(std::string& s, size_t& shard){
+	if( (s.length() < 2) || (s[0] != '@') ) return false;
+	size_t i = 1;
+	shard = 0;
+	for(; (i < s.length()) && (s[i] >= '0') && (s[i] <= '9') && (i < 4); ++i)
+		shard = 10*shard + (s[i] - '0');
+	if( (i < 2) || ((i < s.length()) && (s[i] != ' ')) ) return false;
+	s.erase(0, i + 1);
+	return true;
+}
+
+
+/**
+ * Gets the first symbol of a fact or message, skipping the opening parenthesis
+ */
+static inline
+std::string first_symbol(const std::string& s){
+	size_t start = s.find_first_not_of(" \t(");
+	if(start == std::string::npos) return "";
+	size_t end = s.find_first_of(" \t()", start);
+	return s.substr(start, end - start);
+}
+
+
+
+ShardRouter::ShardRouter(Server& server, ShardKey key):
+	server(server), key(key), lastCommandId(0){
+	}
+
+
+size_t ShardRouter::size() const{
+	return links.size();
+}
+
+
+bool ShardRouter::addShard(const std::string& path){
+	if(links.size() >= MaxShards) return false;
+	auto link = std::make_shared<ShardLink>(links.size(), server.io_context, *this);
+	if( !link->connect(path, std::chrono::seconds(10)) ) return false;
+	links.push_back(link);
+	link->start();
+	return true;
+}
+
+
+size_t ShardRouter::hashShard(const std::string& key) const{
+	return std::hash<std::string>()(key) % links.size();
+}
+
+
+void ShardRouter::addPool(int zygoteFd, const std::string& basePath, size_t size){
+	poolPtr.reset( new EnginePool(server.io_context, *this, zygoteFd, basePath, size) );
+	poolPtr->start();
+}
+
+
+std::shared_ptr<EnginePool::Engine> ShardRouter::getEngine(const std::string& source){
+	std::lock_guard<std::mutex> lock(enginesMutex);
+	auto it = engines.find(source);
+	return (it != engines.end()) ? it->second : NULL;
+}
+
+
+bool ShardRouter::assignEngine(const std::string& source){
+	std::shared_ptr<EnginePool::Engine> engine = poolPtr->acquire(AcquireTimeout);
+	if(!engine){
+		LOG_WARNING(Shard, "No engine available for client %s", source.c_str());
+		return false;
+	}
+	{
+		// The previous engine, if any, exits once it replies to its last command
+		std::lock_guard<std::mutex> lock(enginesMutex);
+		engines[source] = engine;
+	}
+	// The client may have left while waiting
+	if( !server.getSession(source) ) releaseEngine(source);
+	LOG_INFO(Shard, "Client %s moved to engine %d", source.c_str(), engine->pid);
+	return true;
+}
+
+
+void ShardRouter::releaseEngine(const std::string& source){
+	std::shared_ptr<EnginePool::Engine> engine;
+	std::lock_guard<std::mutex> lock(enginesMutex);
+	auto it = engines.find(source);
+	if(it == engines.end()) return;
+	// Released outside the lock
+	engine = std::move(it->second);
+	engines.erase(it);
+}
+
+
+size_t ShardRouter::selectShard(const std::string& source, protocol::Opcode opcode, std::string& arg){
+	size_t shard;
+	if( (key == ShardKey::Tag) && commands[(size_t)opcode].textArgs && strip_tag(arg, shard) )
+		return (shard < links.size()) ? shard : links.size();
+	if(commands[(size_t)opcode].global) return AllShards;
+
+	switch(key){
+		case ShardKey::Prefix:
+			// A batch goes whole to the shard of its first fact
+			if( (opcode == protocol::Opcode::Assert) || (opcode == protocol::Opcode::AssertBatch) )
+				return hashShard( first_symbol(arg) );
+			return AllShards;
+
+		case ShardKey::Session:
+		case ShardKey::Tag:
+		default:
+			return hashShard(source);
+	}
+}
+
+
+void ShardRouter::routeCommand(const std::shared_ptr<TcpMessage>& msg){
+	const std::string& m = msg->getMessage();
+	Pending p;
+	p.source = msg->getSource();
+	p.cmdId = m.substr(1, 4);
+	p.success = false;
+	p.waiting = 0;
+
+	std::string arg;
+	bool binary;
+	protocol::Opcode opcode = protocol::decodeCommand(m.data() + 5, m.length() - 5, arg, binary);
+	p.opcode = opcode;
+	if( (opcode == protocol::Opcode::Fresh) && poolPtr ){
+		p.success = assignEngine(p.source);
+		acknowledge(p);
+		return;
+	}
+	if( (opcode == protocol::Opcode::Stats) && !getEngine(p.source) ){
+		// Workers push their stats to the front end, which relays them
+		std::lock_guard<std::mutex> lock(statsMutex);
+		if(arg == "subscribe") statsSubscribers.insert(p.source);
+		else if(arg == "unsubscribe"){
+			statsSubscribers.erase(p.source);
+			p.success = true;
+			acknowledge(p);
+			return;
+		}
+	}
+	size_t shard = (opcode != protocol::Opcode::None) ?
+		selectShard(p.source, opcode, arg) : links.size();
+	if(shard == links.size()){
+		acknowledge(p);
+		return;
+	}
+	if(opcode == protocol::Opcode::Log){
+		// The front end logs too, so it sets its own levels and answers.
+		// Workers are set the same way but their acks are discarded.
+		p.results.resize(1);
+		p.success = Logger::getInstance().configure(arg, p.results[0]);
+		if(p.success){
+			std::string payload = encode_command(UntrackedCommandId, opcode, arg, binary);
+			std::shared_ptr<EnginePool::Engine> engine = getEngine(p.source);
+			if(engine) engine->link->send(payload);
+			else for(size_t i = 0; i < links.size(); ++i) links[i]->send(payload);
+		}
+		acknowledge(p);
+		return;
+	}
+
+	if(opcode == protocol::Opcode::Cancel){
+		if( !targetCancel(p, arg, binary) ){
+			acknowledge(p);
+			return;
+		}
+	}
+	else{
+		// Clients with a dedicated engine send everything to it
+		p.engine = getEngine(p.source);
+		if(p.engine) p.waiting = 1;
+		else if(shard != AllShards) p.waiting = 1ull << shard;
+		else p.waiting = (links.size() < 64) ? (1ull << links.size()) - 1 : ~0ull;
+	}
+	p.results.resize(p.engine ? 1 : links.size());
+	p.success = !commands[(size_t)opcode].anyShard;
+	std::shared_ptr<ShardLink> engineLink = p.engine ? p.engine->link : NULL;
+
+	uint32_t cmdId;
+	uint64_t waiting = p.waiting;
+	{
+		// Registered before sending: the reply may arrive right away.
+		// Ids are only generated here. Skip the reserved ones.
+		std::lock_guard<std::mutex> lock(pendingMutex);
+		do{
+			if(++lastCommandId >= UntrackedCommandId) lastCommandId = 1;
+		}while( pending.count(lastCommandId) );
+		cmdId = lastCommandId;
+		pending[cmdId] = std::move(p);
+	}
+
+	std::string payload = encode_command(cmdId, opcode, arg, binary);
+	if(engineLink){
+		if( !engineLink->send(payload) ) resolve(engineLink->getIndex(), cmdId, false, "");
+		return;
+	}
+	for(size_t i = 0; i < links.size(); ++i){
+		if( (waiting & (1ull << i)) && !links[i]->send(payload) )
+			resolve(i, cmdId, false, "");
+	}
+}
+
+
+bool ShardRouter::targetCancel(Pending& p, std::string& arg, bool binary){
+	uint32_t target = 0;
+	bool scoped = !arg.empty();
+	if( scoped && !protocol::decodeCommandId(arg, binary, target) ) return false;
+	std::string id((const char*)&target, sizeof(target));
+
+	// Shards know commands by the id the router gave them. Without an id,
+	// the client's oldest run, query or stream command is the one running.
+	std::lock_guard<std::mutex> lock(pendingMutex);
+	auto found = pending.end();
+	for(auto it = pending.begin(); it != pending.end(); ++it){
+		const Pending& c = it->second;
+		if(c.source != p.source) continue;
+		if(scoped){
+			if(c.cmdId != id) continue;
+			found = it;
+			break;
+		}
+		if( (c.opcode != protocol::Opcode::Run) && (c.opcode != protocol::Opcode::Query) &&
+			(c.opcode != protocol::Opcode::Stream) ) continue;
+		if( (found == pending.end()) || (uint32_t(lastCommandId - it->first) > uint32_t(lastCommandId - found->first)) )
+			found = it;
+	}
+	if( found == pending.end() ) return false;
+	// Only the shards that did not reply are still running it
+	p.engine = found->second.engine;
+	p.waiting = found->second.waiting;
+	if(binary) arg.assign( (const char*)&found->first, sizeof(found->first) );
+	else arg = std::to_string(found->first);
+	return true;
+}
+
+
+void ShardRouter::routeMessage(const std::shared_ptr<TcpMessage>& msg){
+	// Received strings may carry a trailing null character
+	std::string text = msg->getMessage().c_str();
+	const std::string& source = msg->getSource();
+	size_t shard;
+	if( (key == ShardKey::Tag) && strip_tag(text, shard) ){
+		if(shard >= links.size()){
+			LOG_WARNING(Shard, "Discarded message from %s: shard %lu does not exist", source.c_str(), shard);
+			return;
+		}
+	}
+	else if(key == ShardKey::Prefix) shard = hashShard( first_symbol(text) );
+	else shard = hashShard(source);
+
+	// Asserted by the worker as the server would (see Server::parseMessage)
+	std::string fact = "(network " + source + " " + text + ")";
+	std::string payload = encode_command(UntrackedCommandId, protocol::Opcode::Assert, fact, false);
+	std::shared_ptr<EnginePool::Engine> engine = getEngine(source);
+	if(engine) engine->link->send(payload);
+	else links[shard]->send(payload);
+}
+
+
+void ShardRouter::handleFrame(size_t shard, const char* data, size_t length){
+	if(length < 1) return;
+
+	// Message for a client sent with (sendto) by a worker
+	if(data[0] == RelayMarker){
+		const char* sep = (const char*)std::memchr(data + 1, 0, length - 1);
+		if(!sep) return;
+		server.sendTo( std::string(data + 1, sep), std::string(sep + 1, data + length) );
+		return;
+	}
+
+	// Messages sent with (broadcast) by a worker
+	if( data[0] || (length < 6) ){
+		if(shard < EnginePool::FirstIndex){
+			server.broadcast( std::string(data, length) );
+			return;
+		}
+		sendToOwner( shard, std::string(data, length) );
+		return;
+	}
+
+	uint32_t cmdId;
+	std::memcpy(&cmdId, data + 1, sizeof(cmdId));
+	if(cmdId == protocol::StatusCommandId){
+		// All shards share watches and path. Shard 0 speaks for them.
+		if(shard != 0) return;
+		FramePtr frame = Frame::makeShared( std::string(data, length) );
+		{
+			std::lock_guard<std::mutex> lock(server.statusMutex);
+			server.statusFrame = frame;
+		}
+		server.broadcast(frame);
+		return;
+	}
+	if(cmdId == protocol::StatsCommandId){
+		if(shard < EnginePool::FirstIndex) pushStats( std::string(data, length) );
+		else sendToOwner( shard, std::string(data, length) );
+		return;
+	}
+	if( (cmdId == protocol::HelloCommandId) || (cmdId == UntrackedCommandId) ) return;
+	if(data[5] == protocol::PartialResult){
+		relayPartial(shard, cmdId, data + 6, length - 6);
+		return;
+	}
+	resolve(shard, cmdId, data[5] != 0, std::string(data + 6, length - 6));
+}
+
+
+void ShardRouter::sendToOwner(size_t engine, const std::string& payload){
+	// Dedicated engines are isolated: only their client hears them
+	std::unique_lock<std::mutex> lock(enginesMutex);
+	for(auto& kv : engines){
+		if(kv.second->link->getIndex() != engine) continue;
+		std::string owner = kv.first;
+		lock.unlock();
+		server.sendTo(owner, payload);
+		return;
+	}
+}
+
+
+void ShardRouter::pushStats(const std::string& payload){
+	std::vector<ConnectionPtr> sessions;
+	{
+		std::lock_guard<std::mutex> lock(statsMutex);
+		for(auto it = statsSubscribers.begin(); it != statsSubscribers.end(); ){
+			ConnectionPtr session = server.getSession(*it);
+			// Subscriptions end with the session
+			if(!session){
+				it = statsSubscribers.erase(it);
+				continue;
+			}
+			sessions.push_back(session);
+			++it;
+		}
+	}
+	// Sending may block (Block policy), so the lock is not held meanwhile
+	FramePtr frame = Frame::makeShared(payload);
+	for(auto& session : sessions)
+		session->send(frame, true);
+}
+
+
+void ShardRouter::handleDisconnection(size_t shard){
+	std::vector<uint32_t> orphans;
+	size_t slot;
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex);
+		for(auto& kv : pending)
+			if( waitsFor(kv.second, shard, slot) ) orphans.push_back(kv.first);
+	}
+	if(shard >= EnginePool::FirstIndex){
+		// Clients of a dead engine go back to the shards
+		std::shared_ptr<EnginePool::Engine> engine;
+		std::lock_guard<std::mutex> lock(enginesMutex);
+		for(auto it = engines.begin(); it != engines.end(); ++it){
+			if(it->second->link->getIndex() != shard) continue;
+			engine = std::move(it->second);
+			engines.erase(it);
+			break;
+		}
+	}
+	for(uint32_t cmdId : orphans)
+		resolve(shard, cmdId, false, "");
+}
+
+
+void ShardRouter::resolve(size_t shard, uint32_t cmdId, bool success, const std::string& result){
+	std::unique_lock<std::mutex> lock(pendingMutex);
+	auto it = pending.find(cmdId);
+	if(it == pending.end()) return;
+	Pending& p = it->second;
+	size_t slot;
+	if( !waitsFor(p, shard, slot) ) return;
+	p.waiting&= ~(1ull << slot);
+	p.success = commands[(size_t)p.opcode].anyShard ? (p.success || success) : (p.success && success);
+	p.results[slot] = result;
+	if(p.waiting) return;
+
+	Pending done = std::move(p);
+	pending.erase(it);
+	lock.unlock();
+	acknowledge(done);
+}
+
+
+void ShardRouter::relayPartial(size_t shard, uint32_t cmdId, const char* output, size_t length){
+	std::string frame(1, '\0');
+	std::string source;
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex);
+		auto it = pending.find(cmdId);
+		size_t slot;
+		if( (it == pending.end()) || !waitsFor(it->second, shard, slot) ) return;
+		source = it->second.source;
+		frame+= it->second.cmdId;
+	}
+	ConnectionPtr session = server.getSession(source);
+	if(!session) return;
+	frame+= protocol::PartialResult;
+	frame.append(output, length);
+	session->send( std::move(frame) );
+}
+
+
+bool ShardRouter::waitsFor(const Pending& p, size_t shard, size_t& slot){
+	if(p.engine) slot = (p.engine->link->getIndex() == shard) ? 0 : MaxShards;
+	else slot = (shard < MaxShards) ? shard : MaxShards;
+	return (slot < MaxShards) && (p.waiting & (1ull << slot));
+}
+
+
+void ShardRouter::acknowledge(const Pending& p){
+	ConnectionPtr session = server.getSession(p.source);
+	if(!session) return;
+
+	std::string ack(1, '\0');
+	ack+= p.cmdId;
+	ack+= p.success ? '\x01' : '\x00';
+	// Failed cancel commands carry no count, as when not sharded
+	bool counts = commands[(size_t)p.opcode].counts;
+	if(counts && p.success){
+		long total = 0;
+		for(const std::string& result : p.results)
+			total+= std::strtol(result.c_str(), NULL, 10);
+		ack+= std::to_string(total);
+	}
+	else if(!counts){
+		for(const std::string& result : p.results)
+			ack+= result;
+	}
+	FramePtr frame = Frame::makeShared( std::move(ack) );
+	// Same rule as Server::acknowledgeMessage
+	if( frame->isExtended() && (session->getProtocolVersion() < 2) ){
+		LOG_WARNING(Network, "Can't send %lu bytes to client %s: extended frames not negotiated.",
+			frame->getPayload().length(), p.source.c_str());
+		frame = Frame::makeShared( std::string(1, '\0') + p.cmdId + '\x00' );
+	}
+	session->send(frame);
+}
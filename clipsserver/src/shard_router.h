@@ -0,0 +1,344 @@
+/* ** *****************************************************************
+* shard_router.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file shard_router.h
+ * Definition of the ShardRouter class: the front end of a sharded
+ * server, which forwards messages to worker processes and merges
+ * their replies
+ */
+
+#ifndef __SHARD_ROUTER_H__
+#define __SHARD_ROUTER_H__
+#pragma once
+
+/** @cond */
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+/** @endcond */
+
+#include "shard_link.h"
+#include "engine_pool.h"
+#include "tcp_message.h"
+#include "clipsclient/protocol.h"
+
+
+
+class Server;
+
+/**
+ * Enumerates the keys used to pick the shard of a message
+ */
+enum class ShardKey{
+	/**
+	 * All messages of a client go to the same shard
+	 */
+	Session,
+	/**
+	 * Facts go to the shard of their name (first symbol).
+	 * Other data commands reach every shard.
+	 */
+	Prefix,
+	/**
+	 * Messages and text arguments starting with @N go to shard N.
+	 * Untagged ones are routed by session.
+	 */
+	Tag
+};
+
+/**
+ * Routes the messages received by the front end to the workers.
+ * Each worker is a forked clipsserver owning an independent CLIPS
+ * instance with the rule base loaded before forking.
+ *
+ * Assert, query, raw, run and print go to the shard selected by the key.
+ * Commands that change the rule base or the configuration of the engine
+ * (reset, clear, load, path, watch, log) reach every shard. Command ids
+ * are remapped so commands of different clients can't clash, and the
+ * replies of a command sent to several shards are merged into a single
+ * ack: it succeeds if all shards succeed and carries their results in
+ * shard order.
+ *
+ * With an engine pool, the fresh command hands the client a dedicated
+ * engine, which receives all of its messages from then on. The engine
+ * is released when the client disconnects or asks for another one.
+ *
+ * The stats command reaches every shard and the reports are merged
+ * like any other result. Stats pushed by the shards are relayed to the
+ * clients that subscribed through the front end.
+ */
+class ShardRouter{
+public:
+	/**
+	 * Initializes a new instance of ShardRouter
+	 * @param server The server whose clients receive the replies
+	 * @param key    The key used to pick the shard of a message
+	 */
+	ShardRouter(Server& server, ShardKey key);
+
+	// Disable copy constructor and assignment op.
+private:
+	/**
+	 * Copy constructor disabled
+	 */
+	ShardRouter(ShardRouter const& obj)        = delete;
+	/**
+	 * Copy assignment operator disabled
+	 */
+	ShardRouter& operator=(ShardRouter const&) = delete;
+
+public:
+	/**
+	 * Connects to a worker and adds it as the next shard
+	 * @param  path The path of the worker's local socket
+	 * @return      true if the worker was connected, false otherwise
+	 */
+	bool addShard(const std::string& path);
+
+	/**
+	 * Gets the number of shards
+	 * @return The number of shards
+	 */
+	size_t size() const;
+
+	/**
+	 * Forwards a command to its shard or shards
+	 * @remark Called by the routing thread only
+	 * @param msg The received command
+	 */
+	void routeCommand(const std::shared_ptr<TcpMessage>& msg);
+
+	/**
+	 * Forwards a plain message to its shard, where it is asserted
+	 * as (network endpoint message)
+	 * @remark Called by the routing thread only
+	 * @param msg The received message
+	 */
+	void routeMessage(const std::shared_ptr<TcpMessage>& msg);
+
+	/**
+	 * Handles a frame received from a worker
+	 * @param shard  The shard that sent the frame
+	 * @param data   The payload of the frame
+	 * @param length The length of the payload
+	 */
+	void handleFrame(size_t shard, const char* data, size_t length);
+
+	/**
+	 * Fails the commands waiting for a disconnected shard
+	 * @param shard The disconnected shard
+	 */
+	void handleDisconnection(size_t shard);
+
+	/**
+	 * Enables the fresh command, handing out engines from a pool
+	 * @param zygoteFd Socket connected to the zygote (see EnginePool)
+	 * @param basePath Prefix of the paths where new engines listen
+	 * @param size     Number of idle engines kept
+	 */
+	void addPool(int zygoteFd, const std::string& basePath, size_t size);
+
+	/**
+	 * Releases the dedicated engine of a client, if any
+	 * @param source The client
+	 */
+	void releaseEngine(const std::string& source);
+
+	/**
+	 * Maximum number of shards
+	 */
+	static const size_t MaxShards = 64;
+
+	/**
+	 * Id of forwarded commands whose ack is discarded
+	 */
+	static const uint32_t UntrackedCommandId = 0xfffffffd;
+
+	/**
+	 * First byte of the frames a worker sends to relay a message to
+	 * a client of the front end: marker + endpoint + '\0' + message
+	 */
+	static const char RelayMarker = '\x02';
+
+private:
+	/**
+	 * A command forwarded to one or more shards
+	 */
+	struct Pending{
+		/**
+		 * The client that sent the command
+		 */
+		std::string source;
+		/**
+		 * The original command id, as received
+		 */
+		std::string cmdId;
+		/**
+		 * One bit per shard that has not replied yet
+		 */
+		uint64_t waiting;
+		/**
+		 * Whether all shards (or any, see commands) succeeded so far
+		 */
+		bool success;
+		/**
+		 * The command, which tells how replies are merged
+		 */
+		protocol::Opcode opcode;
+		/**
+		 * Results of each shard
+		 */
+		std::vector<std::string> results;
+		/**
+		 * The dedicated engine the command was sent to, if any.
+		 * Keeps the engine alive until it replies.
+		 */
+		std::shared_ptr<EnginePool::Engine> engine;
+	};
+
+	/**
+	 * Picks the shard of a command. Strips the shard tag, if any.
+	 * @param  source The client that sent the command
+	 * @param  opcode The command
+	 * @param  arg    The arguments of the command
+	 * @return        The index of the shard, AllShards, or size() if the tag is invalid
+	 */
+	size_t selectShard(const std::string& source, protocol::Opcode opcode, std::string& arg);
+
+	/**
+	 * Maps a key to a shard
+	 */
+	size_t hashShard(const std::string& key) const;
+
+	/**
+	 * Gets the dedicated engine of a client
+	 * @return The engine, or null if the client uses the shards
+	 */
+	std::shared_ptr<EnginePool::Engine> getEngine(const std::string& source);
+
+	/**
+	 * Replaces the dedicated engine of a client with one from the pool
+	 * @return true if the client got a new engine, false otherwise
+	 */
+	bool assignEngine(const std::string& source);
+
+	/**
+	 * Picks the shards a cancel command is forwarded to: those running
+	 * the command it names or, if it names none, the client's oldest
+	 * run, query or stream command. The command id is replaced by the
+	 * one the shards know, so workers never halt another client's command.
+	 * @param  p      The cancel command. Its engine and waiting are set.
+	 * @param  arg    The id of the command to halt, if any
+	 * @param  binary Whether the arguments are binary
+	 * @return        true if there is something to halt, false otherwise
+	 */
+	bool targetCancel(Pending& p, std::string& arg, bool binary);
+
+	/**
+	 * Gets the slot of a shard or engine in the replies of a command
+	 * @return true if the command waits for a reply from shard, false otherwise
+	 */
+	static bool waitsFor(const Pending& p, size_t shard, size_t& slot);
+
+	/**
+	 * Registers the reply of a shard and sends the ack once all shards replied
+	 */
+	void resolve(size_t shard, uint32_t cmdId, bool success, const std::string& result);
+
+	/**
+	 * Sends the partial output of a command still running on a shard
+	 * to its client, with the command id the client used
+	 */
+	void relayPartial(size_t shard, uint32_t cmdId, const char* output, size_t length);
+
+	/**
+	 * Sends a frame received from a dedicated engine to its client
+	 */
+	void sendToOwner(size_t engine, const std::string& payload);
+
+	/**
+	 * Relays the stats pushed by a shard to the subscribed clients
+	 */
+	void pushStats(const std::string& payload);
+
+	/**
+	 * Sends the merged ack of a command to its client
+	 */
+	void acknowledge(const Pending& p);
+
+private:
+	/**
+	 * The server whose clients receive the replies
+	 */
+	Server& server;
+
+	/**
+	 * The key used to pick the shard of a message
+	 */
+	ShardKey key;
+
+	/**
+	 * Links to the workers, indexed by shard
+	 */
+	std::vector<std::shared_ptr<ShardLink>> links;
+
+	/**
+	 * Commands awaiting replies, by forwarded command id
+	 */
+	std::unordered_map<uint32_t, Pending> pending;
+
+	/**
+	 * Protects pending, accessed by the routing and I/O threads
+	 */
+	std::mutex pendingMutex;
+
+	/**
+	 * Last forwarded command id
+	 */
+	uint32_t lastCommandId;
+
+	/**
+	 * Dedicated engines, by client
+	 */
+	std::unordered_map<std::string, std::shared_ptr<EnginePool::Engine>> engines;
+
+	/**
+	 * Protects engines, accessed by the routing and I/O threads
+	 */
+	std::mutex enginesMutex;
+
+	/**
+	 * Clients receiving the stats pushed by the shards
+	 */
+	std::unordered_set<std::string> statsSubscribers;
+
+	/**
+	 * Protects statsSubscribers
+	 */
+	std::mutex statsMutex;
+
+	/**
+	 * Idle engines handed out by the fresh command.
+	 * Declared last, so its thread stops first.
+	 */
+	std::unique_ptr<EnginePool> poolPtr;
+
+	/**
+	 * Selects every shard
+	 */
+	static const size_t AllShards = (size_t)-1;
+
+	/**
+	 * Maximum time the fresh command waits for the pool to refill
+	 */
+	static constexpr std::chrono::milliseconds AcquireTimeout{10000};
+};
+
+#endif // __SHARD_ROUTER_H__
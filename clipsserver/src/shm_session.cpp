@@ -0,0 +1,305 @@
+#include "server.h"
+#include "shm_session.h"
+
+#include <thread>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+ShmSession::ShmSession(const std::string& name, uint32_t protocolVersion, Server& server):
+	name(name), endpoint("shm:" + name), server(server),
+	protocolVersion(protocolVersion), segment(NULL), mappedSize(0),
+	rxReceived(0), txOffset(0), closing(false),
+	queuedBytes(0), droppedFrames(0),
+	highWatermark(8 << 20), lowWatermark(4 << 20),
+	policy(SlowConsumerPolicy::DropOldest){
+	}
+
+ShmSession::~ShmSession(){
+	if(segment)
+		munmap(segment, mappedSize);
+	segment = NULL;
+}
+
+std::string ShmSession::getEndPointStr() const{
+	return endpoint;
+}
+
+size_t ShmSession::getQueuedBytes() const{
+	return queuedBytes;
+}
+
+size_t ShmSession::getDroppedFrames() const{
+	return droppedFrames;
+}
+
+void ShmSession::setWatermarks(size_t high, size_t low){
+	highWatermark = high;
+	lowWatermark = (low < high) ? low : high;
+}
+
+void ShmSession::setSlowConsumerPolicy(SlowConsumerPolicy policy){
+	this->policy = policy;
+}
+
+uint32_t ShmSession::getProtocolVersion() const{
+	return protocolVersion;
+}
+
+
+bool ShmSession::map(){
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+	if(fd < 0){
+		LOG_ERROR(Network, "Can't open shared memory %s: %s", name.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	void* addr = MAP_FAILED;
+	if( !fstat(fd, &st) && ((size_t)st.st_size >= sizeof(shm::Segment)) ){
+		mappedSize = st.st_size;
+		addr = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	::close(fd);
+	if(addr == MAP_FAILED){
+		LOG_ERROR(Network, "Can't map shared memory %s", name.c_str());
+		return false;
+	}
+	segment = static_cast<shm::Segment*>(addr);
+	// The client can change the segment at any time. Only this copy
+	// of the ring size is validated and used from now on.
+	uint64_t ringSize = segment->ringSize;
+	if( !segment->valid(mappedSize, ringSize) ){
+		LOG_ERROR(Network, "Invalid shared memory segment %s", name.c_str());
+		return false;
+	}
+	rxRing = segment->serverRing(ringSize);
+	txRing = segment->clientRing(ringSize);
+	return true;
+}
+
+
+void ShmSession::start(){
+	// The thread keeps the session (and the mapping) alive until it exits
+	std::thread( [self = shared_from_this()](){ self->serve(); } ).detach();
+}
+
+
+void ShmSession::serve(){
+	shm::Segment& seg = *segment;
+	while( !seg.closed.load(std::memory_order_acquire) ){
+		uint32_t observed = seg.serverEvent.prepare();
+		bool progress = receive();
+		{
+			std::lock_guard<std::mutex> lock(outboxMutex);
+			progress|= transmit();
+		}
+		if(queuedBytes <= lowWatermark) drained.notify_all();
+		if(progress){
+			seg.clientEvent.signal();
+			continue;
+		}
+		seg.serverEvent.wait(observed, PollTimeoutMs);
+	}
+	server.removeSession(endpoint);
+	close();
+}
+
+
+bool ShmSession::receive(){
+	shm::RingView& ring = rxRing;
+	bool progress = false;
+	for(;;){
+		if(!rxMessage){
+			// 1. Fetch header (see Session::parseFrames)
+			char header[protocol::ExtendedHeaderSize];
+			size_t available = ring.peek(header, sizeof(header));
+			if(available < protocol::HeaderSize) break;
+			size_t hdrsize = protocol::HeaderSize;
+			size_t length;
+			uint16_t msgsize;
+			std::memcpy(&msgsize, header, sizeof(msgsize));
+			if(msgsize == 0){
+				if(available < protocol::ExtendedHeaderSize) break;
+				uint32_t extsize;
+				std::memcpy(&extsize, header + sizeof(msgsize), sizeof(extsize));
+				if(extsize > protocol::MaxPayload) length = SIZE_MAX;
+				else length = extsize;
+				hdrsize = protocol::ExtendedHeaderSize;
+			}
+			else if(msgsize < protocol::HeaderSize) length = SIZE_MAX;
+			else length = msgsize - protocol::HeaderSize;
+			if(length == SIZE_MAX){
+				LOG_WARNING(Network, "Malformed frame from client %s. Disconnecting.", endpoint.c_str());
+				close();
+				return false;
+			}
+			ring.consume(hdrsize);
+			// 2. The payload is read straight into a pooled message
+			rxMessage = pool.acquire(endpoint, length);
+			rxReceived = 0;
+			progress = true;
+		}
+
+		// 3. Frames larger than the ring are read as they arrive
+		std::string& m = rxMessage->getMessage();
+		size_t length = m.length() - 1;
+		size_t read = ring.read(&m[rxReceived], length - rxReceived);
+		rxReceived+= read;
+		progress|= (read > 0);
+		if(rxReceived < length) break;
+		// Kept until the server's queue has room. Retried on the next poll.
+		if( !server.enqueueTcpMessage(rxMessage) ) break;
+		rxMessage.reset();
+	}
+	return progress;
+}
+
+
+bool ShmSession::transmit(){
+	shm::RingView& ring = txRing;
+	bool progress = false;
+	while( !outbox.empty() ){
+		const Frame& frame = *outbox.front().frame;
+		const std::string& header = frame.getHeader();
+		const std::string& payload = frame.getPayload();
+		size_t written;
+		if(txOffset < header.length()){
+			written = ring.write(header.data() + txOffset, header.length() - txOffset);
+			txOffset+= written;
+			progress|= (written > 0);
+			if(txOffset < header.length()) break;
+		}
+		size_t offset = txOffset - header.length();
+		written = ring.write(payload.data() + offset, payload.length() - offset);
+		txOffset+= written;
+		progress|= (written > 0);
+		if(txOffset < frame.size()) break;
+		queuedBytes-= frame.size();
+		outbox.pop_front();
+		txOffset = 0;
+	}
+	return progress;
+}
+
+
+bool ShmSession::send(const FramePtr& frame, bool droppable){
+	if(!segment || !frame) return false;
+	if( !frame->isValid() ){
+		LOG_WARNING(Network, "Can't send %lu bytes to client %s: payload too large.",
+			frame->getPayload().length(), endpoint.c_str());
+		return false;
+	}
+	if( frame->isExtended() && (protocolVersion < 2) ){
+		LOG_WARNING(Network, "Can't send %lu bytes to client %s: extended frames not negotiated.",
+			frame->getPayload().length(), endpoint.c_str());
+		return false;
+	}
+
+	std::unique_lock<std::mutex> lock(outboxMutex);
+	if( !enqueue(lock, frame, droppable) ) return false;
+	// Write what fits right away. The session thread writes the rest
+	// as the client makes room.
+	bool progress = transmit();
+	lock.unlock();
+	if(progress) segment->clientEvent.signal();
+	return true;
+}
+
+
+size_t ShmSession::send(const std::vector<FramePtr>& frames){
+	if(!segment) return 0;
+	size_t sent = 0;
+	std::unique_lock<std::mutex> lock(outboxMutex);
+	for(const FramePtr& frame : frames){
+		if( !frame->isValid() || (frame->isExtended() && (protocolVersion < 2)) ) break;
+		if( !enqueue(lock, frame, false) ){
+			// The Disconnect policy releases the lock
+			if( !lock.owns_lock() ) return sent;
+			break;
+		}
+		++sent;
+	}
+	bool progress = transmit();
+	lock.unlock();
+	if(progress) segment->clientEvent.signal();
+	return sent;
+}
+
+
+bool ShmSession::enqueue(std::unique_lock<std::mutex>& lock, const FramePtr& frame, bool droppable){
+	if( closing || !makeRoom(lock, frame->size(), droppable) ) return false;
+	queuedBytes+= frame->size();
+	outbox.push_back( {frame, droppable} );
+	return true;
+}
+
+
+bool ShmSession::makeRoom(std::unique_lock<std::mutex>& lock, size_t size, bool droppable){
+	if(queuedBytes + size <= highWatermark) return true;
+
+	switch(policy){
+		case SlowConsumerPolicy::Disconnect:
+			LOG_WARNING(Network, "Client %s is not reading (%lu bytes queued). Disconnecting.",
+				endpoint.c_str(), (size_t)queuedBytes);
+			lock.unlock();
+			close();
+			return false;
+
+		case SlowConsumerPolicy::DropOldest:{
+			// A frame partially written to the ring can't be dropped
+			auto it = outbox.begin();
+			if( (txOffset > 0) && (it != outbox.end()) ) ++it;
+			while( (it != outbox.end()) && (queuedBytes + size > lowWatermark) ){
+				if(!it->droppable){ ++it; continue; }
+				queuedBytes-= it->size();
+				it = outbox.erase(it);
+				++droppedFrames;
+			}
+			if( droppable && (queuedBytes + size > highWatermark) ){
+				++droppedFrames;
+				return false;
+			}
+			return true;
+		}
+
+		case SlowConsumerPolicy::Block:
+		default:
+			break;
+	}
+
+	// Block. Only the session thread drains the outbox, and it never sends.
+	drained.wait(lock, [this](){ return closing || (queuedBytes <= lowWatermark); });
+	return !closing;
+}
+
+
+void ShmSession::close(){
+	{
+		std::lock_guard<std::mutex> lock(outboxMutex);
+		if(closing) return;
+		closing = true;
+		outbox.clear();
+		queuedBytes = 0;
+	}
+	drained.notify_all();
+	// Wakes up both the session thread and the client
+	segment->closed.store(1, std::memory_order_release);
+	segment->serverEvent.signal();
+	segment->clientEvent.signal();
+}
+
+
+std::shared_ptr<ShmSession> ShmSession::makeShared(
+			const std::string& name,
+			uint32_t protocolVersion,
+			Server& server
+	){
+	std::shared_ptr<ShmSession> sp(new ShmSession(name, protocolVersion, server));
+	if( !sp->map() ) return NULL;
+	return sp;
+}
@@ -0,0 +1,312 @@
+/* ** *****************************************************************
+* shm_session.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file shm_session.h
+ * Definition of a shared-memory session: represents a channel between
+ * a client on the same host and the server through a pair of rings
+ * in shared memory
+ */
+
+#ifndef __SHM_SESSION_H__
+#define __SHM_SESSION_H__
+#pragma once
+
+/** @cond */
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <condition_variable>
+/** @endcond */
+
+#include "frame.h"
+#include "connection.h"
+#include "tcp_message.h"
+#include "clipsclient/shm.h"
+#include "clipsclient/protocol.h"
+
+
+
+class Server;
+
+/**
+ * Serves a client through a shared-memory segment created by the client
+ * (see shm.h). A dedicated thread moves received frames into the server's
+ * queue and outgoing frames into the segment, parking on the segment's
+ * server event while there is nothing to do. Frames sent while the ring
+ * has room are written straight into it by the sending thread.
+ */
+class ShmSession : public Connection, public std::enable_shared_from_this<ShmSession>{
+private:
+	/**
+	 * Initializes a new instance of ShmSession
+	 * @param name            The name of the shared-memory object
+	 * @param protocolVersion The protocol version negotiated by the client
+	 * @param server          The server that manages the session and handles incomming messages.
+	 */
+	ShmSession(const std::string& name, uint32_t protocolVersion, Server& server);
+
+	// Disable copy constructor and assignment op.
+	/**
+	 * Copy constructor disabled
+	 */
+	ShmSession(ShmSession const& obj)        = delete;
+	/**
+	 * Copy assignment operator disabled
+	 */
+	ShmSession& operator=(ShmSession const&) = delete;
+
+public:
+	~ShmSession();
+
+	/**
+	 * Gets a string representation of the remote endpoint
+	 * @return shm: followed by the name of the shared-memory object
+	 */
+	std::string getEndPointStr() const override;
+
+	/**
+	 * Gets the number of bytes enqueued for sending that are not yet in the ring
+	 * @return The number of bytes waiting to be sent to the remote client
+	 */
+	size_t getQueuedBytes() const override;
+
+	/**
+	 * Gets the number of frames discarded by the DropOldest policy
+	 * @return The number of frames discarded so far
+	 */
+	size_t getDroppedFrames() const override;
+
+	/**
+	 * Sets the outbound queue watermarks
+	 * @param high The amount of queued bytes that triggers the slow-consumer policy
+	 * @param low  The amount of queued bytes the queue is brought back to
+	 */
+	void setWatermarks(size_t high, size_t low) override;
+
+	/**
+	 * Sets the policy applied when the outbound queue exceeds the high watermark
+	 * @param policy The slow-consumer policy
+	 */
+	void setSlowConsumerPolicy(SlowConsumerPolicy policy) override;
+
+	/**
+	 * Gets the protocol version negotiated by the client on its socket
+	 * @return The negotiated protocol version
+	 */
+	uint32_t getProtocolVersion() const override;
+
+	using Connection::send;
+
+	/**
+	 * Sends an encoded frame to the remote client. The frame is written
+	 * straight into the ring when nothing is queued and it has room,
+	 * otherwise it is queued for the session thread.
+	 * @param frame     The frame to send
+	 * @param droppable Optional. When true the frame may be discarded by
+	 *                  the DropOldest policy (status and broadcasts).
+	 *                  Default: false
+	 * @return          true if the frame was sent or enqueued, false otherwise.
+	 */
+	bool send(const FramePtr& frame, bool droppable = false) override;
+
+	/**
+	 * Sends several frames at once, in order.
+	 * Frames are never dropped by the DropOldest policy.
+	 * @param frames    The frames to send
+	 * @return          The number of frames sent or enqueued
+	 */
+	size_t send(const std::vector<FramePtr>& frames) override;
+
+	/**
+	 * Closes the channel. The session thread removes the session from the server.
+	 */
+	void close() override;
+
+	/**
+	 * Starts the session thread
+	 */
+	void start();
+
+private:
+	/**
+	 * Maps the shared-memory object and validates the segment
+	 * @return true if the segment was mapped, false otherwise
+	 */
+	bool map();
+
+	/**
+	 * Body of the session thread
+	 */
+	void serve();
+
+	/**
+	 * Moves complete frames from the toServer ring into the server's queue.
+	 * Frames larger than the ring are read as they arrive.
+	 * @return true if any bytes were consumed, false otherwise
+	 */
+	bool receive();
+
+	/**
+	 * Writes as much of the outbox as fits into the toClient ring
+	 * @remark outboxMutex must be held by the caller
+	 * @return true if any bytes were written, false otherwise
+	 */
+	bool transmit();
+
+	/**
+	 * Enqueues a frame in the outbox applying the slow-consumer policy
+	 * @remark outboxMutex must be held by the caller through lock
+	 * @return true if the frame was enqueued, false otherwise
+	 */
+	bool enqueue(std::unique_lock<std::mutex>& lock, const FramePtr& frame, bool droppable);
+
+	/**
+	 * Applies the slow-consumer policy when adding size bytes to the
+	 * outbox would exceed the high watermark
+	 * @remark outboxMutex must be held by the caller through lock
+	 * @return true if the frame can be enqueued, false otherwise
+	 */
+	bool makeRoom(std::unique_lock<std::mutex>& lock, size_t size, bool droppable);
+
+private:
+	/**
+	 * Name of the shared-memory object
+	 */
+	std::string name;
+
+	/**
+	 * Stores a string representation of the remote endpoint
+	 */
+	std::string endpoint;
+
+	/**
+	 * The server that manages the session
+	 */
+	Server& server;
+
+	/**
+	 * Protocol version negotiated by the client
+	 */
+	uint32_t protocolVersion;
+
+	/**
+	 * The mapped segment
+	 */
+	shm::Segment* segment;
+
+	/**
+	 * Size of the mapping
+	 */
+	size_t mappedSize;
+
+	/**
+	 * The toServer ring, as validated by map()
+	 */
+	shm::RingView rxRing;
+
+	/**
+	 * The toClient ring, as validated by map()
+	 */
+	shm::RingView txRing;
+
+	/**
+	 * Recycles received messages
+	 */
+	TcpMessagePool pool;
+
+	/**
+	 * Message whose payload is being received
+	 */
+	std::shared_ptr<TcpMessage> rxMessage;
+
+	/**
+	 * Bytes of rxMessage received so far
+	 */
+	size_t rxReceived;
+
+	/**
+	 * Frame queued for sending
+	 */
+	struct OutFrame{
+		FramePtr frame;
+		bool droppable;
+		size_t size() const { return frame->size(); }
+	};
+
+	/**
+	 * Frames waiting to be written to the ring
+	 */
+	std::deque<OutFrame> outbox;
+
+	/**
+	 * Bytes of the first frame in the outbox already written to the ring
+	 */
+	size_t txOffset;
+
+	/**
+	 * Serializes writes to the toClient ring and protects the outbox
+	 */
+	std::mutex outboxMutex;
+
+	/**
+	 * Notifies senders blocked by the Block policy
+	 */
+	std::condition_variable drained;
+
+	/**
+	 * Set once the session is closed
+	 */
+	bool closing;
+
+	/**
+	 * Bytes in the outbox
+	 */
+	std::atomic<size_t> queuedBytes;
+
+	/**
+	 * Frames discarded by the DropOldest policy
+	 */
+	std::atomic<size_t> droppedFrames;
+
+	/**
+	 * Amount of queued bytes that triggers the slow-consumer policy
+	 */
+	size_t highWatermark;
+
+	/**
+	 * Amount of queued bytes the queue is brought back to
+	 */
+	size_t lowWatermark;
+
+	/**
+	 * Policy applied when the client does not read fast enough
+	 */
+	SlowConsumerPolicy policy;
+
+	/**
+	 * Maximum time the session thread parks before polling the segment
+	 */
+	static const long PollTimeoutMs = 100;
+
+public:
+	/**
+	 * Maps the given shared-memory object and creates a session for it
+	 * @param name            The name of the shared-memory object
+	 * @param protocolVersion The protocol version negotiated by the client
+	 * @param server          The server that manages the session
+	 * @return                A pointer to the session, or null if the
+	 *                        object could not be mapped or is not valid
+	 */
+	static std::shared_ptr<ShmSession> makeShared(
+			const std::string& name,
+			uint32_t protocolVersion,
+			Server& server
+	);
+};
+
+#endif // __SHM_SESSION_H__
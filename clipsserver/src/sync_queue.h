@@ -19,6 +19,8 @@
 /** @cond */
 #include <queue>
 #include <mutex>
+#include <limits>
+#include <vector>
 #include <chrono>
 #include <condition_variable>
 /** @endcond */
@@ -97,6 +99,37 @@ public:
 		this->_cv.notify_one();                           // Notifies consumers
 	}
 
+	/**
+	 * Retrieves an element from the synchronous queue without waiting
+	 * @param obj      The dequeued object
+	 * @return         true if an element was dequeued, false if the queue was empty.
+	 */
+	virtual bool tryConsume(T& obj) {
+		std::lock_guard<std::timed_mutex> lock(this->_m); // Exclusive access to the queue
+		if( this->_q.empty() ) return false;
+		obj = this->_q.front();                           // Retrieve object
+		this->_q.pop();                                   // Pop the queue
+		return true;
+	}
+
+	/**
+	 * Retrieves all elements currently in the synchronous queue without waiting
+	 * @param objs     A vector where dequeued elements are appended
+	 * @param max      Optional. The maximum number of elements to dequeue.
+	 *                 Default: no limit
+	 * @return         The number of dequeued elements
+	 */
+	virtual size_t consumeAll(std::vector<T>& objs, size_t max = std::numeric_limits<size_t>::max()) {
+		std::lock_guard<std::timed_mutex> lock(this->_m); // Exclusive access to the queue
+		size_t count = 0;
+		while( (count < max) && !this->_q.empty() ){
+			objs.push_back( this->_q.front() );           // Retrieve object
+			this->_q.pop();                               // Pop the queue
+			++count;
+		}
+		return count;
+	}
+
 	/**
 	 * Retrieves an element from the synchronous queue
 	 * @param obj      The dequeued object
@@ -1,8 +1,13 @@
 #include "tcp_message.h"
 
+#include <atomic>
+#include <algorithm>
+
 TcpMessage::TcpMessage(const std::string& source, const std::string& message):
 	source(source), message(message){}
 
+TcpMessage::TcpMessage(){}
+
 std::string& TcpMessage::getSource(){
 	return source;
 }
@@ -11,6 +16,52 @@ std::string& TcpMessage::getMessage(){
 	return message;
 }
 
+std::chrono::steady_clock::time_point TcpMessage::getStamp(trace::Stage stage) const{
+	return stamps[stage];
+}
+
+void TcpMessage::stamp(trace::Stage stage, std::chrono::steady_clock::time_point time){
+	stamps[stage] = time;
+}
+
 std::shared_ptr<TcpMessage> TcpMessage::makeShared(const std::string& source, const std::string& message){
 	return std::shared_ptr<TcpMessage>(new TcpMessage(source, message));
-}
\ No newline at end of file
+}
+
+
+TcpMessagePool::TcpMessagePool(size_t size):
+	slots(size), next(0){}
+
+std::shared_ptr<TcpMessage> TcpMessagePool::acquire(const std::string& source, const char* data, size_t length){
+	std::shared_ptr<TcpMessage>& slot = recycle(source);
+	// Copied once, followed by the null character
+	slot->message.reserve(length + 1);
+	slot->message.assign(data, length);
+	slot->message.push_back('\0');
+	return slot;
+}
+
+std::shared_ptr<TcpMessage> TcpMessagePool::acquire(const std::string& source, size_t length){
+	std::shared_ptr<TcpMessage>& slot = recycle(source);
+	// Filled by the caller. Only the null character is set.
+	slot->message.resize(length + 1);
+	slot->message[length] = '\0';
+	return slot;
+}
+
+std::shared_ptr<TcpMessage>& TcpMessagePool::recycle(const std::string& source){
+	std::shared_ptr<TcpMessage>& slot = slots[next];
+	next = (next + 1) % slots.size();
+	// The pool holds the only reference once the consumer is done
+	// with the message. Nobody else can acquire it then.
+	if( !slot || (slot.use_count() > 1) || (slot->message.capacity() > MaxPooledCapacity) )
+		slot = std::shared_ptr<TcpMessage>(new TcpMessage());
+	// use_count() is a relaxed load. The fence pairs with the release
+	// of the consumer's reference, so its last reads of the message
+	// happen before the message is overwritten.
+	else std::atomic_thread_fence(std::memory_order_acquire);
+	if(slot->source != source) slot->source = source;
+	std::fill(slot->stamps + 1, slot->stamps + trace::StageCount, std::chrono::steady_clock::time_point());
+	slot->stamps[trace::Received] = std::chrono::steady_clock::now();
+	return slot;
+}
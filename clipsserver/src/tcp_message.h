@@ -14,16 +14,27 @@
 #pragma once
 
 /** @cond */
+#include <chrono>
 #include <memory>
 #include <string>
+#include <vector>
 /** @endcond */
 
+#include "trace_format.h"
+
+class TcpMessagePool;
+
 class TcpMessage{
 	/**
 	 * Initializes a new instance of TcpMessage
 	 */
 	TcpMessage(const std::string& source, const std::string& message);
 
+	/**
+	 * Initializes an empty instance of TcpMessage (pooled messages)
+	 */
+	TcpMessage();
+
 	// Disable copy constructor and assignment op.
 private:
 	/**
@@ -50,6 +61,23 @@ public:
 	 */
 	std::string& getMessage();
 
+	/**
+	 * Retrieves the time when the message went through a stage of the
+	 * ingress pipeline
+	 * @param  stage The stage
+	 * @return       The time, or the clock's epoch if the message has
+	 *               not gone through the stage
+	 */
+	std::chrono::steady_clock::time_point getStamp(trace::Stage stage) const;
+
+	/**
+	 * Stamps the message with the time when it went through a stage
+	 * of the ingress pipeline
+	 * @param stage The stage
+	 * @param time  The time
+	 */
+	void stamp(trace::Stage stage, std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now());
+
 private:
 	/**
 	 * The message source. Typically a string representation of the
@@ -60,6 +88,10 @@ private:
 	 * The message itself
 	 */
 	std::string message;
+	/**
+	 * Time when the message went through each stage
+	 */
+	std::chrono::steady_clock::time_point stamps[trace::StageCount];
 
 
 public:
@@ -70,6 +102,84 @@ public:
 	 */
 	static std::shared_ptr<TcpMessage> makeShared(const std::string& source, const std::string& message);
 
+	friend class TcpMessagePool;
+};
+
+
+/**
+ * Recycles TcpMessage objects received through a single connection.
+ * Messages are handed out round-robin from a fixed set of slots. A slot
+ * is reused once its consumer has released the message, keeping both
+ * the object (and its shared_ptr control block) and the capacity of its
+ * strings, so steady-state reception does not touch the allocator.
+ * When the consumer lags behind, the busy slot is replaced by a fresh
+ * message and the old one is freed by its last owner.
+ * @remark Not thread-safe. Must be used by one producer at a time.
+ */
+class TcpMessagePool{
+public:
+	/**
+	 * Initializes a new instance of TcpMessagePool
+	 * @param size Number of pooled messages
+	 */
+	explicit TcpMessagePool(size_t size = 256);
+
+	// Disable copy constructor and assignment op.
+private:
+	/**
+	 * Copy constructor disabled
+	 */
+	TcpMessagePool(TcpMessagePool const& obj)        = delete;
+	/**
+	 * Copy assignment operator disabled
+	 */
+	TcpMessagePool& operator=(TcpMessagePool const&) = delete;
+
+public:
+	/**
+	 * Gets a message from the pool and fills it with the provided data.
+	 * A null character is appended to the message, as expected by the
+	 * command parser. The message is stamped as received.
+	 * @param source The message source
+	 * @param data   Pointer to the message data
+	 * @param length Length of the message data
+	 * @return       A pointer to the filled message
+	 */
+	std::shared_ptr<TcpMessage> acquire(const std::string& source, const char* data, size_t length);
+
+	/**
+	 * Gets a message from the pool with a message buffer of the
+	 * specified length (plus a trailing null character) to be filled
+	 * by the caller. The message is stamped as received.
+	 * @param source The message source
+	 * @param length Length of the message data
+	 * @return       A pointer to the message
+	 */
+	std::shared_ptr<TcpMessage> acquire(const std::string& source, size_t length);
+
+private:
+	/**
+	 * Gets the next slot, holding a message free to be overwritten.
+	 * The message is stamped as received.
+	 * @param source The message source
+	 * @return       The slot
+	 */
+	std::shared_ptr<TcpMessage>& recycle(const std::string& source);
+
+	/**
+	 * Pooled messages
+	 */
+	std::vector<std::shared_ptr<TcpMessage>> slots;
+
+	/**
+	 * Next slot to hand out
+	 */
+	size_t next;
+
+	/**
+	 * Messages whose buffers grew beyond this capacity are not recycled
+	 */
+	static const size_t MaxPooledCapacity = 4096;
 };
 
-#endif // __TCP_MESSAGE_H__
\ No newline at end of file
+#endif // __TCP_MESSAGE_H__
@@ -0,0 +1,175 @@
+/* ** *****************************************************************
+* trace_format.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file trace_format.h
+ * Layout of the trace files written by clipsserver and read by clipstrace
+ */
+
+#ifndef __TRACE_FORMAT_H__
+#define __TRACE_FORMAT_H__
+#pragma once
+
+/** @cond */
+#include <cstdint>
+/** @endcond */
+
+/**
+ * Message tracing.
+ *
+ * Every message is stamped with a monotonic clock as it moves through the
+ * ingress pipeline (see Stage). When tracing is enabled, a sample of the
+ * messages is written to a trace file: a Header followed by a ring of
+ * fixed-size Records. The server maps the file and overwrites the oldest
+ * records once the ring is full, so the file holds the most recent
+ * messages and can be read while the server runs.
+ */
+namespace trace{
+	/**
+	 * Identifies a trace file
+	 */
+	const uint32_t Magic = 0x45435254; // "TRCE"
+
+	/**
+	 * Version of the file layout
+	 */
+	const uint32_t Version = 1;
+
+	/**
+	 * Stages of a message, in the order they happen
+	 */
+	enum Stage{
+		/**
+		 * The frame was read from the connection
+		 */
+		Received = 0,
+		/**
+		 * The message was pushed into the ingress queue
+		 */
+		Enqueued,
+		/**
+		 * The CLIPS thread took the message from the queue
+		 */
+		Dequeued,
+		/**
+		 * CLIPS started processing the message
+		 */
+		EngineStart,
+		/**
+		 * CLIPS finished processing the message
+		 */
+		EngineEnd,
+		/**
+		 * The ack was handed to the connection. Only commands are acked.
+		 */
+		AckWritten,
+		/**
+		 * Number of stages
+		 */
+		StageCount
+	};
+
+	/**
+	 * Record flags
+	 */
+	enum Flags{
+		/**
+		 * The message was a command (it has an ack)
+		 */
+		Command = 0x01,
+		/**
+		 * The command succeeded
+		 */
+		Success = 0x02
+	};
+
+	/**
+	 * Beginning of a trace file
+	 */
+	struct Header{
+		/**
+		 * Magic
+		 */
+		uint32_t magic;
+		/**
+		 * Version of the file layout
+		 */
+		uint32_t version;
+		/**
+		 * Size of each record
+		 */
+		uint32_t recordSize;
+		/**
+		 * Number of records in the ring
+		 */
+		uint32_t capacity;
+		/**
+		 * Records written so far. Record n is stored in slot n % capacity.
+		 * Updated with release semantics after the record is complete.
+		 */
+		uint64_t written;
+		/**
+		 * Monotonic clock when the file was created, in nanoseconds
+		 */
+		uint64_t monotonicBase;
+		/**
+		 * Wall clock (nanoseconds since the epoch) at monotonicBase.
+		 * Used to convert stamps to wall-clock time.
+		 */
+		uint64_t realtimeBase;
+		/**
+		 * Process id of the server
+		 */
+		int32_t pid;
+		/**
+		 * Index of the shard, or -1 when the server is not sharded
+		 */
+		int32_t shard;
+		/**
+		 * Sampling rate: one message out of this many is traced
+		 */
+		uint32_t sampling;
+		/**
+		 * Reserved
+		 */
+		uint8_t reserved[12];
+	};
+
+	/**
+	 * A traced message
+	 */
+	struct Record{
+		/**
+		 * Monotonic clock at each Stage, in nanoseconds.
+		 * Zero when the message did not go through the stage.
+		 */
+		uint64_t stamps[StageCount];
+		/**
+		 * Number of the message among all messages processed
+		 */
+		uint64_t sequence;
+		/**
+		 * Number of rules fired while processing the message
+		 */
+		int32_t rulesFired;
+		/**
+		 * The command (a protocol::Opcode), or zero for plain messages
+		 */
+		uint8_t opcode;
+		/**
+		 * Combination of Flags
+		 */
+		uint8_t flags;
+		/**
+		 * Reserved
+		 */
+		uint16_t reserved;
+	};
+
+	static_assert(sizeof(Header) == 64, "Unexpected trace header size");
+	static_assert(sizeof(Record) == 64, "Unexpected trace record size");
+}
+
+#endif // __TRACE_FORMAT_H__
@@ -0,0 +1,107 @@
+#include "trace_log.h"
+#include "logger.h"
+
+#include <ctime>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+/* ** ********************************************************
+* Static members
+* *** *******************************************************/
+const size_t TraceLog::DefaultCapacity;
+
+
+
+TraceLog::TraceLog(const std::string& path, size_t sampling):
+	path(path), sampling(sampling ? sampling : 1), messages(0),
+	header(NULL), records(NULL), mappedSize(0){}
+
+
+TraceLog::~TraceLog(){
+	if(header) munmap(header, mappedSize);
+}
+
+
+/**
+ * Reads a clock in nanoseconds
+ */
+static
+uint64_t clock_ns(clockid_t clock){
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+bool TraceLog::open(size_t capacity, int shard){
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0){
+		LOG_ERROR(Server, "Can't create trace file %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	mappedSize = sizeof(trace::Header) + capacity * sizeof(trace::Record);
+	void* addr = MAP_FAILED;
+	if( !ftruncate(fd, mappedSize) )
+		addr = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(addr == MAP_FAILED){
+		LOG_ERROR(Server, "Can't map trace file %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	header = static_cast<trace::Header*>(addr);
+	records = reinterpret_cast<trace::Record*>(header + 1);
+	// The steady clock of libstdc++ is CLOCK_MONOTONIC, so message stamps
+	// and monotonicBase are on the same time line.
+	header->monotonicBase = clock_ns(CLOCK_MONOTONIC);
+	header->realtimeBase = clock_ns(CLOCK_REALTIME);
+	header->version = trace::Version;
+	header->recordSize = sizeof(trace::Record);
+	header->capacity = capacity;
+	header->written = 0;
+	header->pid = getpid();
+	header->shard = shard;
+	header->sampling = sampling;
+	// The magic goes last: readers ignore the file until it is set
+	__atomic_store_n(&header->magic, trace::Magic, __ATOMIC_RELEASE);
+	return true;
+}
+
+
+uint64_t TraceLog::sample(){
+	return ( (messages++ % sampling) == 0 ) ? messages : 0;
+}
+
+
+void TraceLog::write(const TcpMessage& msg, uint64_t sequence, protocol::Opcode opcode, bool command, bool success, int rulesFired){
+	uint64_t n = header->written;
+	trace::Record& r = records[n % header->capacity];
+	for(size_t i = 0; i < trace::StageCount; ++i){
+		auto t = msg.getStamp( (trace::Stage)i );
+		r.stamps[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+	}
+	r.sequence = sequence;
+	r.rulesFired = rulesFired;
+	r.opcode = (uint8_t)opcode;
+	r.flags = (command ? trace::Command : 0) | (success ? trace::Success : 0);
+	r.reserved = 0;
+	__atomic_store_n(&header->written, n + 1, __ATOMIC_RELEASE);
+}
+
+
+const std::string& TraceLog::getPath() const{
+	return path;
+}
+
+
+std::shared_ptr<TraceLog> TraceLog::makeShared(const std::string& path, size_t sampling, int shard, size_t capacity){
+	std::shared_ptr<TraceLog> log(new TraceLog(path, sampling));
+	if( !log->open(capacity ? capacity : DefaultCapacity, shard) ) return NULL;
+	return log;
+}
@@ -0,0 +1,136 @@
+/* ** *****************************************************************
+* trace_log.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file trace_log.h
+ * Definition of the TraceLog class, which writes sampled message
+ * traces to a memory-mapped ring file
+ */
+
+#ifndef __TRACE_LOG_H__
+#define __TRACE_LOG_H__
+#pragma once
+
+/** @cond */
+#include <memory>
+#include <string>
+#include <cstdint>
+/** @endcond */
+
+#include "tcp_message.h"
+#include "trace_format.h"
+#include "clipsclient/protocol.h"
+
+
+
+/**
+ * Writes sampled message traces to a trace file (see trace_format.h).
+ * The file is mapped once and records are copied into the ring, so
+ * tracing a message costs no system call.
+ * @remark Used by the CLIPS thread only
+ */
+class TraceLog{
+private:
+	/**
+	 * Initializes a new instance of TraceLog
+	 */
+	TraceLog(const std::string& path, size_t sampling);
+
+public:
+	~TraceLog();
+
+	// Disable copy constructor and assignment op.
+private:
+	/**
+	 * Copy constructor disabled
+	 */
+	TraceLog(TraceLog const& obj)        = delete;
+	/**
+	 * Copy assignment operator disabled
+	 */
+	TraceLog& operator=(TraceLog const&) = delete;
+
+public:
+	/**
+	 * Counts a processed message and tells whether it must be traced
+	 * @return The number of the message (from 1) if it is in the sample,
+	 *         zero otherwise
+	 */
+	uint64_t sample();
+
+	/**
+	 * Writes the trace of a message
+	 * @param msg        The message, with its stages stamped
+	 * @param sequence   The number of the message, as returned by sample()
+	 * @param opcode     The command, or Opcode::None for plain messages
+	 * @param command    true if the message was a command
+	 * @param success    true if the command succeeded
+	 * @param rulesFired Number of rules fired while processing the message
+	 */
+	void write(const TcpMessage& msg, uint64_t sequence, protocol::Opcode opcode, bool command, bool success, int rulesFired);
+
+	/**
+	 * Gets the path of the trace file
+	 */
+	const std::string& getPath() const;
+
+private:
+	/**
+	 * Creates and maps the trace file
+	 * @param capacity Number of records in the ring
+	 * @param shard    Index of the shard, or -1
+	 */
+	bool open(size_t capacity, int shard);
+
+private:
+	/**
+	 * Path of the trace file
+	 */
+	std::string path;
+
+	/**
+	 * One message out of this many is traced
+	 */
+	size_t sampling;
+
+	/**
+	 * Messages counted by sample()
+	 */
+	uint64_t messages;
+
+	/**
+	 * The mapped file
+	 */
+	trace::Header* header;
+
+	/**
+	 * The ring of records, right after the header
+	 */
+	trace::Record* records;
+
+	/**
+	 * Size of the mapping
+	 */
+	size_t mappedSize;
+
+public:
+	/**
+	 * Number of records in the ring of a new trace file (4 MiB)
+	 */
+	static const size_t DefaultCapacity = 65536;
+
+	/**
+	 * Creates a trace file and returns a shared pointer to a TraceLog that writes it
+	 * @param  path     Path of the trace file. Replaced if it exists.
+	 * @param  sampling One message out of this many is traced
+	 * @param  shard    Index of the shard, or -1 when the server is not sharded
+	 * @param  capacity Number of records in the ring
+	 * @return          The TraceLog, or null if the file could not be created
+	 */
+	static std::shared_ptr<TraceLog> makeShared(const std::string& path, size_t sampling,
+		int shard = -1, size_t capacity = DefaultCapacity);
+};
+
+#endif // __TRACE_LOG_H__
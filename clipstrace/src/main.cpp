@@ -0,0 +1,251 @@
+/** @file main.cpp
+* @author Mauricio Matamoros
+*
+* Anchor point (main function) for clipstrace.
+* Dumps the trace file written by clipsserver -tf: the time each traced
+* message spent in every stage of the ingress pipeline, followed by a
+* summary of each span.
+*
+*/
+
+/** @cond */
+#include <ctime>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+/** @endcond */
+
+#include "trace_format.h"
+#include "clipsclient/protocol.h"
+
+
+/* ** ********************************************************
+* Global variables
+* *** *******************************************************/
+/**
+ * Path of the trace file
+ */
+std::string tracePath;
+
+/**
+ * Number of records dumped, newest last. 0 dumps all of them.
+ */
+size_t last = 0;
+
+/**
+ * When set, only the summary is printed
+ */
+bool summaryOnly = false;
+
+/**
+ * Spans reported: time between two stages.
+ * StageCount stands for the last stage the message went through.
+ */
+const struct{ const char* name; trace::Stage from; trace::Stage to; } spans[] = {
+	{"read",   trace::Received,    trace::Enqueued},
+	{"queue",  trace::Enqueued,    trace::Dequeued},
+	{"decode", trace::Dequeued,    trace::EngineStart},
+	{"engine", trace::EngineStart, trace::EngineEnd},
+	{"ack",    trace::EngineEnd,   trace::AckWritten},
+	{"total",  trace::Received,    trace::StageCount},
+};
+
+/**
+ * Number of spans
+ */
+const size_t SpanCount = sizeof(spans) / sizeof(spans[0]);
+
+
+/* ** ********************************************************
+* Prototypes
+* *** *******************************************************/
+int main(int argc, char **argv);
+bool parseArgs(int argc, char **argv);
+bool readTrace(trace::Header& header, std::vector<trace::Record>& records);
+void dump(const trace::Header& header, const trace::Record& r);
+void report(const std::string& name, std::vector<double>& samples);
+static inline double span_us(const trace::Record& r, trace::Stage from, trace::Stage to);
+static inline const char* command_name(const trace::Record& r);
+
+
+/* ** ********************************************************
+* Main (program anchor)
+* *** *******************************************************/
+/**
+ * Program anchor
+ * @param  argc The number of arguments to the program
+ * @param  argv The arguments passed to the program
+ * @return      The program exit code
+ */
+int main(int argc, char **argv){
+	if( !parseArgs(argc, argv) ) return -1;
+
+	trace::Header header;
+	std::vector<trace::Record> records;
+	if( !readTrace(header, records) ) return -1;
+
+	printf("%s: pid %d", tracePath.c_str(), header.pid);
+	if(header.shard >= 0) printf(" shard %d", header.shard);
+	printf(", 1 in %u messages traced, %lu records (%llu written)\n\n", header.sampling,
+		records.size(), (unsigned long long)header.written);
+	if( records.empty() ) return 0;
+
+	if( (last > 0) && (last < records.size()) )
+		records.erase(records.begin(), records.end() - last);
+
+	if(!summaryOnly){
+		printf("%-10s %-15s %-8s", "seq", "time", "command");
+		for(size_t i = 0; i < SpanCount; ++i)
+			printf(" %9s", spans[i].name);
+		printf(" %6s %3s\n", "rules", "ok");
+		for(const trace::Record& r : records)
+			dump(header, r);
+		printf("\n");
+	}
+
+	printf("%-8s %8s %10s %10s %10s %10s %10s\n", "span", "count", "min", "p50", "p90", "p99", "max");
+	for(size_t i = 0; i < SpanCount; ++i){
+		std::vector<double> samples;
+		for(const trace::Record& r : records){
+			double us = span_us(r, spans[i].from, spans[i].to);
+			if(us >= 0) samples.push_back(us);
+		}
+		report(spans[i].name, samples);
+	}
+
+	long long rules = 0;
+	for(const trace::Record& r : records)
+		rules+= r.rulesFired;
+	printf("\nrules fired: %lld\n", rules);
+	return 0;
+}
+
+
+/* ** ********************************************************
+* Function definitions
+* *** *******************************************************/
+bool parseArgs(int argc, char **argv){
+	for(int i = 1; i < argc; ++i){
+		if (!strcmp(argv[i], "-h")) break;
+		else if (!strcmp(argv[i],"-s")) summaryOnly = true;
+		else if (!strcmp(argv[i],"-n") && (i+1 < argc)) last = std::stoul(argv[++i]);
+		else if (argv[i][0] != '-') tracePath = argv[i];
+		else break;
+	}
+	if( tracePath.empty() ){
+		printf("Usage: %s [-n last_records] [-s] trace_file\n", argv[0]);
+		printf("    -n  Dumps only the newest records\n");
+		printf("    -s  Prints only the summary\n");
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * Reads the header and the records of the trace file, oldest first.
+ * The file may be read while the server writes it.
+ * @param  header  Receives the header
+ * @param  records Receives the records
+ * @return         true if the file is a valid trace file, false otherwise
+ */
+bool readTrace(trace::Header& header, std::vector<trace::Record>& records){
+	FILE* f = fopen(tracePath.c_str(), "rb");
+	if(!f){
+		fprintf(stderr, "Can't open %s: %s\n", tracePath.c_str(), strerror(errno));
+		return false;
+	}
+	if( (fread(&header, sizeof(header), 1, f) != 1) || (header.magic != trace::Magic) ||
+		(header.version != trace::Version) || (header.recordSize != sizeof(trace::Record)) ){
+		fprintf(stderr, "%s is not a trace file\n", tracePath.c_str());
+		fclose(f);
+		return false;
+	}
+
+	std::vector<trace::Record> ring(header.capacity);
+	size_t slots = fread(ring.data(), sizeof(trace::Record), ring.size(), f);
+	fclose(f);
+
+	// Unwrap the ring. Once it is full, the oldest record is in the next slot to write.
+	uint64_t count = std::min<uint64_t>(header.written, header.capacity);
+	size_t first = (header.written > header.capacity) ? header.written % header.capacity : 0;
+	for(uint64_t i = 0; i < count; ++i){
+		size_t slot = (first + i) % header.capacity;
+		if(slot < slots) records.push_back( ring[slot] );
+	}
+	return true;
+}
+
+
+/**
+ * Prints a record as a line of the dump
+ * @param header The header of the trace file
+ * @param r      The record
+ */
+void dump(const trace::Header& header, const trace::Record& r){
+	// Wall-clock time when the message was received
+	uint64_t ns = header.realtimeBase + (r.stamps[trace::Received] - header.monotonicBase);
+	time_t secs = ns / 1000000000ull;
+	struct tm tm;
+	char time[32];
+	localtime_r(&secs, &tm);
+	size_t len = strftime(time, sizeof(time), "%H:%M:%S", &tm);
+	snprintf(time + len, sizeof(time) - len, ".%06llu", (unsigned long long)(ns % 1000000000ull) / 1000);
+
+	printf("%-10llu %-15s %-8s", (unsigned long long)r.sequence, time, command_name(r));
+	for(size_t i = 0; i < SpanCount; ++i){
+		double us = span_us(r, spans[i].from, spans[i].to);
+		if(us < 0) printf(" %9s", "-");
+		else printf(" %9.1f", us);
+	}
+	const char* ok = (r.flags & trace::Command) ? ( (r.flags & trace::Success) ? "yes" : "no" ) : "-";
+	printf(" %6d %3s\n", r.rulesFired, ok);
+}
+
+
+/**
+ * Prints percentiles of the given samples (in microseconds)
+ * @param name    Name of the span
+ * @param samples Measured spans in microseconds
+ */
+void report(const std::string& name, std::vector<double>& samples){
+	if( samples.empty() ){
+		printf("%-8s %8d\n", name.c_str(), 0);
+		return;
+	}
+	std::sort(samples.begin(), samples.end());
+	auto pct = [&](double p){ return samples[ (size_t)(p * (samples.size() - 1)) ]; };
+	printf("%-8s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f  (us)\n", name.c_str(), samples.size(),
+		samples.front(), pct(0.5), pct(0.9), pct(0.99), samples.back());
+}
+
+
+/**
+ * Returns the time between two stages of a record in microseconds
+ * @param  r    The record
+ * @param  from The first stage
+ * @param  to   The second stage, or StageCount for the last one
+ * @return      The time in microseconds, or -1 if the message did not
+ *              go through both stages
+ */
+static inline double span_us(const trace::Record& r, trace::Stage from, trace::Stage to){
+	if(to == trace::StageCount)
+		for(to = trace::AckWritten; (to > from) && !r.stamps[to]; to = (trace::Stage)(to - 1));
+	if( !r.stamps[from] || !r.stamps[to] ) return -1;
+	return (int64_t)(r.stamps[to] - r.stamps[from]) / 1000.0;
+}
+
+
+/**
+ * Returns the name of the command of a record
+ * @param  r The record
+ * @return   The name of the command, or "message" for plain messages
+ */
+static inline const char* command_name(const trace::Record& r){
+	if( !(r.flags & trace::Command) ) return "message";
+	const char* name = protocol::opcodeName( (protocol::Opcode)r.opcode );
+	return *name ? name : "?";
+}
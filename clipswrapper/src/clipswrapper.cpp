@@ -9,6 +9,7 @@
 
 #include <map>
 #include <stack>
+#include <atomic>
 #include "clipswrapper.h"
 
 
@@ -16,6 +17,10 @@ extern "C" {
 	#include "clips/clips.h"
 	#include "clips/commline.h"
 	#include "clips/prcdrfun.h"
+	#include "clips/factrhs.h"
+	#include "clips/exprnops.h"
+	#include "clips/prntutil.h"
+	#include "clips/strngrtr.h"
 }
 
 
@@ -29,6 +34,32 @@ char* clipsstr(const std::string& s){
 	return s.length() ? (char*)s.c_str() : NULL;
 }
 
+/**
+ * Returns a copy of s, up to its first null character, that the CLIPS
+ * scanner can read to the end without ever reaching EOF: GetcCLIPS
+ * waits forever for more input when a router returns EOF. Open strings
+ * and comments are closed and a STOP character (0x03) is appended.
+ */
+static
+std::string terminate_source(const std::string& s){
+	std::string text(s.c_str());
+	bool inString = false, inComment = false, escaped = false;
+	for(char c : text){
+		if(escaped) escaped = false;
+		else if(inString){
+			if(c == '\\') escaped = true;
+			else if(c == '"') inString = false;
+		}
+		else if(inComment) inComment = (c != '\n') && (c != '\r');
+		else if(c == '"') inString = true;
+		else if(c == ';') inComment = true;
+	}
+	if(escaped) text+= ' ';
+	if(inString) text+= '"';
+	text+= "\n\x03";
+	return text;
+}
+
 
 namespace clips{
 std::map<WatchItem,std::string> watchItems = {
@@ -72,12 +103,104 @@ const std::string version(){
 }
 
 
+/**
+ * Set by requestHalt(), possibly from another thread
+ */
+static std::atomic<bool> haltFlag(false);
+
+/**
+ * Set when the run in progress was halted by haltFlag
+ */
+static bool halted = false;
+
+/**
+ * Called by CLIPS after every rule fired. Turns a halt request into
+ * HaltExecution, which stops Run() before the next rule. Unlike
+ * HaltRules it also stops runs nested in the actions of a rule.
+ */
+extern "C" void halt_check(){
+	if( halted || !haltFlag.load(std::memory_order_relaxed) ) return;
+	halted = true;
+	SetHaltExecution(TRUE);
+}
+
+
+/**
+ * Fires rules unless a halt was requested. HaltExecution is cleared
+ * afterwards if it was set by halt_check(), so it does not make the
+ * commands that follow fail.
+ */
+static
+int run_unless_halted(int maxRules){
+	if( haltFlag.load(std::memory_order_relaxed) ) return 0;
+	int fired = Run(maxRules);
+	if(halted){
+		halted = false;
+		SetHaltExecution(FALSE);
+	}
+	return fired;
+}
+
+
+void requestHalt(){
+	haltFlag.store(true, std::memory_order_relaxed);
+}
+
+
+void clearHalt(){
+	haltFlag.store(false, std::memory_order_relaxed);
+}
+
+
 int run(int maxRules){
-	return Run(maxRules);
+	return run_unless_halted(maxRules);
+}
+
+
+/**
+ * End of the budget of the bounded run in progress
+ */
+static std::chrono::steady_clock::time_point runDeadline;
+
+/**
+ * Set when the bounded run in progress is stopped by its budget
+ */
+static bool runExpired;
+
+/**
+ * Rules fired during the bounded run in progress
+ */
+static unsigned runFired;
+
+/**
+ * Called by CLIPS after every rule fired during a bounded run.
+ * The clock is read every 8 rules, which keeps the check cheap for
+ * short rules. HaltRules stops Run() before the next rule, and Run()
+ * clears it.
+ */
+extern "C" void run_budget_check(){
+	if( (++runFired & 7) || runExpired || (std::chrono::steady_clock::now() < runDeadline) ) return;
+	runExpired = true;
+	HaltRules = TRUE;
+}
+
+
+int run(int maxRules, std::chrono::microseconds budget, bool& expired){
+	static char name[] = "run-budget";
+	runDeadline = std::chrono::steady_clock::now() + budget;
+	runExpired = false;
+	runFired = 0;
+	AddRunFunction(name, run_budget_check, 0);
+	int fired = run_unless_halted(maxRules);
+	RemoveRunFunction(name);
+	expired = runExpired;
+	return fired;
 }
 
 void initialize(){
+	static char name[] = "halt-request";
 	InitializeCLIPS();
+	AddRunFunction(name, halt_check, 0);
 }
 
 void rerouteStdin(int argc, char** argv){
@@ -100,6 +223,22 @@ void setFactListChanged(const bool changed){
 	SetFactListChanged(changed);
 }
 
+long getNumberOfFacts(){
+	return GetNumberOfFacts();
+}
+
+long getNumberOfActivations(){
+	return GetNumberOfActivations();
+}
+
+long memUsed(){
+	return MemUsed();
+}
+
+long memRequests(){
+	return MemRequests();
+}
+
 int returnArgCount(){
 	return RtnArgCount();
 }
@@ -126,6 +265,55 @@ void assertString(const std::string& s){
 }
 
 
+size_t assertBatch(const std::string& facts, int& failed){
+	// Same steps as StringToFact, over one string router for all facts
+	static char source[] = "assert_batch";
+	size_t asserted = 0;
+	failed = -1;
+	std::string text = terminate_source(facts);
+	if( !OpenStringSource(source, (char*)text.c_str(), 0) ){
+		failed = 0;
+		return 0;
+	}
+
+	struct token token;
+	for(int index = 0; ; ++index){
+		GetToken(source, &token);
+		if(token.type == STOP) break;
+		int error = FALSE;
+		struct expr* args = GetRHSPattern(source, &token, &error, FALSE, FALSE, TRUE, RPAREN);
+		if( !error && ExpressionContainsVariables(args, FALSE) ){
+			LocalVariableErrorMessage((char*)"the assert-batch command");
+			SetEvaluationError(TRUE);
+			error = TRUE;
+		}
+		if(error || !args){
+			ReturnExpression(args);
+			failed = index;
+			break;
+		}
+
+		int fields = 0;
+		for(struct expr* arg = args->nextArg; arg; arg = arg->nextArg)
+			++fields;
+		struct fact* f = CreateFactBySize(fields);
+		f->whichDeftemplate = (struct deftemplate*)args->value;
+		DATA_OBJECT value;
+		int i = 0;
+		for(struct expr* arg = args->nextArg; arg; arg = arg->nextArg, ++i){
+			EvaluateExpression(arg, &value);
+			f->theProposition.theFields[i].type = value.type;
+			f->theProposition.theFields[i].value = value.value;
+		}
+		ReturnExpression(args);
+		if( Assert(f) ) ++asserted;
+	}
+
+	CloseStringSource(source);
+	return asserted;
+}
+
+
 void printAgenda(
 	const std::string& logicalName,
 	const std::string& module){
@@ -0,0 +1,225 @@
+#include <cctype>
+#include <cstdlib>
+#include "factbuilder.h"
+
+
+extern "C" {
+	#include "clips/clips.h"
+	#include "clips/pattern.h"
+	#include "clips/modulpsr.h"
+	#include "clips/modulutl.h"
+	#include "clips/tmpltpsr.h"
+}
+
+
+/* ** ***************************************************************
+*
+* Helpers
+*
+** ** **************************************************************/
+/**
+ * Checks for the characters the CLIPS scanner skips between tokens
+ */
+static inline
+bool is_space(char c){
+	return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\f');
+}
+
+
+/**
+ * Checks for the characters that end a symbol or a number in the CLIPS
+ * scanner. Bytes above 0x7F are not printable for the scanner.
+ */
+static inline
+bool is_delimiter(char c){
+	return (c == '<') || (c == '"') || (c == '(') || (c == ')') || (c == '&') ||
+		(c == '|') || (c == '~') || (c == ' ') || (c == ';') || !isprint( (unsigned char)c );
+}
+
+
+/**
+ * Classifies a token beginning with a digit, a sign or a period with the
+ * same state machine the CLIPS scanner uses (ScanNumber)
+ * @param  token  The token
+ * @param  length The length of the token
+ * @param  isFloat Receives whether the number is a float
+ * @return         true if the token is a number, false if it is a symbol
+ */
+static
+bool scan_number(const char* token, size_t length, bool& isFloat){
+	// Phases: -1 sign, 0 integral, 1 decimal, 2 exponent-begin, 3 exponent-value
+	int phase = -1;
+	bool digitFound = false;
+	isFloat = false;
+	for(size_t i = 0; i < length; ++i){
+		char c = token[i];
+		bool digit = isdigit( (unsigned char)c );
+		bool exponent = (c == 'e') || (c == 'E');
+		bool sign = (c == '+') || (c == '-');
+		if( (phase == -1) && sign ) phase = 0;
+		else if( (phase <= 1) && digit ) { phase = (phase < 0) ? 0 : phase; digitFound = true; }
+		else if( (phase <= 0) && (c == '.') ) { isFloat = true; phase = 1; }
+		else if( (phase <= 1) && exponent ) { isFloat = true; phase = 2; }
+		else if( (phase == 2) && (digit || sign) ) phase = 3;
+		else if( (phase == 3) && digit ) continue;
+		else return false;
+	}
+	if(phase == 2) return false;
+	if( (phase == 3) && ( (token[length-1] == '+') || (token[length-1] == '-') ) ) return false;
+	return digitFound;
+}
+
+
+namespace clips{
+/* ** ***************************************************************
+*
+* FactBuilder class members
+*
+** ** **************************************************************/
+FactBuilder::FactBuilder(const std::string& relation) :
+	relation(relation), count(0){}
+
+
+FactBuilder& FactBuilder::append(long value){
+	next(FieldType::Integer).integer = value;
+	return *this;
+}
+
+
+FactBuilder& FactBuilder::append(double value){
+	next(FieldType::Float).real = value;
+	return *this;
+}
+
+
+bool FactBuilder::append(const std::string& text){
+	const char* s = text.c_str();
+	size_t start = count;
+	size_t pos = 0;
+	while(true){
+		while( is_space(s[pos]) ) ++pos;
+		if(!s[pos]) return true;
+		if( !appendToken(s, pos) ){
+			count = start;
+			return false;
+		}
+	}
+}
+
+
+bool FactBuilder::appendToken(const char* text, size_t& pos){
+	const char* token = text + pos;
+	// Strings: a backslash escapes the next character
+	if(*token == '"'){
+		std::string& s = next(FieldType::String).text;
+		s.clear();
+		size_t i = 1;
+		for(; token[i] && (token[i] != '"'); ++i){
+			if( (token[i] == '\\') && !token[++i] ) return false;
+			s.push_back(token[i]);
+		}
+		if(!token[i]) return false;
+		pos+= i + 1;
+		return true;
+	}
+
+	size_t length = 0;
+	while( !is_delimiter(token[length]) ) ++length;
+	// Variables, wildcards, function calls and everything that is not
+	// a symbol or a number are left to the parser
+	if( (length == 0) || (*token == '?') || (*token == '$') || (*token == '=') ) return false;
+	// [name] is an instance name
+	if( (*token == '[') && (length > 2) && (token[length-1] == ']') ) return false;
+	pos+= length;
+
+	bool isFloat;
+	if( (isdigit( (unsigned char)*token ) || (*token == '+') || (*token == '-') || (*token == '.')) &&
+		scan_number(token, length, isFloat) ){
+		// Same conversions as the scanner, on a null-terminated copy
+		Field& f = next(isFloat ? FieldType::Float : FieldType::Integer);
+		f.text.assign(token, length);
+		if(isFloat) f.real = atof( f.text.c_str() );
+		else f.integer = atol( f.text.c_str() );
+		return true;
+	}
+	next(FieldType::Symbol).text.assign(token, length);
+	return true;
+}
+
+
+bool FactBuilder::assertFact(){
+	char* name = (char*)relation.c_str();
+	if( relation.empty() || ReservedPatternSymbol(name, NULL) ) return false;
+
+	// Find or create the implied deftemplate the same way the parser does
+	int found;
+	struct deftemplate* tmplt = (struct deftemplate*)
+		FindImportedConstruct((char*)"deftemplate", NULL, name, &found, TRUE, NULL);
+	if(found > 1) return false;
+	if(tmplt == NULL){
+		if( FindImportExportConflict((char*)"deftemplate", (struct defmodule*)GetCurrentModule(), name) )
+			return false;
+		tmplt = CreateImpliedDeftemplate((SYMBOL_HN*)AddSymbol(name), TRUE);
+	}
+	if(!tmplt->implied) return false;
+
+	// An ordered fact has a single multifield slot holding all the fields
+	struct fact* theFact = CreateFact(tmplt);
+	if(count > 0){
+		VOID* mf = CreateMultifield(count);
+		for(size_t i = 0; i < count; ++i){
+			const Field& f = fields[i];
+			switch(f.type){
+				case FieldType::Symbol:
+					SetMFType(mf, i+1, SYMBOL);
+					SetMFValue(mf, i+1, AddSymbol( (char*)f.text.c_str() ));
+					break;
+				case FieldType::String:
+					SetMFType(mf, i+1, STRING);
+					SetMFValue(mf, i+1, AddSymbol( (char*)f.text.c_str() ));
+					break;
+				case FieldType::Integer:
+					SetMFType(mf, i+1, INTEGER);
+					SetMFValue(mf, i+1, AddLong(f.integer));
+					break;
+				case FieldType::Float:
+					SetMFType(mf, i+1, FLOAT);
+					SetMFValue(mf, i+1, AddDouble(f.real));
+					break;
+			}
+		}
+		DATA_OBJECT value;
+		SetpType(&value, MULTIFIELD);
+		SetpValue(&value, mf);
+		SetpDOBegin(&value, 1);
+		SetpDOEnd(&value, count);
+		PutFactSlot(theFact, NULL, &value);
+	}
+	Assert(theFact);
+	return true;
+}
+
+
+void FactBuilder::clear(){
+	count = 0;
+}
+
+
+const std::string& FactBuilder::getRelation() const{
+	return relation;
+}
+
+
+size_t FactBuilder::size() const{
+	return count;
+}
+
+
+FactBuilder::Field& FactBuilder::next(FieldType type){
+	if(count == fields.size()) fields.emplace_back();
+	Field& f = fields[count++];
+	f.type = type;
+	return f;
+}
+
+} // end namespace clips
@@ -1,6 +1,10 @@
 #include <cstring>
 #include "queryrouter.h"
 
+extern "C" {
+	#include "clips/clips.h"
+}
+
 namespace clips{
 /* ** ***************************************************************
 *
@@ -11,6 +15,7 @@ extern "C"{
 	static int queryFunction(char* logicalName);
 	static int printFunction(char *logicalName, char *str);
 	static int exitFunction(int exitCode);
+	static void runFunction();
 }
 
 
@@ -33,7 +38,7 @@ QueryRouter& QueryRouter::getInstance(
 
 QueryRouter::QueryRouter(const std::string& routerName, clips::RouterPriority priority):
 	routerName(routerName), priority(priority),
-	registered(false), enabled(false){}
+	registered(false), enabled(false), chunkSize(0), latency(0){}
 
 QueryRouter::~QueryRouter(){
 	unregisterR();
@@ -92,7 +97,36 @@ std::string QueryRouter::read(){
 
 
 void QueryRouter::write(const std::string& s){
+	if( handler && buffer.empty() )
+		deadline = std::chrono::steady_clock::now() + latency;
 	buffer+=s;
+	if( handler && ( (buffer.length() >= chunkSize) || (std::chrono::steady_clock::now() >= deadline) ) )
+		flush();
+}
+
+
+void QueryRouter::stream(const OutputHandler& handler, size_t chunkSize, std::chrono::milliseconds latency){
+	static char name[] = "query-stream";
+	flush();
+	if( handler && !this->handler ) AddRunFunction(name, runFunction, 0);
+	else if( !handler && this->handler ) RemoveRunFunction(name);
+	this->handler = handler;
+	this->chunkSize = (chunkSize > 0) ? chunkSize : 1;
+	this->latency = latency;
+}
+
+
+void QueryRouter::flush(){
+	if( !handler || buffer.empty() ) return;
+	for(size_t i = 0; i < buffer.length(); i+= chunkSize)
+		handler( buffer.substr(i, chunkSize) );
+	buffer.clear();
+}
+
+
+void QueryRouter::flushIfDue(){
+	if( handler && !buffer.empty() && (std::chrono::steady_clock::now() >= deadline) )
+		flush();
 }
 
 
@@ -167,4 +201,12 @@ int exitFunction(int exitCode){
 	return 1;
 }
 
+/*
+Called by CLIPS after every rule fired while streaming, so output
+printed before a long stretch of silent rules is not held back.
+*/
+void runFunction(){
+	QueryRouter::getInstance().flushIfDue();
+}
+
 } // end namespace clips
@@ -6,6 +6,7 @@
 #include <map>
 #include <mutex>
 #include <string>
+#include <vector>
 #include <iomanip>
 #include <condition_variable>
 
@@ -14,11 +15,14 @@
 /** @endcond */
 
 #include "reply.h"
+#include "request.h"
 #include "clipsstatus.h"
 
 class ClipsClient;
 typedef std::shared_ptr<ClipsClient> ClipsClientPtr;
 
+namespace shm{ struct Segment; }
+
 /**
  * Implements a tcp client that connects to clipsserver
  */
@@ -51,6 +55,25 @@ public:
 	 */
 	bool connect(const std::string& address, uint16_t port);
 
+	/**
+	 * Connects to ClipsServer through a local (AF_UNIX) socket.
+	 * Requires ClipsServer to run on the same host with the -u option.
+	 * @param  path    The path of ClipsServer's local socket
+	 * @return         true if a connection was established, false otherwise
+	 */
+	bool connectLocal(const std::string& path);
+
+	/**
+	 * Connects to ClipsServer through a local (AF_UNIX) socket and moves
+	 * all traffic to a pair of rings in shared memory (see shm.h).
+	 * The socket is kept open to detect disconnection.
+	 * @param  path     The path of ClipsServer's local socket
+	 * @param  ringSize Optional. The size in bytes of each ring,
+	 *                  rounded up to the next power of two. Default: 1MB
+	 * @return          true if the channel was established, false otherwise
+	 */
+	bool connectShm(const std::string& path, size_t ringSize = 1 << 20);
+
 	/**
 	 * Disconnects from ClipsServer
 	 */
@@ -72,6 +95,33 @@ public:
 	 */
 	void reset();
 
+	/**
+	 * Requests ClipsServer to start over with the rule base loaded at
+	 * startup, as if (clear), loading the startup file and (reset) were
+	 * executed. A server running an engine pool hands the client a
+	 * dedicated engine instead, which is instant.
+	 * @return true if the engine was replaced, false otherwise
+	 */
+	bool fresh();
+
+	/**
+	 * Requests the statistics of ClipsServer: latency histograms per
+	 * command, queue depth, message and rule rates, and engine counters
+	 * @param  report When this method returns contains the report,
+	 *                one item per line
+	 * @return        true if the report was received, false otherwise
+	 */
+	bool getStats(std::string& report);
+
+	/**
+	 * Subscribes to (or unsubscribes from) the statistics ClipsServer
+	 * pushes periodically. They are delivered to the handlers added
+	 * with addStatsReceivedHandler().
+	 * @param  subscribe true to subscribe, false to unsubscribe
+	 * @return           true if the request succeeded, false otherwise
+	 */
+	bool subscribeStats(bool subscribe = true);
+
 	/**
 	 * Requests ClipsServer to run clips, executing the (run n) command
 	 * @param n Maximum number fo rules to fire.
@@ -86,6 +136,18 @@ public:
 	 */
 	void assertFact(const std::string& fact);
 
+	/**
+	 * Requests ClipsServer to assert many facts with a single command,
+	 * which parses them all in one pass. Facts are asserted in order.
+	 * Facts after the first one with errors are not asserted.
+	 * @param  facts  The facts to assert, e.g. {"(a 1)", "(b 2)"}
+	 * @param  failed When this method returns contains the index of the
+	 *                first fact with errors, or -1 if there were none
+	 * @return        The number of facts asserted
+	 */
+	size_t assertFacts(const std::vector<std::string>& facts, int& failed);
+	size_t assertFacts(const std::vector<std::string>& facts);
+
 	/**
 	 * Requests ClipsServer to execute the (retract fact) command
 	 * @param fact The fact to retract
@@ -102,15 +164,20 @@ public:
 	 * Requests ClipsServer to execute a command.
 	 * A command is any of
 	 * 		assert   Asserts the fact given in args
+	 * 		assert-batch Asserts all the facts given in args
 	 * 		reset    Resets CLIPS
 	 * 		clear    Clears CLIPS KB
+	 * 		fresh    Starts over with the rule base loaded at startup
+	 * 		stats    Reports statistics. Takes reset, subscribe or unsubscribe.
 	 * 		raw      Injects the string in CLIPS language contained in args
 	 * 		path     Sets the working path of CLIPSServer
 	 * 		print    Prints the elements specified in args (any of {facts, rules, agenda})
 	 * 		watch    Toggles the watch set in args (any of {functions, globals, facts, rules})
 	 * 		load     Loads the CLP or DAT file specidied in args
 	 * 		run      Executes (run n) with the integer value given in args
-	 * 		log      Sets the log level of CLIPSServer
+	 * 		log      Sets the log level of CLIPSServer ([category] level)
+	 * 		stream   Performs the query given in args (see streamQuery())
+	 * 		cancel   Halts the command whose id is given in args (see cancel())
 	 *
 	 * @param  cmd  The command to execute
 	 * @param  args The command to execute
@@ -118,6 +185,28 @@ public:
 	 */
 	bool execute(const std::string& cmd, const std::string& args);
 
+	/**
+	 * Sends a command to ClipsServer without waiting for its response,
+	 * so many commands can be in flight at once (pipelining).
+	 * Commands are executed in the order they are sent.
+	 * Every successful call must be completed with endExecute().
+	 * @param  cmd   The command to execute (see execute())
+	 * @param  args  The arguments for the command
+	 * @param  cmdId When this method returns contains the ID of the command
+	 * @return       true if the command was sent, false otherwise
+	 */
+	bool beginExecute(const std::string& cmd, const std::string& args, uint32_t& cmdId);
+
+	/**
+	 * Waits for the response of a command sent with beginExecute()
+	 * @param  cmdId  The ID of the command
+	 * @param  result When this method returns contains the results produced
+	 *                by the command on the remote server
+	 * @return        true if the command was successfully executed, false otherwise
+	 */
+	bool endExecute(uint32_t cmdId, std::string& result);
+	bool endExecute(uint32_t cmdId);
+
 	/**
 	 * Requests ClipsServer to perform a query on the KB
 	 * @param  query  A string containing query to perform on CLIPS language
@@ -126,6 +215,32 @@ public:
 	 */
 	bool query(const std::string& query, std::string& result);
 
+	/**
+	 * Requests ClipsServer to perform a query on the KB, receiving the
+	 * output while the engine runs instead of all at once at the end
+	 * @param  query   A string containing query to perform on CLIPS language
+	 * @param  handler Receives the output yielded by CLIPS, in chunks, as
+	 *                 ClipsServer sends it. Called by the receiving thread.
+	 * @param  steps   When this method returns contains the number of
+	 *                 rules fired by the query
+	 * @return         true if the query was performed, false otherwise
+	 */
+	bool streamQuery(const std::string& query, std::function<void(const std::string&)> handler, int& steps);
+
+	/**
+	 * Requests ClipsServer to halt the run, query or stream command it
+	 * is executing for this client, once the rule being fired completes. The request is
+	 * served right away, even while the engine is busy.
+	 * @param  fired When this method returns contains the number of
+	 *               rules fired by the halted command
+	 * @param  cmdId Optional. The ID of the command to halt, as returned
+	 *               by beginExecute(). 0 halts whichever command of
+	 *               this client is running.
+	 *               Default: 0
+	 * @return       true if a command was halted, false otherwise
+	 */
+	bool cancel(int& fired, uint32_t cmdId = 0);
+
 	/**
 	 * Sends the given string to CLIPSServer
 	 * @param s The string to send
@@ -151,6 +266,13 @@ public:
 	 */
 	uint32_t toggleWatch(const std::string& watch);
 
+	/**
+	 * Gets the protocol version negotiated with CLIPSServer upon connection
+	 * @return The negotiated protocol version. 1 for servers without
+	 *         extended frames (messages limited to 64KB)
+	 */
+	uint32_t getProtocolVersion() const;
+
 public:
 	ClipsClientPtr getPtr();
 
@@ -158,12 +280,14 @@ public:
 	void addClipsStatusChangedHandler(std::function<void(const ClipsClientPtr&, const ClipsStatusPtr&)> handler);
 	void addConnectedHandler(std::function<void(const ClipsClientPtr&)> handler);
 	void addDisconnectedHandler(std::function<void(const ClipsClientPtr&)> handler);
+	void addStatsReceivedHandler(std::function<void(const ClipsClientPtr&, const std::string&)> handler);
 
 #if __GNUC__ > 10
 	void removeMessageReceivedHandler(std::function<void(const ClipsClientPtr&, const std::string&)> handler);
 	void removeClipsStatusChangedHandler(std::function<void(const ClipsClientPtr&, const ClipsStatusPtr&)> handler);
 	void removeConnectedHandler(std::function<void(const ClipsClientPtr&)> handler);
 	void removeDisconnectedHandler(std::function<void(const ClipsClientPtr&)> handler);
+	void removeStatsReceivedHandler(std::function<void(const ClipsClientPtr&, const std::string&)> handler);
 #endif
 
 protected:
@@ -187,6 +311,39 @@ protected:
 	 */
 	void asyncReadHandler(const boost::system::error_code& error, size_t bytes_transferred);
 
+	/**
+	 * Begins an asynchronous read of the remainder of a large message
+	 */
+	void beginReceiveLarge();
+
+	/**
+	 * Handles the completion of the read of a large message
+	 * @param error             Error code
+	 * @param bytes_transferred Number of bytes transferred
+	 */
+	void asyncReadLargeHandler(const boost::system::error_code& error, size_t bytes_transferred);
+
+	/**
+	 * Receives frames from the shared-memory channel until it is closed.
+	 * Body of the shared-memory reader thread.
+	 */
+	void shmReceive();
+
+	/**
+	 * Writes the given bytes to the shared-memory channel, waiting for
+	 * the server to make room when the ring is full
+	 * @param  data   The bytes to write
+	 * @param  length The number of bytes to write
+	 * @return        true if the bytes were written, false if the channel is closed
+	 */
+	bool shmSend(const char* data, size_t length);
+
+	/**
+	 * Processes a complete message received from CLIPSServer
+	 * @param s The received message
+	 */
+	void dispatchMessage(const std::string& s);
+
 	/**
 	 * Calls handles for received messages
 	 * @param handler The received message string
@@ -211,6 +368,12 @@ protected:
 	 */
 	void onClipsStatusChanged();
 
+	/**
+	 * Calls handles for pushed statistics
+	 * @param report The statistics report
+	 */
+	void onStatsReceived(const std::string& report);
+
 private:
 	/**
 	 * Sends the given command to ClipsServer
@@ -219,6 +382,12 @@ private:
 	 */
 	bool sendCommand(const std::string& command, const std::string& args, uint32_t& cmdId);
 
+	/**
+	 * Sends the given request to ClipsServer
+	 * @param rq The request to send
+	 */
+	bool sendRequest(const Request& rq);
+
 	/**
 	 * Awaits until a response arrives from the server
 	 * @param cmdId   The ID of the command that awaits for response
@@ -242,6 +411,58 @@ private:
 	bool rpc(const std::string& cmd);
 	bool rpc(const std::string& cmd, const std::string& args);
 
+	/**
+	 * Performs a RPC call on CLIPSServer to execute the given request and
+	 * synchronously awaits for the response to arrive
+	 * @param rq      The request to send
+	 * @param result  When this method returns contains the results produced
+	 *                by the rpc call on the remote server
+	 * @return        true if the RPC was successfully completed, false otherwise.
+	 */
+	bool rpc(const Request& rq, std::string& result);
+
+	/**
+	 * Validates the arguments of a command and executes it on CLIPSServer.
+	 * The command is sent in binary form when the server supports it,
+	 * as text otherwise.
+	 * @param opcode  The command to execute
+	 * @param args    The arguments for the command, as text
+	 * @param result  When this method returns contains the results produced
+	 *                by the rpc call on the remote server
+	 * @return        true if the command was successfully executed, false otherwise.
+	 */
+	bool command(protocol::Opcode opcode, const std::string& args, std::string& result);
+
+	/**
+	 * Validates and encodes a command into a request for CLIPSServer.
+	 * The command is encoded in binary form when the server supports it,
+	 * as text otherwise.
+	 * @param opcode  The command to encode
+	 * @param args    The arguments for the command, as text
+	 * @return        The request, or NULL if the arguments are not valid
+	 */
+	RequestPtr makeRequest(protocol::Opcode opcode, const std::string& args);
+
+	/**
+	 * Sends a request and registers it as pending, without waiting for
+	 * the response to arrive
+	 * @param rq The request to send
+	 * @return   true if the request was sent, false otherwise
+	 */
+	bool beginRpc(const Request& rq);
+
+	/**
+	 * Connects to ClipsServer at the given endpoint and starts receiving
+	 * @param  endpoint ClipsServer's TCP or local endpoint
+	 * @return          true if a connection was established, false otherwise
+	 */
+	bool connect(const boost::asio::generic::stream_protocol::endpoint& endpoint);
+
+	/**
+	 * Negotiates the protocol version with CLIPSServer
+	 */
+	void negotiateProtocol();
+
 	/**
 	 * Aborts all RPC request releasing all waiting locks. To be used during disconnection.
 	 */
@@ -282,7 +503,7 @@ private:
 	/**
 	 * Pointer to the socket object used to connect to the clips server
 	 */
-	std::shared_ptr<boost::asio::ip::tcp::socket> socketPtr;
+	std::shared_ptr<boost::asio::generic::stream_protocol::socket> socketPtr;
 
 	/**
 	 * Buffer to receive messages asynchronously
@@ -290,9 +511,46 @@ private:
 	boost::asio::streambuf buffer;
 
 	/**
-	 * Stream used to read the buffer
+	 * Large message being received straight from the socket
 	 */
-	std::istream is;
+	std::string rxLarge;
+
+	/**
+	 * Bytes of rxLarge received so far
+	 */
+	size_t rxLargeReceived;
+
+	/**
+	 * Shared-memory segment used instead of the socket, if any
+	 */
+	shm::Segment* shmSegment;
+
+	/**
+	 * Size of the mapping of shmSegment
+	 */
+	size_t shmSize;
+
+	/**
+	 * Size of each ring of shmSegment. Rings are accessed with this
+	 * size rather than the one in shared memory, which the server can write.
+	 */
+	size_t shmRingSize;
+
+	/**
+	 * Thread receiving frames from shmSegment
+	 */
+	std::shared_ptr<boost::thread> shmThreadPtr;
+
+	/**
+	 * Protocol version negotiated with CLIPSServer
+	 */
+	uint32_t serverProtocol;
+
+	/**
+	 * Serializes writes to the socket, so frames sent from
+	 * several threads are not interleaved
+	 */
+	std::mutex sendMutex;
 
 	/**
 	 * Protection lock for the pendingCommands map
@@ -310,6 +568,12 @@ private:
 	 */
 	std::map<uint32_t, ReplyPtr> pendingCommands;
 
+	/**
+	 * Stores the output handlers of stream commands awaiting for a response.
+	 * Protected by pcmutex.
+	 */
+	std::map<uint32_t, std::function<void(const std::string&)>> streamHandlers;
+
 	/**
 	 * Stores handler functions for message reception
 	 */
@@ -330,6 +594,11 @@ private:
 	 */
 	std::vector<std::function<void(const ClipsClientPtr&)>> disconnectedHandlers;
 
+	/**
+	 * Stores handler functions for pushed statistics
+	 */
+	std::vector<std::function<void(const ClipsClientPtr&, const std::string&)>> statsReceivedHandlers;
+
 	/**
 	 * Stores CLIPS status and active watches
 	 */
@@ -0,0 +1,274 @@
+/* ** *****************************************************************
+* protocol.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file protocol.h
+ * Wire format shared by clipsserver and its clients: framing,
+ * command ids, opcodes and the encoding of binary arguments.
+ */
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+#pragma once
+
+/** @cond */
+#include <string>
+#include <cstdint>
+#include <cstring>
+/** @endcond */
+
+/**
+ * Wire format shared by clipsserver and its clients.
+ *
+ * Every frame starts with a little-endian uint16 holding the frame size,
+ * header included. Since protocol 2, payloads that do not fit are sent
+ * in extended frames: a uint16 zero followed by a little-endian uint32
+ * holding the payload size. Extended frames are only sent to peers that
+ * negotiated protocol 2 with the proto command. The server advertises
+ * its version in a hello frame sent upon connection.
+ *
+ * Commands are sent as 0x00 + id + command [+ ' ' + args]. Since protocol 3
+ * commands may also be sent in binary form: 0x00 + id + opcode + args,
+ * where args are encoded according to the opcode (see Opcode). Opcodes
+ * are below 0x20, so they never clash with the name of a text command.
+ *
+ * Replies are sent as 0x00 + id + success (0x00 or 0x01) + result. The
+ * stream command sends its output before the reply, in frames whose
+ * success byte is PartialResult. The cancel command is served as soon
+ * as it is received, ahead of the commands queued before it, and is
+ * replied once the command it halts is over.
+ */
+namespace protocol{
+	/**
+	 * Version of the protocol implemented
+	 */
+	const uint32_t Version = 3;
+
+	/**
+	 * First protocol version supporting binary commands
+	 */
+	const uint32_t BinaryCommandsVersion = 3;
+
+	/**
+	 * Command id of the hello frame (0x00 + id + 0x01 + "proto:N")
+	 */
+	const uint32_t HelloCommandId = 0xfffffffe;
+
+	/**
+	 * Command id of status frames (0x00 + id + 0x01 + "watching:N|path:P")
+	 */
+	const uint32_t StatusCommandId = 0xffffffff;
+
+	/**
+	 * Command id of the stats frames pushed to subscribed clients
+	 * (0x00 + id + 0x01 + report, as the result of the stats command)
+	 */
+	const uint32_t StatsCommandId = 0xfffffffc;
+
+	/**
+	 * Success byte of the frames carrying part of the output of a
+	 * command that is still running (0x00 + id + 0x02 + output)
+	 */
+	const char PartialResult = 0x02;
+
+	/**
+	 * Size of the header of a standard frame
+	 */
+	const size_t HeaderSize = 2;
+
+	/**
+	 * Size of the header of an extended frame
+	 */
+	const size_t ExtendedHeaderSize = 6;
+
+	/**
+	 * Largest payload that fits in a standard frame
+	 */
+	const size_t MaxShortPayload = 0xffff - HeaderSize;
+
+	/**
+	 * Largest payload accepted in an extended frame
+	 */
+	const size_t MaxPayload = 0x10000000;
+
+	/**
+	 * Opcodes of binary commands and the encoding of their arguments
+	 */
+	enum class Opcode : uint8_t{
+		None = 0,
+		Assert,    ///< The fact to assert (text)
+		Reset,     ///< No arguments
+		Clear,     ///< No arguments
+		Query,     ///< The query (text)
+		Raw,       ///< The CLIPS code to inject (text)
+		Path,      ///< The working path (text)
+		Print,     ///< A PrintItem (1 byte)
+		Watch,     ///< A WatchItem (1 byte). No arguments queries the status.
+		Load,      ///< The file to load (text)
+		Run,       ///< The maximum number of rules to fire (int32 little-endian)
+		Log,       ///< The log level, optionally preceded by a category (text)
+		Fresh,     ///< No arguments
+		Stats,     ///< Empty, reset, subscribe or unsubscribe (text)
+		AssertBatch, ///< The facts to assert, one after the other (text)
+		Stream,    ///< The query (text). Replies with the number of rules fired.
+		Cancel,    ///< Optional id of the client's command to halt (uint32 little-endian).
+		           ///< Replies with the number of rules it fired.
+		Count
+	};
+
+	/**
+	 * Arguments of the print command
+	 */
+	enum class PrintItem : uint8_t{
+		None = 0, Facts, Rules, Agenda, Count
+	};
+
+	/**
+	 * Arguments of the watch command
+	 */
+	enum class WatchItem : uint8_t{
+		None = 0, Functions, Globals, Facts, Rules, Count
+	};
+
+	/**
+	 * Gets the text name of the given command
+	 * @param  opcode The opcode of the command
+	 * @return        The name of the command, or an empty string if the opcode is invalid
+	 */
+	inline const char* opcodeName(Opcode opcode){
+		static const char* names[] = {
+			"", "assert", "reset", "clear", "query", "raw", "path",
+			"print", "watch", "load", "run", "log", "fresh", "stats",
+			"assert-batch", "stream", "cancel"
+		};
+		return (opcode < Opcode::Count) ? names[(size_t)opcode] : "";
+	}
+
+	/**
+	 * Gets the text name of the given print argument
+	 * @param  item The item to print
+	 * @return      The name of the item, or an empty string if the item is invalid
+	 */
+	inline const char* printItemName(PrintItem item){
+		static const char* names[] = { "", "facts", "rules", "agenda" };
+		return (item < PrintItem::Count) ? names[(size_t)item] : "";
+	}
+
+	/**
+	 * Gets the text name of the given watch argument
+	 * @param  item The item to watch
+	 * @return      The name of the item, or an empty string if the item is invalid
+	 */
+	inline const char* watchItemName(WatchItem item){
+		static const char* names[] = { "", "functions", "globals", "facts", "rules" };
+		return (item < WatchItem::Count) ? names[(size_t)item] : "";
+	}
+
+	/**
+	 * Looks up a text name in the given names function
+	 * @param  name     The name to look for
+	 * @param  length   The length of the name
+	 * @param  nameOf   Function returning the name of each value
+	 * @return          The value whose name matches, or E::None
+	 */
+	template<class E>
+	inline E findByName(const char* name, size_t length, const char* (*nameOf)(E)){
+		for(size_t i = 1; i < (size_t)E::Count; ++i){
+			const char* candidate = nameOf( (E)i );
+			if( !std::strncmp(candidate, name, length) && !candidate[length] )
+				return (E)i;
+		}
+		return E::None;
+	}
+
+	/**
+	 * Gets the opcode of a text command
+	 * @param  name   The name of the command
+	 * @param  length The length of the name
+	 * @return        The opcode, or Opcode::None if the command is unknown
+	 */
+	inline Opcode findOpcode(const char* name, size_t length){
+		return findByName<Opcode>(name, length, opcodeName);
+	}
+
+	/**
+	 * Checks whether the command starting at the given byte is binary
+	 * @param  c The first byte after the command id
+	 * @return   true if c is an opcode, false if a text command starts there
+	 */
+	inline bool isOpcode(char c){
+		return (uint8_t)c < 0x20;
+	}
+
+	/**
+	 * Decodes a command received in text or binary form
+	 * @param  c      The command, right after the command id
+	 * @param  length The length of the command
+	 * @param  arg    When this function returns contains the arguments of the command
+	 * @param  binary When this function returns indicates whether the command is binary
+	 * @return        The opcode, or Opcode::None if the command is unknown
+	 */
+	inline Opcode decodeCommand(const char* c, size_t length, std::string& arg, bool& binary){
+		arg.clear();
+		binary = (length > 0) && isOpcode(c[0]);
+		if(length < 1) return Opcode::None;
+		if(binary){
+			// Received messages carry a trailing null character
+			if( (length > 1) && !c[length-1] ) --length;
+			arg.assign(c + 1, length - 1);
+			return ((Opcode)c[0] < Opcode::Count) ? (Opcode)c[0] : Opcode::None;
+		}
+		// Everything after the first null character is discarded
+		const char* end = (const char*)std::memchr(c, 0, length);
+		if(end) length = end - c;
+		const char* sp = (const char*)std::memchr(c, ' ', length);
+		if(!sp) return findOpcode(c, length);
+		arg.assign(sp + 1, length - (sp + 1 - c));
+		return findOpcode(c, sp - c);
+	}
+
+	/**
+	 * Decodes a command id given as the argument of a command
+	 * @param  arg    The argument, as returned by decodeCommand
+	 * @param  binary Whether the command is binary
+	 * @param  cmdId  When this function returns contains the command id
+	 * @return        true if the argument holds a command id, false otherwise
+	 */
+	inline bool decodeCommandId(const std::string& arg, bool binary, uint32_t& cmdId){
+		if(binary){
+			if(arg.length() != sizeof(cmdId)) return false;
+			std::memcpy(&cmdId, arg.data(), sizeof(cmdId));
+			return true;
+		}
+		if( arg.empty() || (arg.length() > 10) ) return false;
+		uint64_t n = 0;
+		for(char c : arg){
+			if( (c < '0') || (c > '9') ) return false;
+			n = 10*n + (c - '0');
+		}
+		cmdId = n;
+		return n <= 0xffffffff;
+	}
+
+	/**
+	 * Builds the header of a frame for a payload of the given size
+	 * @param  length The size of the payload
+	 * @return        A standard header if the payload fits, an extended one otherwise.
+	 *                An empty string if the payload exceeds MaxPayload: such
+	 *                frames can't be sent.
+	 */
+	inline std::string makeHeader(size_t length){
+		if(length <= MaxShortPayload){
+			uint16_t size = HeaderSize + length;
+			return std::string((const char*)&size, HeaderSize);
+		}
+		if(length > MaxPayload) return std::string();
+		uint32_t size = length;
+		std::string header(HeaderSize, 0);
+		header.append((const char*)&size, sizeof(size));
+		return header;
+	}
+}
+
+#endif // __PROTOCOL_H__
@@ -3,6 +3,7 @@
 #pragma once
 
 /** @cond */
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -10,12 +11,15 @@
 #include <boost/asio.hpp>
 /** @endcond */
 
+#include "protocol.h"
+
 class Request;
 typedef std::shared_ptr<Request> RequestPtr;
 
 class Request{
 public:
 	Request(const std::string& command, const std::string& args="");
+	Request(protocol::Opcode opcode, const std::string& args="");
 
 private:
 	Request();
@@ -31,15 +35,17 @@ public:
 
 private:
 	uint32_t cmdId;
+	protocol::Opcode opcode;
 	std::string cmd;
 	std::string args;
 
 private:
-	static uint32_t lastCommandId;
+	static std::atomic<uint32_t> lastCommandId;
 
 public:
 	static RequestPtr fromMessage(const std::string& message);
 	static RequestPtr make_shared(const std::string& command, const std::string& args="");
+	static RequestPtr make_shared(protocol::Opcode opcode, const std::string& args="");
 
 public:
 	static const uint32_t CommandIdNone = -1;
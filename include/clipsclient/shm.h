@@ -0,0 +1,359 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+#pragma once
+
+/** @cond */
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <ctime>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+/** @endcond */
+
+/**
+ * Shared-memory transport between clipsserver and clients on the same host.
+ *
+ * The client creates a POSIX shared-memory object holding a Segment:
+ * two single-producer/single-consumer byte rings (one per direction)
+ * followed by their data. It then sends the shm command with the name
+ * of the object through a local socket, and from then on frames are
+ * exchanged through the rings instead. Frames are encoded exactly as on
+ * the socket (see protocol.h), so the server parses them unchanged.
+ * Each side parks on its own futex-backed Event when there is nothing
+ * to do, and the other side wakes it only when it is parked.
+ * The socket stays open: when either side closes it, the channel is closed.
+ */
+namespace shm{
+	/**
+	 * Identifies an initialized segment
+	 */
+	const uint32_t Magic = 0x53504c43; // "CLPS"
+
+	/**
+	 * Version of the segment layout
+	 */
+	const uint32_t Version = 1;
+
+	/**
+	 * Default size of each ring
+	 */
+	const size_t DefaultRingSize = 1 << 20;
+
+	/**
+	 * Names of shared-memory objects start with this prefix
+	 */
+	const char NamePrefix[] = "/clipsclient.";
+
+	/**
+	 * Number of polls before parking on an Event. Used only on
+	 * multi-core hosts, where the other side runs concurrently.
+	 */
+	const unsigned SpinCount = 2000;
+
+	/**
+	 * Eventcount living in shared memory.
+	 * A waiter reads the sequence with prepare(), checks its condition,
+	 * and calls wait() with the sequence read if it does not hold.
+	 * Any signal() after prepare() makes wait() return.
+	 */
+	struct Event{
+		/**
+		 * Incremented by every signal
+		 */
+		std::atomic<uint32_t> seq;
+		/**
+		 * Number of parked waiters
+		 */
+		std::atomic<uint32_t> waiters;
+
+		/**
+		 * Reads the current sequence. Must be called before checking the condition.
+		 * @return The sequence to pass to wait()
+		 */
+		uint32_t prepare() const{
+			return seq.load(std::memory_order_acquire);
+		}
+
+		/**
+		 * Waits until the event is signaled after prepare() or the timeout expires
+		 * @param observed  The value returned by prepare()
+		 * @param timeoutMs The maximum time to wait in milliseconds
+		 */
+		void wait(uint32_t observed, long timeoutMs){
+			static const unsigned spins = (std::thread::hardware_concurrency() > 1) ? SpinCount : 0;
+			for(unsigned i = 0; i < spins; ++i)
+				if(seq.load(std::memory_order_acquire) != observed) return;
+
+			timespec ts;
+			ts.tv_sec = timeoutMs / 1000;
+			ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+			waiters.fetch_add(1, std::memory_order_seq_cst);
+			if(seq.load(std::memory_order_seq_cst) == observed)
+				syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAIT, observed, &ts, NULL, 0);
+			waiters.fetch_sub(1, std::memory_order_seq_cst);
+		}
+
+		/**
+		 * Wakes up all waiters. The futex is touched only when someone is parked.
+		 */
+		void signal(){
+			seq.fetch_add(1, std::memory_order_seq_cst);
+			if(waiters.load(std::memory_order_seq_cst) > 0)
+				syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		}
+	};
+
+	/**
+	 * Single-producer/single-consumer byte ring living in shared memory.
+	 * Positions grow monotonically and are wrapped when indexing the data.
+	 * The ring is accessed through a RingView, never directly, since the
+	 * other side can write any of its fields at any time.
+	 */
+	struct Ring{
+		/**
+		 * Next position to write. Modified only by the producer.
+		 */
+		alignas(64) std::atomic<uint64_t> head;
+		/**
+		 * Next position to read. Modified only by the consumer.
+		 */
+		alignas(64) std::atomic<uint64_t> tail;
+		/**
+		 * Size of the data (a power of two)
+		 */
+		uint64_t capacity;
+		/**
+		 * Offset of the data relative to this ring
+		 */
+		uint64_t offset;
+	};
+
+	/**
+	 * Access to a Ring with its capacity and data location held in
+	 * private memory. They are set when the segment is created or
+	 * validated and never read from shared memory again: positions are
+	 * wrapped with the private capacity and lengths clamped to it, so
+	 * every copy stays within the data whatever the other side writes.
+	 */
+	class RingView{
+	public:
+		RingView() : ring(NULL), data(NULL), capacity(0){}
+
+		/**
+		 * Initializes a new instance of RingView
+		 * @param ring     The ring
+		 * @param data     The data of the ring
+		 * @param capacity The size of the data (a power of two)
+		 */
+		RingView(Ring& ring, char* data, uint64_t capacity) :
+			ring(&ring), data(data), capacity(capacity){}
+
+		/**
+		 * Gets the number of bytes the producer can write.
+		 * Clamped to the capacity, since the other side may be faulty.
+		 */
+		size_t writable() const{
+			uint64_t used = ring->head.load(std::memory_order_relaxed) - ring->tail.load(std::memory_order_acquire);
+			return (used < capacity) ? capacity - used : 0;
+		}
+
+		/**
+		 * Gets the number of bytes the consumer can read.
+		 * Clamped to the capacity, since the other side may be faulty.
+		 */
+		size_t readable() const{
+			uint64_t used = ring->head.load(std::memory_order_acquire) - ring->tail.load(std::memory_order_relaxed);
+			return std::min(used, capacity);
+		}
+
+		/**
+		 * Writes as many bytes as fit and publishes them
+		 * @remark Producer only
+		 * @param  src    The bytes to write
+		 * @param  length The number of bytes to write
+		 * @return        The number of bytes written
+		 */
+		size_t write(const char* src, size_t length){
+			uint64_t pos = ring->head.load(std::memory_order_relaxed);
+			length = std::min(length, writable());
+			copyIn(pos & (capacity - 1), src, length);
+			ring->head.store(pos + length, std::memory_order_release);
+			return length;
+		}
+
+		/**
+		 * Copies readable bytes without consuming them
+		 * @remark Consumer only
+		 * @param  dst    Where the bytes are copied
+		 * @param  length The maximum number of bytes to copy
+		 * @return        The number of bytes copied
+		 */
+		size_t peek(char* dst, size_t length) const{
+			uint64_t pos = ring->tail.load(std::memory_order_relaxed);
+			length = std::min(length, readable());
+			copyOut(pos & (capacity - 1), dst, length);
+			return length;
+		}
+
+		/**
+		 * Releases bytes to the producer
+		 * @remark Consumer only
+		 * @param  length The number of bytes to release. At most readable().
+		 */
+		void consume(size_t length){
+			ring->tail.store(ring->tail.load(std::memory_order_relaxed) + length, std::memory_order_release);
+		}
+
+		/**
+		 * Copies and consumes readable bytes
+		 * @remark Consumer only
+		 * @param  dst    Where the bytes are copied
+		 * @param  length The maximum number of bytes to read
+		 * @return        The number of bytes read
+		 */
+		size_t read(char* dst, size_t length){
+			length = peek(dst, length);
+			consume(length);
+			return length;
+		}
+
+	private:
+		/**
+		 * Copies a buffer into the data at the given index, wrapping around its end
+		 */
+		void copyIn(size_t index, const char* src, size_t length){
+			size_t first = std::min<size_t>(length, capacity - index);
+			std::memcpy(data + index, src, first);
+			std::memcpy(data, src + first, length - first);
+		}
+
+		/**
+		 * Copies the data at the given index into a buffer, wrapping around its end
+		 */
+		void copyOut(size_t index, char* dst, size_t length) const{
+			size_t first = std::min<size_t>(length, capacity - index);
+			std::memcpy(dst, data + index, first);
+			std::memcpy(dst + first, data, length - first);
+		}
+
+		/**
+		 * The ring, in shared memory
+		 */
+		Ring* ring;
+
+		/**
+		 * The data of the ring
+		 */
+		char* data;
+
+		/**
+		 * Size of the data
+		 */
+		uint64_t capacity;
+	};
+
+	/**
+	 * Header of the shared-memory object. The data of both rings follows it.
+	 */
+	struct Segment{
+		uint32_t magic;
+		uint32_t version;
+		/**
+		 * Size of each ring
+		 */
+		uint64_t ringSize;
+		/**
+		 * Set by either side to close the channel
+		 */
+		std::atomic<uint32_t> closed;
+		/**
+		 * Signaled by the client when it writes to toServer or reads from toClient
+		 */
+		alignas(64) Event serverEvent;
+		/**
+		 * Signaled by the server when it writes to toClient or reads from toServer
+		 */
+		alignas(64) Event clientEvent;
+		/**
+		 * Frames sent by the client
+		 */
+		Ring toServer;
+		/**
+		 * Frames sent by the server
+		 */
+		Ring toClient;
+
+		/**
+		 * Gets the size of the shared-memory object for the given ring size
+		 * @param  ringSize The size of each ring. Must be a power of two.
+		 * @return          The size of the object
+		 */
+		static size_t size(size_t ringSize){
+			return headerSize() + 2 * ringSize;
+		}
+
+		/**
+		 * Initializes a zero-filled segment
+		 * @param ringSize The size of each ring. Must be a power of two.
+		 */
+		void init(size_t ringSize){
+			this->ringSize = ringSize;
+			toServer.capacity = toClient.capacity = ringSize;
+			toServer.offset = dataOffset(toServer, 0);
+			toClient.offset = dataOffset(toClient, ringSize);
+			version = Version;
+			std::atomic_thread_fence(std::memory_order_release);
+			magic = Magic;
+		}
+
+		/**
+		 * Checks whether a mapped segment was initialized and fits in the mapping
+		 * @param  mappedSize The size of the mapping
+		 * @param  ringSize   A copy of the ring size read from the segment.
+		 *                    Only this copy is checked against the mapping.
+		 * @return            true if the segment is valid, false otherwise
+		 */
+		bool valid(size_t mappedSize, uint64_t ringSize) const{
+			return (mappedSize >= sizeof(Segment)) && (magic == Magic) && (version == Version) &&
+				ringSize && !(ringSize & (ringSize - 1)) && (mappedSize >= size(ringSize)) &&
+				(toServer.capacity == ringSize) && (toServer.offset == dataOffset(toServer, 0)) &&
+				(toClient.capacity == ringSize) && (toClient.offset == dataOffset(toClient, ringSize));
+		}
+
+		/**
+		 * Gets a view of the toServer ring. Its data is located from the
+		 * layout rather than from the offset stored in the ring.
+		 * @param  ringSize The size of each ring, as passed to init() or valid()
+		 * @return          The view
+		 */
+		RingView serverRing(uint64_t ringSize){
+			return RingView(toServer, reinterpret_cast<char*>(this) + headerSize(), ringSize);
+		}
+
+		/**
+		 * Gets a view of the toClient ring (see serverRing)
+		 * @param  ringSize The size of each ring, as passed to init() or valid()
+		 * @return          The view
+		 */
+		RingView clientRing(uint64_t ringSize){
+			return RingView(toClient, reinterpret_cast<char*>(this) + headerSize() + ringSize, ringSize);
+		}
+
+	private:
+		uint64_t dataOffset(const Ring& ring, size_t skip) const{
+			return headerSize() + skip - (reinterpret_cast<const char*>(&ring) - reinterpret_cast<const char*>(this));
+		}
+
+		static size_t headerSize(){
+			return (sizeof(Segment) + 63) & ~size_t(63);
+		}
+	};
+}
+
+#endif // __SHM_H__
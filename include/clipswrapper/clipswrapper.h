@@ -20,6 +20,7 @@
 #pragma once
 
 /** @cond */
+#include <chrono>
 #include <cstdio>
 #include <string>
 #include <vector>
@@ -29,6 +30,7 @@
 /** @endcond */
 
 #include "queryrouter.h"
+#include "factbuilder.h"
 
 
 
@@ -206,6 +208,35 @@ bool load(std::string const& fpath);
  */
 int run(int maxRules = -1);
 
+/**
+ * Allows rules to execute for a bounded time.
+ * Fires rules until the agenda is empty, maxRules rules are fired or
+ * the budget is over. The budget is checked every few rules fired, so
+ * rules are never interrupted. The agenda is kept: a later run resumes
+ * where this one stopped.
+ * @param  maxRules An integer indicating how many rules should fire
+ *                  before returning. A negative value sets no limit.
+ * @param  budget   The wall-clock time the run may take
+ * @param  expired  When this function returns indicates whether the
+ *                  run stopped because the budget was over
+ * @return          Returns the number of rules that were fired.
+ */
+int run(int maxRules, std::chrono::microseconds budget, bool& expired);
+
+/**
+ * Asks the engine to stop firing rules. The rule being fired, if any,
+ * completes its actions: run() returns before firing the next one.
+ * The request holds, so later runs return right away, until it is
+ * withdrawn with clearHalt().
+ * @remark Unlike the rest of the wrapper, it may be called from any thread.
+ */
+void requestHalt();
+
+/**
+ * Withdraws the request made with requestHalt()
+ */
+void clearHalt();
+
 /**
  * Prints the list of all facts currently in the fact-list.
  * It is the C equivalent of the CLIPS facts command.
@@ -286,6 +317,19 @@ void printAgenda(
  */
 void assertString(const std::string& s);
 
+/**
+ * Asserts a sequence of facts, e.g. "(a 1) (b 2) (c 3)", with a single
+ * pass of the CLIPS parser over the whole string.
+ * Facts are asserted as they are parsed. Parsing stops at the first
+ * fact with a syntax error, so the facts after it are not asserted.
+ * @param  facts  The facts, written as for assertString()
+ * @param  failed When this function returns contains the index (from 0)
+ *                of the first fact that could not be parsed, or -1
+ * @return        The number of facts asserted. Duplicates of facts
+ *                already in the fact-list are not counted.
+ */
+size_t assertBatch(const std::string& facts, int& failed);
+
 /**
  * Queries all active routers until it finds a router that recognizes
  * the logical name associated with this I/O request to print a string.
@@ -404,6 +448,35 @@ bool getFactListChanged();
 void setFactListChanged(bool changed);
 
 
+/**
+ * Gets the number of facts in the fact-list
+ * @remark Wrapper for GetNumberOfFacts
+ * @return The number of facts
+ */
+long getNumberOfFacts();
+
+/**
+ * Gets the number of activations in the agenda
+ * @remark Wrapper for GetNumberOfActivations
+ * @return The number of activations
+ */
+long getNumberOfActivations();
+
+/**
+ * Gets the amount of memory CLIPS has allocated
+ * @remark Wrapper for MemUsed
+ * @return The number of bytes in use
+ */
+long memUsed();
+
+/**
+ * Gets the number of memory requests CLIPS has made
+ * @remark Wrapper for MemRequests
+ * @return The number of outstanding memory requests
+ */
+long memRequests();
+
+
 
 /* ** ***************************************************************
 *
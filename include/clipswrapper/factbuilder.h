@@ -0,0 +1,131 @@
+/* ** *****************************************************************
+* factbuilder.h
+*
+* Author: Mauricio Matamoros
+*
+* ** *****************************************************************/
+/** @file factbuilder.h
+ * Definition of the FactBuilder class: builds ordered facts field by
+ * field and asserts them without going through the CLIPS parser.
+ */
+#ifndef __FACTBUILDER_H__
+#define __FACTBUILDER_H__
+#pragma once
+
+/** @cond */
+#include <string>
+#include <vector>
+/** @endcond */
+
+namespace clips{
+
+/**
+ * Builds an ordered fact (a relation followed by fields) and asserts it
+ * with CreateFact, PutFactSlot and Assert. The result is the same fact
+ * assertString() would assert for "(relation fields...)", without the
+ * cost of the string router, the scanner and the expression evaluator.
+ * A builder can be cleared and reused to assert many facts.
+ * @remark Facts of deftemplates with slots are not supported: they
+ *         must be asserted with assertString().
+ */
+class FactBuilder{
+public:
+	/**
+	 * Initializes a new instance of FactBuilder
+	 * @param relation The relation name (first field) of the fact
+	 */
+	FactBuilder(const std::string& relation);
+
+public:
+	/**
+	 * Appends an integer field
+	 * @param  value The integer
+	 * @return       This builder
+	 */
+	FactBuilder& append(long value);
+
+	/**
+	 * Appends a float field
+	 * @param  value The float
+	 * @return       This builder
+	 */
+	FactBuilder& append(double value);
+
+	/**
+	 * Appends the fields written in text, as assertString() would read
+	 * them: whitespace separated symbols, numbers and quoted strings.
+	 * Text is read up to its first null character.
+	 * @param  text The fields
+	 * @return      true if the text was appended. false if the text has
+	 *              anything other than constants (variables, function
+	 *              calls, parentheses, comments, instance names or bad
+	 *              characters), in which case nothing is appended and the
+	 *              fact must be asserted with assertString() instead.
+	 */
+	bool append(const std::string& text);
+
+	/**
+	 * Asserts the fact built so far
+	 * @return true if the fact was passed to the engine (which may still
+	 *         drop it as a duplicate). false if the relation cannot be
+	 *         asserted as an ordered fact (it names a deftemplate with
+	 *         slots or a reserved symbol), in which case nothing is done.
+	 */
+	bool assertFact();
+
+	/**
+	 * Removes all fields, keeping the relation, so the builder can
+	 * build another fact
+	 */
+	void clear();
+
+	/**
+	 * Gets the relation name of the fact
+	 */
+	const std::string& getRelation() const;
+
+	/**
+	 * Gets the number of fields appended after the relation
+	 */
+	size_t size() const;
+
+private:
+	/**
+	 * Type of a field
+	 */
+	enum class FieldType{ Symbol, String, Integer, Float };
+
+	/**
+	 * A field of the fact. Values are hashed into CLIPS when the fact is
+	 * asserted, so the engine may run between appends.
+	 */
+	struct Field{
+		FieldType type;
+		std::string text;
+		long integer;
+		double real;
+	};
+
+	/**
+	 * Appends a field, reusing the storage of cleared fields
+	 * @return The field
+	 */
+	Field& next(FieldType type);
+
+	/**
+	 * Reads a token of text as the CLIPS scanner would
+	 * @param  text  The text
+	 * @param  pos   The position of the token, moved past it
+	 * @return       true if the token is a constant, false otherwise
+	 */
+	bool appendToken(const char* text, size_t& pos);
+
+private:
+	std::string relation;
+	std::vector<Field> fields;
+	size_t count;
+};
+
+} // end namespace clips
+
+#endif // __FACTBUILDER_H__
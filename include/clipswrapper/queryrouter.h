@@ -13,12 +13,20 @@
 #pragma once
 
 #include <set>
+#include <chrono>
 #include <string>
+#include <functional>
 #include "clipswrapper.h"
 
 namespace clips{
 
 class QueryRouter{
+public:
+	/**
+	 * Receives the output captured while streaming
+	 */
+	typedef std::function<void(const std::string&)> OutputHandler;
+
 // Singleton element access
 public:
 	/**
@@ -99,6 +107,29 @@ public:
 	 */
 	void write(const std::string& s);
 
+	/**
+	 * Passes captured output to handler as it is produced instead of
+	 * keeping it until read(). Output is passed in chunks of at most
+	 * chunkSize bytes, as soon as chunkSize bytes are captured or the
+	 * oldest byte has waited latency, which is checked on every write and
+	 * after every rule fired.
+	 * @param handler   The handler. An empty handler stops streaming.
+	 * @param chunkSize The size of a full chunk
+	 * @param latency   The longest time output waits in the buffer
+	 */
+	void stream(const OutputHandler& handler, size_t chunkSize, std::chrono::milliseconds latency);
+
+	/**
+	 * Passes the output in the buffer to the streaming handler, if any
+	 */
+	void flush();
+
+	/**
+	 * Passes the output in the buffer to the streaming handler if its
+	 * oldest byte has waited longer than the latency
+	 */
+	void flushIfDue();
+
 private:
 	/**
 	 * Registers the router with CLIPS
@@ -116,6 +147,13 @@ private:
 	bool enabled;
 	std::set<std::string> logicalNames;
 	std::string buffer;
+	OutputHandler handler;
+	size_t chunkSize;
+	std::chrono::milliseconds latency;
+	/**
+	 * Time when the output in the buffer is due (streaming only)
+	 */
+	std::chrono::steady_clock::time_point deadline;
 };
 
 } // end namespace clips
@@ -0,0 +1,448 @@
+/** @file main.cpp
+* @author Mauricio Matamoros
+*
+* Anchor point (main function) for clipsload, a load generator for
+* clipsserver. Opens a number of connections and sends a mix of
+* assert, run and query commands and plain network facts at a fixed
+* target rate (open loop), then reports the throughput achieved and the
+* latency percentiles of every operation as text and, optionally, JSON.
+*
+* Latencies are measured from the time each operation was scheduled,
+* not from the time it was actually sent, so a server that falls behind
+* is charged for the time operations spend waiting to be sent.
+*
+*/
+
+/** @cond */
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+/** @endcond */
+
+#include "clipsclient/clipsclient.h"
+
+/* ** ********************************************************
+* Typedefs
+* *** *******************************************************/
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Operations sent to the server
+ */
+enum Operation{
+	OpAssert = 0,
+	OpRun,
+	OpQuery,
+	OpFact,
+	OpCount
+};
+
+/**
+ * Names of the operations, as given in the mix
+ */
+const char* opNames[OpCount] = { "assert", "run", "query", "fact" };
+
+/**
+ * A command waiting for its response
+ */
+struct InFlight{
+	uint32_t cmdId;
+	Operation op;
+	Clock::time_point scheduled;
+};
+
+/**
+ * The state of a connection
+ */
+struct Connection{
+	std::shared_ptr<ClipsClient> client;
+	std::thread sender;
+	std::thread collector;
+	/**
+	 * Commands sent, oldest first
+	 */
+	std::deque<InFlight> inFlight;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool done = false;
+	/**
+	 * Operations sent, by operation
+	 */
+	size_t sent[OpCount] = {};
+	/**
+	 * Commands that failed or were not answered, by operation
+	 */
+	size_t failed[OpCount] = {};
+	/**
+	 * Latencies in microseconds, by operation.
+	 * Facts have no response: their latency is the time to send them.
+	 */
+	std::vector<double> latencies[OpCount];
+};
+
+
+/* ** ********************************************************
+* Global variables
+* *** *******************************************************/
+/**
+ * Server address
+ */
+std::string address = "127.0.0.1";
+
+/**
+ * Server port
+ */
+uint16_t port = 5000;
+
+/**
+ * Path of the server's local socket. When set, it is used instead of TCP.
+ */
+std::string localPath;
+
+/**
+ * When set, traffic goes through shared memory set up over localPath
+ */
+bool useShm = false;
+
+/**
+ * Number of connections
+ */
+size_t connections = 4;
+
+/**
+ * Target rate in operations per second, over all connections
+ */
+double rate = 1000;
+
+/**
+ * Length of the run in seconds
+ */
+double duration = 10;
+
+/**
+ * Relative weight of each operation
+ */
+unsigned mix[OpCount] = { 40, 10, 10, 40 };
+
+/**
+ * Path of the JSON report. Empty disables it. - writes it to stdout.
+ */
+std::string jsonPath;
+
+/**
+ * When set, the rule base is not cleared and the load rule is not defined
+ */
+bool skipSetup = false;
+
+
+/* ** ********************************************************
+* Prototypes
+* *** *******************************************************/
+int main(int argc, char **argv);
+bool parseArgs(int argc, char **argv);
+bool parseMix(const char* s);
+bool connectClient(const std::shared_ptr<ClipsClient>& client);
+void generate(Connection& c, size_t index, Clock::time_point start, Clock::time_point end);
+void collect(Connection& c);
+void report(std::vector<Connection>& conns, double elapsed);
+static inline double elapsed_us(const Clock::time_point& start);
+static inline double percentile(const std::vector<double>& sorted, double p);
+
+
+/* ** ********************************************************
+* Main (program anchor)
+* *** *******************************************************/
+/**
+ * Program anchor
+ * @param  argc The number of arguments to the program
+ * @param  argv The arguments passed to the program
+ * @return      The program exit code
+ */
+int main(int argc, char **argv){
+	if( !parseArgs(argc, argv) ) return -1;
+
+	std::vector<Connection> conns(connections);
+	for(Connection& c : conns){
+		c.client = ClipsClient::create();
+		if( !connectClient(c.client) ){
+			if( localPath.empty() ) fprintf(stderr, "Could not connect to CLIPS on %s:%u.\n", address.c_str(), port);
+			else fprintf(stderr, "Could not connect to CLIPS on %s.\n", localPath.c_str());
+			fprintf(stderr, "Run the server and pass the right parameters.\n");
+			return -1;
+		}
+	}
+
+	// Asserted facts are consumed by run, so the fact base does not grow
+	if(!skipSetup){
+		conns[0].client->clear();
+		conns[0].client->execute("raw", "(defrule clipsload-consume ?f <- (clipsload ?c ?n) => (retract ?f))");
+		conns[0].client->reset();
+	}
+
+	printf("Sending %.0f ops/s over %lu connections for %.1fs (mix", rate, connections, duration);
+	for(size_t op = 0; op < OpCount; ++op)
+		printf(" %s=%u", opNames[op], mix[op]);
+	printf(")...\n");
+
+	Clock::time_point start = Clock::now() + std::chrono::milliseconds(10);
+	Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(duration));
+	for(size_t i = 0; i < conns.size(); ++i){
+		Connection& c = conns[i];
+		c.collector = std::thread(collect, std::ref(c));
+		c.sender = std::thread(generate, std::ref(c), i, start, end);
+	}
+	for(Connection& c : conns){
+		c.sender.join();
+		c.collector.join();
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	report(conns, elapsed);
+	for(Connection& c : conns)
+		c.client->disconnect();
+	return 0;
+}
+
+
+/* ** ********************************************************
+* Function definitions
+* *** *******************************************************/
+bool parseArgs(int argc, char **argv){
+	for(int i = 1; i < argc; ++i){
+		if (!strcmp(argv[i],"-k")){ skipSetup = true; continue; }
+		if (!strcmp(argv[i], "-h") || (i+1 >= argc) ){
+			printf("Usage: %s [-a address] [-p port] [-u unix_socket_path] [-m unix_socket_path] "
+				"[-c connections] [-r ops_per_second] [-d seconds] [-x mix] [-j json_file] [-k]\n", argv[0]);
+			printf("    -x  Weights of the operations, e.g. assert=40,run=10,query=10,fact=40\n");
+			printf("    -j  Writes a JSON report to the file (- for stdout)\n");
+			printf("    -k  Keeps the rule base (no clear and no load rule)\n");
+			return false;
+		}
+		else if (!strcmp(argv[i],"-a")) address     = argv[++i];
+		else if (!strcmp(argv[i],"-p")) port        = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i],"-u")) localPath   = argv[++i];
+		else if (!strcmp(argv[i],"-m")){localPath   = argv[++i]; useShm = true;}
+		else if (!strcmp(argv[i],"-c")) connections = std::stoul(argv[++i]);
+		else if (!strcmp(argv[i],"-r")) rate        = std::stod(argv[++i]);
+		else if (!strcmp(argv[i],"-d")) duration    = std::stod(argv[++i]);
+		else if (!strcmp(argv[i],"-j")) jsonPath    = argv[++i];
+		else if (!strcmp(argv[i],"-x")){
+			if( !parseMix(argv[++i]) ){
+				fprintf(stderr, "Invalid mix '%s'\n", argv[i]);
+				return false;
+			}
+		}
+	}
+	return (connections > 0) && (rate > 0) && (duration > 0);
+}
+
+
+/**
+ * Parses a mix of operations given as name=weight pairs separated by
+ * commas. Operations not given get a zero weight.
+ * @param  s The mix
+ * @return   true if the mix is valid, false otherwise
+ */
+bool parseMix(const char* s){
+	unsigned weights[OpCount] = {};
+	unsigned total = 0;
+	std::string item;
+	std::string str(s);
+	size_t pos = 0;
+	while(pos <= str.length()){
+		size_t comma = str.find(',', pos);
+		if(comma == std::string::npos) comma = str.length();
+		item = str.substr(pos, comma - pos);
+		pos = comma + 1;
+		size_t eq = item.find('=');
+		if(eq == std::string::npos) return false;
+		size_t op = 0;
+		while( (op < OpCount) && item.compare(0, eq, opNames[op]) ) ++op;
+		if(op >= OpCount) return false;
+		try{ weights[op] = std::stoul(item.substr(eq + 1)); }
+		catch(...){ return false; }
+		total+= weights[op];
+	}
+	if(total < 1) return false;
+	std::copy(weights, weights + OpCount, mix);
+	return true;
+}
+
+
+/**
+ * Connects a client to the server as given in the arguments
+ * @param  client The client
+ * @return        true if the client is connected, false otherwise
+ */
+bool connectClient(const std::shared_ptr<ClipsClient>& client){
+	if( localPath.empty() ) return client->connect(address, port);
+	if(useShm) return client->connectShm(localPath);
+	return client->connectLocal(localPath);
+}
+
+
+/**
+ * Sends operations through a connection at its share of the target rate
+ * until the end of the run
+ * @param c     The connection
+ * @param index The index of the connection
+ * @param start The time the run starts
+ * @param end   The time the run ends
+ */
+void generate(Connection& c, size_t index, Clock::time_point start, Clock::time_point end){
+	// Connections are staggered so they do not send in bursts
+	Clock::duration interval = std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(connections / rate) );
+	Clock::time_point scheduled = start + interval * index / connections;
+
+	std::mt19937 rng(index);
+	std::discrete_distribution<int> pick(mix, mix + OpCount);
+	for(size_t n = 0; scheduled < end; ++n, scheduled+= interval){
+		std::this_thread::sleep_until(scheduled);
+		Operation op = (Operation)pick(rng);
+		std::string fact = "clipsload " + std::to_string(index) + " " + std::to_string(n);
+		InFlight f = { 0, op, scheduled };
+		bool sent = true;
+		switch(op){
+			case OpAssert: sent = c.client->beginExecute("assert", "(" + fact + ")", f.cmdId); break;
+			case OpRun:    sent = c.client->beginExecute("run", "-1", f.cmdId); break;
+			case OpQuery:  sent = c.client->beginExecute("query", "(printout t ok crlf)", f.cmdId); break;
+			default:{
+				// Plain messages are framed here: send() writes them as given
+				std::string frame(2, 0);
+				uint16_t size = fact.length() + 2;
+				std::memcpy(&frame[0], &size, sizeof(size));
+				frame+= fact;
+				sent = c.client->send(frame);
+				c.latencies[op].push_back( elapsed_us(scheduled) );
+			}
+		}
+		++c.sent[op];
+		if(!sent){
+			++c.failed[op];
+			continue;
+		}
+		if(op == OpFact) continue;
+		std::lock_guard<std::mutex> lock(c.mutex);
+		c.inFlight.push_back(f);
+		c.cv.notify_one();
+	}
+
+	std::lock_guard<std::mutex> lock(c.mutex);
+	c.done = true;
+	c.cv.notify_one();
+}
+
+
+/**
+ * Waits for the responses of the commands sent through a connection,
+ * in order, until the sender is done
+ * @param c The connection
+ */
+void collect(Connection& c){
+	for(;;){
+		InFlight f;
+		{
+			std::unique_lock<std::mutex> lock(c.mutex);
+			c.cv.wait(lock, [&c](){ return c.done || !c.inFlight.empty(); });
+			if( c.inFlight.empty() ) return;
+			f = c.inFlight.front();
+			c.inFlight.pop_front();
+		}
+		// Run fails when no rule fires. It still counts as answered.
+		std::string result;
+		bool success = c.client->endExecute(f.cmdId, result);
+		c.latencies[f.op].push_back( elapsed_us(f.scheduled) );
+		if( !success && (f.op != OpRun) ) ++c.failed[f.op];
+	}
+}
+
+
+/**
+ * Prints the throughput and latency percentiles of every operation,
+ * and writes the JSON report if requested
+ * @param conns   The connections
+ * @param elapsed Length of the run, until the last response arrived, in seconds
+ */
+void report(std::vector<Connection>& conns, double elapsed){
+	std::string json = "{\n";
+	char buf[512];
+	snprintf(buf, sizeof(buf), "  \"connections\": %lu,\n  \"target_rate\": %.1f,\n  \"duration\": %.3f,\n"
+		"  \"elapsed\": %.3f,\n  \"operations\": {", connections, rate, duration, elapsed);
+	json+= buf;
+
+	size_t totalSent = 0, totalDone = 0;
+	printf("%-8s %9s %7s %10s %10s %10s %10s %10s\n", "op", "sent", "failed", "ops/s", "p50", "p99", "p99.9", "max");
+	for(size_t op = 0; op < OpCount; ++op){
+		size_t sent = 0, failed = 0;
+		std::vector<double> samples;
+		for(Connection& c : conns){
+			sent+= c.sent[op];
+			failed+= c.failed[op];
+			samples.insert(samples.end(), c.latencies[op].begin(), c.latencies[op].end());
+		}
+		if(sent < 1) continue;
+		std::sort(samples.begin(), samples.end());
+		double throughput = samples.size() / elapsed;
+		totalSent+= sent;
+		totalDone+= samples.size();
+
+		double p50 = percentile(samples, 0.5), p99 = percentile(samples, 0.99);
+		double p999 = percentile(samples, 0.999), max = percentile(samples, 1);
+		printf("%-8s %9lu %7lu %10.1f %10.1f %10.1f %10.1f %10.1f  (us)\n", opNames[op],
+			sent, failed, throughput, p50, p99, p999, max);
+		snprintf(buf, sizeof(buf), "%s\n    \"%s\": {\"sent\": %lu, \"completed\": %lu, \"failed\": %lu, "
+			"\"throughput\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+			(totalSent == sent) ? "" : ",", opNames[op], sent, samples.size(), failed,
+			throughput, p50, p99, p999, max);
+		json+= buf;
+	}
+	printf("total    %9lu %7s %10.1f\n", totalSent, "", totalDone / elapsed);
+	snprintf(buf, sizeof(buf), "\n  },\n  \"sent\": %lu,\n  \"completed\": %lu,\n  \"throughput\": %.1f\n}\n",
+		totalSent, totalDone, totalDone / elapsed);
+	json+= buf;
+
+	if( jsonPath.empty() ) return;
+	if(jsonPath == "-"){
+		fputs(json.c_str(), stdout);
+		return;
+	}
+	FILE* f = fopen(jsonPath.c_str(), "w");
+	if(!f){
+		fprintf(stderr, "Can't write %s\n", jsonPath.c_str());
+		return;
+	}
+	fputs(json.c_str(), f);
+	fclose(f);
+}
+
+
+/**
+ * Returns the time elapsed since start in microseconds
+ * @param  start The reference time point
+ * @return       Elapsed time in microseconds
+ */
+static inline double elapsed_us(const Clock::time_point& start){
+	return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+
+/**
+ * Returns the given percentile of sorted samples
+ * @param  sorted The samples, sorted
+ * @param  p      The percentile, between 0 and 1
+ * @return        The percentile, or 0 if there are no samples
+ */
+static inline double percentile(const std::vector<double>& sorted, double p){
+	if( sorted.empty() ) return 0;
+	return sorted[ (size_t)(p * (sorted.size() - 1)) ];
+}
@@ -0,0 +1,389 @@
+/** @file main.cpp
+* @author Mauricio Matamoros
+*
+* Anchor point (main function) for the CLIPS engine microbenchmark.
+* Measures libclips60 directly, without the server in the way:
+* assert (parsed and built with FactBuilder) and retract rates, join-heavy rule firing (cross products and
+* negated conditional elements), reset with large deffacts, load time of
+* large .clp files and the overhead of capturing output with QueryRouter.
+* Every workload runs at growing sizes. Results are printed as a table
+* and, optionally, written as JSON.
+*
+*/
+
+/** @cond */
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+/** @endcond */
+
+#include "clipswrapper/clipswrapper.h"
+#include "clipswrapper/queryrouter.h"
+#include "clipswrapper/factbuilder.h"
+
+extern "C" {
+	#include "clips/clips.h"
+}
+
+/* ** ********************************************************
+* Typedefs
+* *** *******************************************************/
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Result of a benchmark at one size
+ */
+struct Result{
+	std::string name;
+	size_t size;
+	/**
+	 * Best time of all repetitions, in seconds
+	 */
+	double seconds;
+	/**
+	 * Operations performed per run
+	 */
+	size_t ops;
+	/**
+	 * What an operation is
+	 */
+	std::string unit;
+};
+
+/**
+ * A benchmark: sets the engine up for the given size (not measured)
+ * and returns the function to measure, which returns the number of
+ * operations it performed
+ */
+typedef std::function<std::function<size_t()>(size_t size)> Benchmark;
+
+
+/* ** ********************************************************
+* Global variables
+* *** *******************************************************/
+/**
+ * Multiplies the sizes of every workload
+ */
+size_t scale = 1;
+
+/**
+ * Number of times each measurement is repeated. The best time is kept.
+ */
+size_t repetitions = 3;
+
+/**
+ * Only benchmarks whose name contains this string are run
+ */
+std::string filter;
+
+/**
+ * Path of the JSON report. Empty disables it. - writes it to stdout.
+ */
+std::string jsonPath;
+
+/**
+ * Results of all benchmarks
+ */
+std::vector<Result> results;
+
+
+/* ** ********************************************************
+* Prototypes
+* *** *******************************************************/
+int main(int argc, char **argv);
+bool parseArgs(int argc, char **argv);
+void measure(const std::string& name, const std::string& unit,
+	std::vector<size_t> sizes, const Benchmark& benchmark);
+void writeJson();
+static std::string temp_file(const std::string& name);
+
+/* ** ********************************************************
+* C-compatible Prototypes
+* *** *******************************************************/
+extern "C" {
+	void UserFunctions();
+}
+
+
+/* ** ********************************************************
+* Main (program anchor)
+* *** *******************************************************/
+/**
+ * Program anchor
+ * @param  argc The number of arguments to the program
+ * @param  argv The arguments passed to the program
+ * @return      The program exit code
+ */
+int main(int argc, char **argv){
+	if( !parseArgs(argc, argv) ) return -1;
+
+	clips::initialize();
+	clips::unwatch(clips::WatchItem::Compilations);
+	// Same captured names as the server
+	clips::QueryRouter& qr = clips::QueryRouter::getInstance();
+	qr.addLogicalName("wdisplay");
+	qr.addLogicalName("wtrace");
+	qr.addLogicalName("stdout");
+
+	printf("%-16s %10s %12s %14s %s\n", "benchmark", "size", "time (ms)", "rate", "unit/s");
+
+	// AssertString of ordered facts
+	measure("assert", "facts", {2500, 10000, 40000}, [](size_t n){
+		clips::clear();
+		return [n](){
+			char buf[64];
+			for(size_t i = 0; i < n; ++i){
+				snprintf(buf, sizeof(buf), "(item %lu %lu)", i, i % 97);
+				AssertString(buf);
+			}
+			clips::clear();
+			return n;
+		};
+	});
+
+	// The same facts built with FactBuilder, bypassing the parser
+	measure("assert-builder", "facts", {2500, 10000, 40000}, [](size_t n){
+		clips::clear();
+		return [n](){
+			clips::FactBuilder builder("item");
+			for(size_t i = 0; i < n; ++i){
+				builder.clear();
+				builder.append( (long)i ).append( (long)(i % 97) ).assertFact();
+			}
+			clips::clear();
+			return n;
+		};
+	});
+
+	// Retract of facts asserted during setup
+	measure("retract", "facts", {2500, 10000, 40000}, [](size_t n){
+		clips::clear();
+		auto facts = std::make_shared<std::vector<void*>>();
+		char buf[64];
+		for(size_t i = 0; i < n; ++i){
+			snprintf(buf, sizeof(buf), "(item %lu %lu)", i, i % 97);
+			facts->push_back( AssertString(buf) );
+		}
+		return [facts](){
+			for(void* f : *facts) Retract(f);
+			return facts->size();
+		};
+	});
+
+	// Every (a) joins every (b): n*n activations
+	measure("join-cross", "firings", {100, 200, 400}, [](size_t n){
+		clips::clear();
+		clips::sendCommand("(defrule cross (a ?x) (b ?y) =>)");
+		return [n](){
+			char buf[64];
+			for(size_t i = 0; i < n; ++i){
+				snprintf(buf, sizeof(buf), "(a %lu)", i);
+				AssertString(buf);
+				snprintf(buf, sizeof(buf), "(b %lu)", i);
+				AssertString(buf);
+			}
+			size_t fired = clips::run();
+			clips::reset();
+			return fired;
+		};
+	});
+
+	// Every (a) is checked against all (b): n/2 activations, n*n tests
+	measure("join-negated", "facts", {1000, 2000, 4000}, [](size_t n){
+		clips::clear();
+		clips::sendCommand("(defrule lonely (a ?x) (not (b ?x)) =>)");
+		return [n](){
+			char buf[64];
+			for(size_t i = 0; i < n; i+= 2){
+				snprintf(buf, sizeof(buf), "(b %lu)", i);
+				AssertString(buf);
+			}
+			for(size_t i = 0; i < n; ++i){
+				snprintf(buf, sizeof(buf), "(a %lu)", i);
+				AssertString(buf);
+			}
+			clips::run();
+			clips::reset();
+			return n;
+		};
+	});
+
+	// Reset retracts the facts of the previous reset and asserts the deffacts
+	measure("reset-deffacts", "facts", {1000, 4000, 16000}, [](size_t n){
+		std::string path = temp_file("deffacts.clp");
+		std::ofstream clp(path);
+		clp << "(deffacts clipsbench-facts" << std::endl;
+		for(size_t i = 0; i < n; ++i)
+			clp << "  (item " << i << " " << (i % 97) << ")" << std::endl;
+		clp << ")" << std::endl;
+		clp.close();
+		clips::clear();
+		clips::load(path);
+		unlink( path.c_str() );
+		clips::reset();
+		return [n](){
+			clips::reset();
+			return n;
+		};
+	});
+
+	// Rules joining two patterns each, sharing their first pattern
+	measure("load-clp", "rules", {250, 1000, 4000}, [](size_t n){
+		std::string path = temp_file("rules.clp");
+		std::ofstream clp(path);
+		for(size_t i = 0; i < n; ++i){
+			clp << "(defrule rule-" << i << std::endl;
+			clp << "  (item ?x " << (i % 97) << ")" << std::endl;
+			clp << "  (tag ?x " << i << " ?y)" << std::endl;
+			clp << "  =>" << std::endl;
+			clp << "  (assert (out " << i << " ?x ?y)))" << std::endl;
+		}
+		clp.close();
+		return [path, n](){
+			clips::clear();
+			clips::load(path);
+			return n;
+		};
+	});
+
+	// Baseline of query-capture: the command of size 0, without the router
+	measure("command", "commands", {0}, [](size_t){
+		clips::clear();
+		return [](){
+			for(size_t i = 0; i < 100; ++i)
+				clips::sendCommand("(printout t)");
+			return (size_t)100;
+		};
+	});
+
+	// Output of the given size captured by QueryRouter, per query.
+	// The router echoes what it captures to stdout, sent to /dev/null here.
+	measure("query-capture", "queries", {0, 16, 64, 256}, [](size_t bytes){
+		clips::clear();
+		auto q = std::make_shared<std::string>("(printout t)");
+		if(bytes > 0) *q = "(printout t \"" + std::string(bytes, 'x') + "\")";
+		return [q](){
+			std::string result;
+			fflush(stdout);
+			int console = dup(STDOUT_FILENO);
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, STDOUT_FILENO);
+			for(size_t i = 0; i < 100; ++i)
+				clips::query(*q, result);
+			fflush(stdout);
+			dup2(console, STDOUT_FILENO);
+			close(console);
+			close(null);
+			return (size_t)100;
+		};
+	});
+
+	writeJson();
+	return 0;
+}
+
+
+/* ** ********************************************************
+* Function definitions
+* *** *******************************************************/
+bool parseArgs(int argc, char **argv){
+	for(int i = 1; i < argc; ++i){
+		if (!strcmp(argv[i], "-h") || (i+1 >= argc) ){
+			printf("Usage: %s [-s scale] [-n repetitions] [-f filter] [-j json_file]\n", argv[0]);
+			printf("    -s  Multiplies the sizes of every workload\n");
+			printf("    -f  Runs only the benchmarks whose name contains filter\n");
+			printf("    -j  Writes a JSON report to the file (- for stdout)\n");
+			return false;
+		}
+		else if (!strcmp(argv[i],"-s")) scale       = std::stoul(argv[++i]);
+		else if (!strcmp(argv[i],"-n")) repetitions = std::stoul(argv[++i]);
+		else if (!strcmp(argv[i],"-f")) filter      = argv[++i];
+		else if (!strcmp(argv[i],"-j")) jsonPath    = argv[++i];
+	}
+	return (scale > 0) && (repetitions > 0);
+}
+
+
+/**
+ * Runs a benchmark at every size, keeping the best of the repetitions
+ * @param name      Name of the benchmark
+ * @param unit      What an operation is
+ * @param sizes     Sizes of the workload, multiplied by scale
+ * @param benchmark The benchmark
+ */
+void measure(const std::string& name, const std::string& unit,
+	std::vector<size_t> sizes, const Benchmark& benchmark){
+	if( !filter.empty() && (name.find(filter) == std::string::npos) ) return;
+
+	for(size_t size : sizes){
+		size*= scale;
+		Result r = { name, size, 0, 0, unit };
+		for(size_t i = 0; i < repetitions; ++i){
+			std::function<size_t()> run = benchmark(size);
+			Clock::time_point start = Clock::now();
+			r.ops = run();
+			double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+			if( (i == 0) || (seconds < r.seconds) ) r.seconds = seconds;
+		}
+		printf("%-16s %10lu %12.3f %14.1f %s\n", name.c_str(), size,
+			r.seconds * 1000, r.ops / r.seconds, unit.c_str());
+		fflush(stdout);
+		results.push_back(r);
+	}
+	clips::clear();
+}
+
+
+/**
+ * Writes the results as a JSON array, if requested
+ */
+void writeJson(){
+	if( jsonPath.empty() ) return;
+	std::string json = "[\n";
+	char buf[256];
+	for(size_t i = 0; i < results.size(); ++i){
+		const Result& r = results[i];
+		snprintf(buf, sizeof(buf), "  {\"benchmark\": \"%s\", \"size\": %lu, \"seconds\": %.6f, "
+			"\"ops\": %lu, \"rate\": %.1f, \"unit\": \"%s\"}%s\n", r.name.c_str(), r.size, r.seconds,
+			r.ops, r.ops / r.seconds, r.unit.c_str(), (i + 1 < results.size()) ? "," : "");
+		json+= buf;
+	}
+	json+= "]\n";
+
+	if(jsonPath == "-"){
+		fputs(json.c_str(), stdout);
+		return;
+	}
+	FILE* f = fopen(jsonPath.c_str(), "w");
+	if(!f){
+		fprintf(stderr, "Can't write %s\n", jsonPath.c_str());
+		return;
+	}
+	fputs(json.c_str(), f);
+	fclose(f);
+}
+
+
+/**
+ * Required by CLIPS. The benchmark defines no user functions.
+ */
+void UserFunctions(){
+}
+
+
+/**
+ * Returns the path of a temporary file private to this process
+ * @param  name The name of the file
+ * @return      The path
+ */
+static std::string temp_file(const std::string& name){
+	return "/tmp/clipsbench." + std::to_string(getpid()) + "." + name;
+}
@@ -0,0 +1,188 @@
+/** @file main.cpp
+* @author Mauricio Matamoros
+*
+* Anchor point (main function) for the latency benchmark.
+* Measures the round-trip time of request/response commands
+* (assert + run + query) sent to a running clipsserver.
+*
+*/
+
+/** @cond */
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+/** @endcond */
+
+#include "clipsclient/clipsclient.h"
+
+/* ** ********************************************************
+* Typedefs
+* *** *******************************************************/
+typedef std::chrono::steady_clock Clock;
+
+
+/* ** ********************************************************
+* Global variables
+* *** *******************************************************/
+/**
+ * Client used to talk to clipsserver
+ */
+std::shared_ptr<ClipsClient> clientPtr;
+
+/**
+ * Server address
+ */
+std::string address = "127.0.0.1";
+
+/**
+ * Server port
+ */
+uint16_t port = 5000;
+
+/**
+ * Path of the server's local socket. When set, it is used instead of TCP.
+ */
+std::string localPath;
+
+/**
+ * When set, traffic goes through shared memory set up over localPath
+ */
+bool useShm = false;
+
+/**
+ * Number of request/response cycles to measure
+ */
+size_t iterations = 1000;
+
+/**
+ * Idle time between cycles in milliseconds. Makes every cycle
+ * an idle-to-busy transition on the server.
+ */
+size_t gap = 5;
+
+
+/* ** ********************************************************
+* Prototypes
+* *** *******************************************************/
+int main(int argc, char **argv);
+bool parseArgs(int argc, char **argv);
+void report(const std::string& name, std::vector<double>& samples);
+static inline double elapsed_us(const Clock::time_point& start);
+static inline void sleep_ms(size_t ms);
+
+
+/* ** ********************************************************
+* Main (program anchor)
+* *** *******************************************************/
+/**
+ * Program anchor
+ * @param  argc The number of arguments to the program
+ * @param  argv The arguments passed to the program
+ * @return      The program exit code
+ */
+int main(int argc, char **argv){
+	if( !parseArgs(argc, argv) ) return -1;
+
+	clientPtr = ClipsClient::create();
+	bool connected;
+	if( localPath.empty() ) connected = clientPtr->connect(address, port);
+	else if(useShm) connected = clientPtr->connectShm(localPath);
+	else connected = clientPtr->connectLocal(localPath);
+	if(!connected){
+		if( localPath.empty() ) fprintf(stderr, "Could not connect to CLIPS on %s:%u.\n", address.c_str(), port);
+		else fprintf(stderr, "Could not connect to CLIPS on %s.\n", localPath.c_str());
+		fprintf(stderr, "Run the server and pass the right parameters.\n");
+		return -1;
+	}
+	clientPtr->clear();
+	clientPtr->execute("raw", "(deftemplate bench (slot id))");
+	clientPtr->reset();
+
+	std::vector<double> tAssert, tRun, tQuery, tCycle;
+	printf("Running %lu cycles with %lums idle gap...\n", iterations, gap);
+	for(size_t i = 0; i < iterations; ++i){
+		std::string result;
+		Clock::time_point start = Clock::now(), t;
+
+		t = Clock::now();
+		clientPtr->execute("assert", "(bench (id " + std::to_string(i) + "))");
+		tAssert.push_back( elapsed_us(t) );
+
+		t = Clock::now();
+		clientPtr->execute("run", "-1");
+		tRun.push_back( elapsed_us(t) );
+
+		t = Clock::now();
+		clientPtr->query("(printout t ok crlf)", result);
+		tQuery.push_back( elapsed_us(t) );
+
+		tCycle.push_back( elapsed_us(start) );
+		if(gap) sleep_ms(gap);
+	}
+
+	printf("%-8s %10s %10s %10s %10s %10s\n", "op", "min", "p50", "p90", "p99", "max");
+	report("assert", tAssert);
+	report("run",    tRun);
+	report("query",  tQuery);
+	report("cycle",  tCycle);
+
+	clientPtr->disconnect();
+	return 0;
+}
+
+
+/* ** ********************************************************
+* Function definitions
+* *** *******************************************************/
+bool parseArgs(int argc, char **argv){
+	for(int i = 1; i < argc; ++i){
+		if (!strcmp(argv[i], "-h") || (i+1 >= argc) ){
+			printf("Usage: %s [-a address] [-p port] [-u unix_socket_path] [-m unix_socket_path] [-n iterations] [-g gap_ms]\n", argv[0]);
+			return false;
+		}
+		else if (!strcmp(argv[i],"-a")) address    = argv[++i];
+		else if (!strcmp(argv[i],"-p")) port       = std::stoi(argv[++i]);
+		else if (!strcmp(argv[i],"-u")) localPath  = argv[++i];
+		else if (!strcmp(argv[i],"-m")){localPath  = argv[++i]; useShm = true;}
+		else if (!strcmp(argv[i],"-n")) iterations = std::stoul(argv[++i]);
+		else if (!strcmp(argv[i],"-g")) gap        = std::stoul(argv[++i]);
+	}
+	return iterations > 0;
+}
+
+
+/**
+ * Prints percentiles of the given samples (in microseconds)
+ * @param name    Name of the measured operation
+ * @param samples Measured round-trip times in microseconds
+ */
+void report(const std::string& name, std::vector<double>& samples){
+	std::sort(samples.begin(), samples.end());
+	auto pct = [&](double p){ return samples[ (size_t)(p * (samples.size() - 1)) ]; };
+	printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f  (us)\n", name.c_str(),
+		samples.front(), pct(0.5), pct(0.9), pct(0.99), samples.back());
+}
+
+
+/**
+ * Returns the time elapsed since start in microseconds
+ * @param  start The reference time point
+ * @return       Elapsed time in microseconds
+ */
+static inline double elapsed_us(const Clock::time_point& start){
+	return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+
+/**
+ * Sleeps the current execution thread for the specified amount of time
+ * @param ms The amount of time in milliseconds
+ */
+static inline void sleep_ms(size_t ms){
+	std::this_thread::sleep_for( std::chrono::milliseconds(ms) );
+}
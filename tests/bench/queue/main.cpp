@@ -0,0 +1,134 @@
+/** @file main.cpp
+* @author Mauricio Matamoros
+*
+* Anchor point (main function) for the ingress queue microbenchmark.
+* Compares sync_queue and mpsc_queue with 1, 4 and 16 producers
+* feeding a single consumer.
+*
+*/
+
+/** @cond */
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+/** @endcond */
+
+#include "sync_queue.h"
+#include "mpsc_queue.h"
+
+/* ** ********************************************************
+* Typedefs
+* *** *******************************************************/
+typedef std::chrono::steady_clock Clock;
+typedef std::shared_ptr<size_t> Item;
+
+
+/* ** ********************************************************
+* Global variables
+* *** *******************************************************/
+/**
+ * Number of elements transferred per run
+ */
+size_t total = 1000000;
+
+/**
+ * Shared item. Copies of a shared_ptr mimic the cost of passing
+ * TcpMessage pointers around without measuring the allocator.
+ */
+Item item = std::make_shared<size_t>(0);
+
+
+/* ** ********************************************************
+* Prototypes
+* *** *******************************************************/
+int main(int argc, char **argv);
+template<class Q> double measure(Q& queue, size_t producers, bool bulk);
+template<class Q> void drain(Q& queue, size_t count, bool bulk);
+
+
+/* ** ********************************************************
+* Main (program anchor)
+* *** *******************************************************/
+/**
+ * Program anchor
+ * @param  argc The number of arguments to the program
+ * @param  argv The arguments passed to the program
+ * @return      The program exit code
+ */
+int main(int argc, char **argv){
+	if( (argc > 2) && !strcmp(argv[1], "-n") )
+		total = std::stoul(argv[2]);
+
+	printf("Transferring %lu elements per run (Mops/s, higher is better)\n", total);
+	printf("%-10s %12s %12s %12s %12s\n", "producers", "sync_queue", "mpsc_queue", "sync bulk", "mpsc bulk");
+	for(size_t producers : {1, 4, 16}){
+		sync_queue<Item> sq, sbq;
+		mpsc_queue<Item> mq(65536), mbq(65536);
+		double tsq  = measure(sq,  producers, false);
+		double tmq  = measure(mq,  producers, false);
+		double tsbq = measure(sbq, producers, true);
+		double tmbq = measure(mbq, producers, true);
+		printf("%-10lu %12.2f %12.2f %12.2f %12.2f\n", producers,
+			total / tsq / 1e6, total / tmq / 1e6, total / tsbq / 1e6, total / tmbq / 1e6);
+	}
+	return 0;
+}
+
+
+/* ** ********************************************************
+* Function definitions
+* *** *******************************************************/
+/**
+ * Measures the time required to transfer total elements from the
+ * given number of producers to a single consumer
+ * @param  queue     The queue to measure
+ * @param  producers The number of producer threads
+ * @param  bulk      When true the consumer drains with consumeAll()
+ * @return           The elapsed time in seconds
+ */
+template<class Q>
+double measure(Q& queue, size_t producers, bool bulk){
+	std::vector<std::thread> threads;
+	size_t perProducer = total / producers;
+	size_t count = perProducer * producers;
+
+	Clock::time_point start = Clock::now();
+	for(size_t i = 0; i < producers; ++i){
+		threads.push_back( std::thread([&queue, perProducer](){
+			for(size_t j = 0; j < perProducer; ++j)
+				queue.produce(item);
+		}));
+	}
+	drain(queue, count, bulk);
+	for(auto& t : threads) t.join();
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+/**
+ * Consumes the given number of elements from the queue
+ * @param queue The queue to drain
+ * @param count The number of elements to consume
+ * @param bulk  When true the consumer drains with consumeAll()
+ */
+template<class Q>
+void drain(Q& queue, size_t count, bool bulk){
+	if(!bulk){
+		for(size_t i = 0; i < count; ++i)
+			queue.consume();
+		return;
+	}
+
+	std::vector<Item> items;
+	items.reserve(4096);
+	while(count > 0){
+		size_t n = queue.consumeAll(items, 4096);
+		if(n < 1) std::this_thread::yield();
+		count-= n;
+		items.clear();
+	}
+}